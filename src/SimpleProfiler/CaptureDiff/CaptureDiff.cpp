@@ -0,0 +1,624 @@
+// CaptureDiff.cpp : Compares profiler captures and reports the methods that got slower or faster.
+// Usage: CaptureDiff [options] <before.csv> <after.csv>
+//        CaptureDiff [options] <baseline.csv...> --vs <candidate.csv...>
+//
+// Takes MonoProfilerOutput.csv or MonoProfilerOutputByMethod.csv files. Methods are matched by full name,
+// so captures from different runs can be compared even though the methods live at other addresses.
+// Every capture is scaled to its duration, so captures of different lengths can be compared too.
+// With several captures on each side the changes also have to pass a Welch t-test, with one capture
+// on each side only the thresholds apply.
+// The exit code is 1 if any change selected by --fail-on regressed, which lets CI use it as a performance gate.
+//
+// The files are streamed one chunk at a time and every row is joined to its method through one hash lookup,
+// so captures with hundreds of thousands of rows only take as long as reading them.
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Hands out the lines of a file without loading all of it
+class LineReader
+{
+public:
+	explicit LineReader(const char* path)
+		: file(std::fopen(path, "rb"))
+	{
+		buffer.resize(chunk_size);
+	}
+
+	~LineReader()
+	{
+		if (file)
+			std::fclose(file);
+	}
+
+	bool is_open() const { return file != nullptr; }
+
+	// The returned line stays valid until the next call
+	bool next(std::string_view& line)
+	{
+		while (true)
+		{
+			size_t end = std::string_view(buffer.data() + start, filled - start).find('\n');
+			if (end != std::string_view::npos)
+			{
+				line = std::string_view(buffer.data() + start, end);
+				start += end + 1;
+				if (!line.empty() && line.back() == '\r')
+					line.remove_suffix(1);
+				return true;
+			}
+			if (eof)
+			{
+				if (start == filled)
+					return false;
+				line = std::string_view(buffer.data() + start, filled - start);
+				start = filled;
+				return true;
+			}
+
+			// Keep the partial line and read more after it
+			std::copy(buffer.begin() + start, buffer.begin() + filled, buffer.begin());
+			filled -= start;
+			start = 0;
+			if (filled == buffer.size())
+				buffer.resize(buffer.size() * 2);
+			size_t read = std::fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+			filled += read;
+			eof = read == 0;
+		}
+	}
+
+private:
+	static constexpr size_t chunk_size = 1 << 20;
+
+	FILE* file;
+	std::vector<char> buffer;
+	size_t start = 0;
+	size_t filled = 0;
+	bool eof = false;
+};
+
+// Splits a line written by the profiler. Quoted fields never contain quotes, the profiler replaces them
+// in method names (MethodNames) and thread names (ThreadRegistry::sanitize) before writing them.
+static void split_csv(std::string_view line, std::vector<std::string_view>& fields)
+{
+	fields.clear();
+	size_t i = 0;
+	while (i <= line.size())
+	{
+		if (i < line.size() && line[i] == '"')
+		{
+			size_t close = line.find('"', i + 1);
+			if (close == std::string_view::npos)
+				close = line.size();
+			fields.push_back(line.substr(i + 1, close - i - 1));
+			i = line.find(',', close);
+		}
+		else
+		{
+			size_t comma = line.find(',', i);
+			fields.push_back(line.substr(i, comma == std::string_view::npos ? std::string_view::npos : comma - i));
+			i = comma;
+		}
+		if (i == std::string_view::npos)
+			break;
+		i++;
+	}
+}
+
+template <typename T>
+static bool parse_number(std::string_view text, T& out)
+{
+	auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+	return ec == std::errc() && end == text.data() + text.size();
+}
+
+// Lets the method index be searched with the string_views from the reader, without a copy per row
+struct NameHash
+{
+	using is_transparent = void;
+	size_t operator()(std::string_view name) const { return std::hash<std::string_view>()(name); }
+};
+
+struct MethodTotals
+{
+	uint64_t calls = 0;
+	int64_t self_ns = 0;
+	uint64_t alloc_bytes = 0;
+};
+
+struct Capture
+{
+	std::string path;
+	int64_t duration_ns = 0;          // 0 if the file has no duration row
+	std::vector<MethodTotals> totals; // Indexed like MethodIndex::names, shorter if the last methods weren't in this capture
+};
+
+// Every method name seen in any capture
+struct MethodIndex
+{
+	std::unordered_map<std::string, uint32_t, NameHash, std::equal_to<>> ids;
+	std::vector<const std::string*> names;
+
+	uint32_t get(std::string_view name)
+	{
+		auto it = ids.find(name);
+		if (it != ids.end())
+			return it->second;
+		auto [inserted, _] = ids.emplace(std::string(name), static_cast<uint32_t>(names.size()));
+		names.push_back(&inserted->first);
+		return inserted->second;
+	}
+};
+
+static bool load_capture(const std::string& path, MethodIndex& index, Capture& capture)
+{
+	LineReader reader(path.c_str());
+	if (!reader.is_open())
+	{
+		std::cerr << "Could not open " << path << std::endl;
+		return false;
+	}
+	capture.path = path;
+
+	std::string_view line;
+	std::vector<std::string_view> fields;
+	if (!reader.next(line))
+	{
+		std::cerr << path << " is empty" << std::endl;
+		return false;
+	}
+
+	// Columns are looked up by name, so both output files and older captures with fewer columns work
+	split_csv(line, fields);
+	auto column = [&](std::string_view name) {
+		auto it = std::find(fields.begin(), fields.end(), name);
+		return it == fields.end() ? -1 : static_cast<int>(it - fields.begin());
+	};
+	int calls_column = column("Call count");
+	int name_column = column("Method name");
+	int self_column = column("Corrected self runtime (ns)");
+	if (self_column < 0)
+		self_column = column("Self runtime (ns)");
+	int alloc_column = column("Self allocation (bytes)");
+	if (calls_column < 0 || name_column < 0 || self_column < 0)
+	{
+		std::cerr << path << " is not a MonoProfilerOutput.csv or MonoProfilerOutputByMethod.csv file" << std::endl;
+		return false;
+	}
+	size_t needed = static_cast<size_t>(std::max({ calls_column, name_column, self_column, alloc_column })) + 1;
+
+	while (reader.next(line))
+	{
+		split_csv(line, fields);
+		if (fields.size() == 2 && fields[0] == "Capture duration (ns)")
+		{
+			parse_number(fields[1], capture.duration_ns);
+			continue;
+		}
+		// Notes at the end of the file have a single column
+		if (fields.size() < needed)
+			continue;
+
+		MethodTotals row;
+		if (!parse_number(fields[calls_column], row.calls) || !parse_number(fields[self_column], row.self_ns)
+			|| (alloc_column >= 0 && !parse_number(fields[alloc_column], row.alloc_bytes)))
+			continue;
+
+		uint32_t id = index.get(fields[name_column]);
+		if (id >= capture.totals.size())
+			capture.totals.resize(id + 1);
+		MethodTotals& totals = capture.totals[id];
+		totals.calls += row.calls;
+		totals.self_ns += row.self_ns;
+		totals.alloc_bytes += row.alloc_bytes;
+	}
+	return true;
+}
+
+// Regularized incomplete beta function, continued fraction from Numerical Recipes
+static double incomplete_beta(double a, double b, double x)
+{
+	if (x <= 0)
+		return 0;
+	if (x >= 1)
+		return 1;
+	if (x > (a + 1) / (a + b + 2))
+		return 1 - incomplete_beta(b, a, 1 - x);
+
+	const double tiny = 1e-300;
+	double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log(1 - x)) / a;
+	double c = 1, d = 1 - (a + b) * x / (a + 1);
+	d = 1 / (std::abs(d) < tiny ? tiny : d);
+	double result = d;
+	for (int m = 1; m <= 200; m++)
+	{
+		for (int step = 0; step < 2; step++)
+		{
+			double numerator = step == 0
+				? m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m))
+				: -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+			d = 1 + numerator * d;
+			d = 1 / (std::abs(d) < tiny ? tiny : d);
+			c = 1 + numerator / c;
+			if (std::abs(c) < tiny)
+				c = tiny;
+			result *= c * d;
+			if (step == 1 && std::abs(c * d - 1) < 1e-12)
+				return front * result;
+		}
+	}
+	return front * result;
+}
+
+struct Sample
+{
+	double mean = 0;
+	double variance = 0; // Of the samples, not of the mean
+	size_t count = 0;
+};
+
+static Sample summarize(const std::vector<double>& values)
+{
+	Sample sample;
+	sample.count = values.size();
+	if (values.empty())
+		return sample;
+	for (double value : values)
+		sample.mean += value;
+	sample.mean /= values.size();
+	if (values.size() > 1)
+	{
+		for (double value : values)
+			sample.variance += (value - sample.mean) * (value - sample.mean);
+		sample.variance /= values.size() - 1;
+	}
+	return sample;
+}
+
+// Two sided p-value of Welch's t-test. NaN if either side has fewer than two captures.
+static double welch_p_value(const Sample& before, const Sample& after)
+{
+	if (before.count < 2 || after.count < 2)
+		return NAN;
+	double before_error = before.variance / before.count;
+	double after_error = after.variance / after.count;
+	double error = before_error + after_error;
+	if (error <= 0)
+		return before.mean == after.mean ? 1.0 : 0.0;
+
+	double t = (after.mean - before.mean) / std::sqrt(error);
+	double df = error * error / (before_error * before_error / (before.count - 1) + after_error * after_error / (after.count - 1));
+	return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+enum Metric
+{
+	SelfTime,
+	SelfPerCall,
+	Calls,
+	Allocation,
+	MetricCount,
+};
+
+static const char* metric_names[MetricCount] = { "self", "per_call", "calls", "alloc" };
+static const char* metric_labels[MetricCount] = { "Self ms/s", "Self us/call", "Calls/s", "Alloc KB/s" };
+
+struct Options
+{
+	double threshold = 10;     // Minimum change in %
+	double min_self_ms = 0.5;  // Per second of capture
+	double min_calls = 10;     // Per second of capture
+	double min_alloc_kb = 16;  // Per second of capture
+	double confidence = 95;    // In %, only used with several captures on each side
+	bool fail_on[MetricCount] = { true, false, false, false };
+	uint32_t top = 30;
+	std::string csv_path;
+};
+
+struct Change
+{
+	uint32_t method;
+	Metric metric;
+	double before;
+	double after;
+	double p_value; // NaN without a t-test
+};
+
+// Value of a metric in one capture. Returns false if the capture says nothing about it, i.e. no calls for per call times.
+static bool metric_value(const Capture& capture, uint32_t method, Metric metric, bool per_second, double& out)
+{
+	MethodTotals totals = method < capture.totals.size() ? capture.totals[method] : MethodTotals();
+	double seconds = per_second ? capture.duration_ns / 1e9 : 1.0;
+	switch (metric)
+	{
+	case SelfTime:
+		out = totals.self_ns / 1e6 / seconds;
+		return true;
+	case SelfPerCall:
+		out = totals.self_ns / 1e3 / std::max<double>(totals.calls, 1);
+		return totals.calls > 0;
+	case Calls:
+		out = totals.calls / seconds;
+		return true;
+	default:
+		out = totals.alloc_bytes / 1024.0 / seconds;
+		return true;
+	}
+}
+
+// A change is reported when it is large enough in relative and absolute terms, and significant when there is a test
+static bool is_meaningful(const Options& options, Metric metric, const Sample& before, const Sample& after,
+	const Sample& before_self, const Sample& after_self, const Sample& before_calls, const Sample& after_calls, double p_value)
+{
+	double low = std::min(before.mean, after.mean);
+	double high = std::max(before.mean, after.mean);
+	if (high <= 0 || (low > 0 && (high - low) / low * 100 < options.threshold))
+		return false;
+
+	switch (metric)
+	{
+	case SelfTime:
+		if (high < options.min_self_ms)
+			return false;
+		break;
+	case SelfPerCall:
+		// Methods that are rarely called or cheap overall have noisy per call times that don't matter
+		if (before.count == 0 || after.count == 0 || std::min(before_calls.mean, after_calls.mean) < options.min_calls
+			|| std::max(before_self.mean, after_self.mean) < options.min_self_ms)
+			return false;
+		break;
+	case Calls:
+		if (high < options.min_calls)
+			return false;
+		break;
+	default:
+		if (high < options.min_alloc_kb)
+			return false;
+		break;
+	}
+
+	return std::isnan(p_value) || p_value < 1 - options.confidence / 100;
+}
+
+static int usage()
+{
+	std::cerr << "Usage: CaptureDiff [options] <before.csv> <after.csv>\n"
+		"       CaptureDiff [options] <baseline.csv...> --vs <candidate.csv...>\n"
+		"Options:\n"
+		"  --threshold <percent>     Smallest change that is reported (10)\n"
+		"  --min-self-ms <ms/s>      Ignore self time changes of methods below this (0.5)\n"
+		"  --min-calls <calls/s>     Ignore call count changes of methods below this (10)\n"
+		"  --min-alloc-kb <KB/s>     Ignore allocation changes of methods below this (16)\n"
+		"  --confidence <percent>    Confidence of the t-test with several captures per side (95)\n"
+		"  --fail-on <metrics>       Regressions that fail the gate: any of self,per_call,calls,alloc separated\n"
+		"                            by commas, or any, or none (self)\n"
+		"  --top <count>             Rows printed per section (30)\n"
+		"  --csv <path>              Also write every reported change to a CSV file\n"
+		"Exit code: 0 without failing regressions, 1 with, 2 on errors" << std::endl;
+	return 2;
+}
+
+static bool parse_fail_on(std::string_view value, bool (&fail_on)[MetricCount])
+{
+	std::fill(std::begin(fail_on), std::end(fail_on), value == "any");
+	if (value == "any" || value == "none")
+		return true;
+	while (!value.empty())
+	{
+		size_t comma = value.find(',');
+		std::string_view name = value.substr(0, comma);
+		auto it = std::find(std::begin(metric_names), std::end(metric_names), name);
+		if (it == std::end(metric_names))
+			return false;
+		fail_on[it - std::begin(metric_names)] = true;
+		value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+	}
+	return true;
+}
+
+static std::string format_change(double before, double after)
+{
+	if (before == 0)
+		return "new";
+	if (after == 0)
+		return "gone";
+	char text[32];
+	std::snprintf(text, sizeof(text), "%+.1f%%", (after - before) / before * 100);
+	return text;
+}
+
+static void print_section(const char* title, std::vector<Change>& changes, const MethodIndex& index, uint32_t top)
+{
+	std::cout << "\n" << title << " (" << changes.size() << ")\n";
+	if (changes.empty())
+		return;
+
+	// Largest absolute change first within every metric
+	std::stable_sort(changes.begin(), changes.end(), [](const Change& a, const Change& b) {
+		if (a.metric != b.metric)
+			return a.metric < b.metric;
+		return std::abs(a.after - a.before) > std::abs(b.after - b.before);
+	});
+
+	char line[256];
+	std::snprintf(line, sizeof(line), "  %-13s %12s %12s %9s %8s  %s\n", "Metric", "Before", "After", "Change", "p", "Method");
+	std::cout << line;
+	uint32_t printed = 0;
+	for (size_t i = 0; i < changes.size(); i++)
+	{
+		const Change& it = changes[i];
+		if (i > 0 && changes[i - 1].metric != it.metric)
+			printed = 0;
+		if (printed++ >= top)
+			continue;
+		char p[16] = "-";
+		if (!std::isnan(it.p_value))
+			std::snprintf(p, sizeof(p), "%.4f", it.p_value);
+		std::snprintf(line, sizeof(line), "  %-13s %12.3f %12.3f %9s %8s  ", metric_labels[it.metric], it.before, it.after,
+			format_change(it.before, it.after).c_str(), p);
+		std::cout << line << *index.names[it.method] << "\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	std::vector<std::string> before_paths, after_paths;
+	bool after_vs = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (arg == "--vs")
+		{
+			after_vs = true;
+			continue;
+		}
+		if (arg.size() < 2 || arg.substr(0, 2) != "--")
+		{
+			(after_vs ? after_paths : before_paths).emplace_back(arg);
+			continue;
+		}
+		if (i + 1 >= argc)
+			return usage();
+		std::string_view value = argv[++i];
+
+		bool ok = true;
+		if (arg == "--threshold")
+			ok = parse_number(value, options.threshold) && options.threshold >= 0;
+		else if (arg == "--min-self-ms")
+			ok = parse_number(value, options.min_self_ms);
+		else if (arg == "--min-calls")
+			ok = parse_number(value, options.min_calls);
+		else if (arg == "--min-alloc-kb")
+			ok = parse_number(value, options.min_alloc_kb);
+		else if (arg == "--confidence")
+			ok = parse_number(value, options.confidence) && options.confidence > 0 && options.confidence < 100;
+		else if (arg == "--fail-on")
+			ok = parse_fail_on(value, options.fail_on);
+		else if (arg == "--top")
+			ok = parse_number(value, options.top);
+		else if (arg == "--csv")
+			options.csv_path = value;
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			std::cerr << "Invalid argument " << arg << " " << value << std::endl;
+			return usage();
+		}
+	}
+
+	// Without --vs the first file is the baseline and the second one the candidate
+	if (!after_vs && before_paths.size() == 2)
+	{
+		after_paths.push_back(before_paths.back());
+		before_paths.pop_back();
+	}
+	if (before_paths.empty() || after_paths.empty())
+		return usage();
+
+	MethodIndex index;
+	std::vector<Capture> before(before_paths.size()), after(after_paths.size());
+	for (size_t i = 0; i < before_paths.size(); i++)
+		if (!load_capture(before_paths[i], index, before[i]))
+			return 2;
+	for (size_t i = 0; i < after_paths.size(); i++)
+		if (!load_capture(after_paths[i], index, after[i]))
+			return 2;
+
+	// Captures from before the duration row was added can only be compared as a whole
+	bool per_second = true;
+	for (auto* side : { &before, &after })
+	{
+		for (const Capture& capture : *side)
+		{
+			if (capture.duration_ns <= 0)
+			{
+				std::cerr << "Warning: " << capture.path << " has no capture duration, comparing totals instead of rates" << std::endl;
+				per_second = false;
+			}
+		}
+	}
+
+	std::vector<Change> regressions, improvements;
+	std::vector<double> values;
+	auto sample = [&](const std::vector<Capture>& side, uint32_t method, Metric metric) {
+		values.clear();
+		double value;
+		for (const Capture& capture : side)
+			if (metric_value(capture, method, metric, per_second, value))
+				values.push_back(value);
+		return summarize(values);
+	};
+
+	for (uint32_t method = 0; method < index.names.size(); method++)
+	{
+		Sample before_samples[MetricCount], after_samples[MetricCount];
+		for (int metric = 0; metric < MetricCount; metric++)
+		{
+			before_samples[metric] = sample(before, method, static_cast<Metric>(metric));
+			after_samples[metric] = sample(after, method, static_cast<Metric>(metric));
+		}
+
+		for (int metric = 0; metric < MetricCount; metric++)
+		{
+			const Sample& b = before_samples[metric];
+			const Sample& a = after_samples[metric];
+			double p_value = welch_p_value(b, a);
+			if (!is_meaningful(options, static_cast<Metric>(metric), b, a, before_samples[SelfTime], after_samples[SelfTime],
+				before_samples[Calls], after_samples[Calls], p_value))
+				continue;
+
+			// Fewer calls aren't necessarily better, but more work is what a gate is after
+			Change change{ method, static_cast<Metric>(metric), b.mean, a.mean, p_value };
+			(a.mean > b.mean ? regressions : improvements).push_back(change);
+		}
+	}
+
+	std::cout << "Baseline: " << before.size() << " capture(s), candidate: " << after.size() << " capture(s), " << index.names.size() << " methods\n";
+	std::cout << (per_second ? "Times, calls and allocations are per second of capture" : "Times, calls and allocations are capture totals") << ", self time per call is in us\n";
+	if (before.size() < 2 || after.size() < 2)
+		std::cout << "With a single capture on a side only the thresholds are applied, pass several captures per side for a t-test\n";
+
+	print_section("Regressions", regressions, index, options.top);
+	print_section("Improvements", improvements, index, options.top);
+
+	if (!options.csv_path.empty())
+	{
+		std::ofstream fs(options.csv_path, std::fstream::out | std::fstream::trunc);
+		if (!fs)
+		{
+			std::cerr << "Could not write " << options.csv_path << std::endl;
+			return 2;
+		}
+		fs << "\"Method name\",\"Metric\",\"Before\",\"After\",\"Change\",\"p-value\",\"Verdict\"\n";
+		for (auto* list : { &regressions, &improvements })
+		{
+			for (const Change& it : *list)
+			{
+				fs << "\"" << *index.names[it.method] << "\",\"" << metric_labels[it.metric] << "\"," << it.before << "," << it.after
+					<< ",\"" << format_change(it.before, it.after) << "\",";
+				if (!std::isnan(it.p_value))
+					fs << it.p_value;
+				fs << ",\"" << (list == &regressions ? "Regression" : "Improvement") << "\"\n";
+			}
+		}
+	}
+
+	size_t failing = std::count_if(regressions.begin(), regressions.end(), [&](const Change& it) { return options.fail_on[it.metric]; });
+	std::cout << "\n" << regressions.size() << " regressions, " << improvements.size() << " improvements, "
+		<< failing << " regressions fail the gate" << std::endl;
+	return failing > 0 ? 1 : 0;
+}
@@ -0,0 +1,451 @@
+// fake_mono.cpp : Minimal implementation of the runtime functions used by the native profiler.
+
+#include "fake_mono.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace
+{
+	struct FakeImage
+	{
+		std::string name;
+	};
+
+	struct FakeClass
+	{
+		std::string name_space;
+		std::string name;
+		FakeImage* image;
+	};
+
+	struct FakeMethod
+	{
+		FakeClass* klass;
+		std::string name;
+	};
+
+	// Compiled code as mono_jit_info_get_code_size sees it
+	struct FakeJitInfo
+	{
+		void* method;
+		int code_size;
+	};
+
+	// An object as the allocation and monitor hooks see it, MonoObject has to come first
+	struct FakeObject
+	{
+		MonoObject header;
+		uint32_t size;
+		void* klass;
+	};
+
+	std::mutex metadata_mut;
+	std::deque<FakeImage> images;   // Needs lock: metadata_mut
+	std::deque<FakeClass> classes;  // Needs lock: metadata_mut
+	std::deque<FakeMethod> methods; // Needs lock: metadata_mut
+
+	std::atomic<uint32_t> events = 0;
+	MonoProfileMethodFunc enter_hook;
+	MonoProfileMethodFunc leave_hook;
+	MonoProfileMethodFunc exception_leave_hook;
+	MonoProfileMethodFunc jit_start_hook;
+	MonoProfileMethodResult jit_end_hook;
+	MonoProfileJitResult jit_end_info_hook;
+	MonoProfileThreadFunc thread_start_hook;
+	MonoProfileThreadFunc thread_end_hook;
+	MonoProfileThreadNameFunc thread_name_hook;
+	MonoProfileAllocFunc allocation_hook;
+	MonoProfileMonitorFunc monitor_hook;
+	MonoProfileAssemblyFunc assembly_start_hook;
+	MonoProfileAssemblyResult assembly_end_hook;
+	MonoProfileClassFunc class_start_hook;
+	MonoProfileClassResult class_end_hook;
+	MonoProfileGCFunc gc_hook;
+	MonoProfileGCResizeFunc heap_resize_hook;
+	MonoProfileStatFunc statistical_hook;
+	MonoProfileStatCallChainFunc statistical_call_chain_hook;
+
+	thread_local std::basic_string<gunichar2> thread_name; // Backs the name of the thread object
+
+	std::atomic<uint64_t> used_size = 0;
+	std::mutex gc_lock; // Held for a whole collection and not recursive, like the Boehm GC's lock on Linux
+	std::atomic<uint32_t> next_small_id = 0; // Like the runtime, the first thread gets 0
+
+	bool wants(MonoProfileFlags flag)
+	{
+		return (events.load(std::memory_order_relaxed) & flag) != 0;
+	}
+
+	FakeImage* get_image(const char* name)
+	{
+		for (FakeImage& image : images)
+		{
+			if (image.name == name)
+				return &image;
+		}
+		return &images.emplace_back(FakeImage{ name });
+	}
+
+	FakeClass* get_class(const char* name_space, const char* name, FakeImage* image)
+	{
+		for (FakeClass& klass : classes)
+		{
+			if (klass.image == image && klass.name_space == name_space && klass.name == name)
+				return &klass;
+		}
+		return &classes.emplace_back(FakeClass{ name_space, name, image });
+	}
+
+	char* duplicate(const std::string& value)
+	{
+		char* copy = static_cast<char*>(std::malloc(value.size() + 1));
+		std::memcpy(copy, value.c_str(), value.size() + 1);
+		return copy;
+	}
+}
+
+FAKE_MONO_EXPORT void* fake_mono_create_method(const char* name_space, const char* class_name, const char* method_name, const char* assembly)
+{
+	std::lock_guard guard(metadata_mut);
+	FakeClass* klass = get_class(name_space, class_name, get_image(assembly));
+	return &methods.emplace_back(FakeMethod{ klass, method_name });
+}
+
+FAKE_MONO_EXPORT void* fake_mono_method_class(void* method)
+{
+	return static_cast<FakeMethod*>(method)->klass;
+}
+
+FAKE_MONO_EXPORT void fake_mono_enter(void* method)
+{
+	if (enter_hook && wants(MONO_PROFILE_ENTER_LEAVE))
+		enter_hook(nullptr, method);
+}
+
+FAKE_MONO_EXPORT void fake_mono_leave(void* method)
+{
+	if (leave_hook && wants(MONO_PROFILE_ENTER_LEAVE))
+		leave_hook(nullptr, method);
+}
+
+FAKE_MONO_EXPORT void fake_mono_exception_leave(void* method)
+{
+	if (exception_leave_hook && wants(MONO_PROFILE_EXCEPTIONS))
+		exception_leave_hook(nullptr, method);
+}
+
+FAKE_MONO_EXPORT void fake_mono_jit_start(void* method)
+{
+	if (jit_start_hook && wants(MONO_PROFILE_JIT_COMPILATION))
+		jit_start_hook(nullptr, method);
+}
+
+FAKE_MONO_EXPORT void fake_mono_jit_end(void* method, int code_size)
+{
+	if (!wants(MONO_PROFILE_JIT_COMPILATION))
+		return;
+	FakeJitInfo info{ method, code_size };
+	if (jit_end_hook)
+		jit_end_hook(nullptr, method, MONO_PROFILE_OK);
+	if (jit_end_info_hook)
+		jit_end_info_hook(nullptr, method, &info, MONO_PROFILE_OK);
+}
+
+FAKE_MONO_EXPORT _MonoThread* mono_thread_current();
+
+FAKE_MONO_EXPORT void fake_mono_thread_start()
+{
+	if (thread_start_hook && wants(MONO_PROFILE_THREADS))
+		thread_start_hook(nullptr, mono_thread_current()->tid);
+}
+
+FAKE_MONO_EXPORT void fake_mono_thread_end()
+{
+	if (thread_end_hook && wants(MONO_PROFILE_THREADS))
+		thread_end_hook(nullptr, mono_thread_current()->tid);
+}
+
+FAKE_MONO_EXPORT void fake_mono_thread_set_name(const char* name)
+{
+	// Only meant for ASCII names
+	thread_name.assign(name, name + std::strlen(name));
+	_MonoThread* thread = mono_thread_current();
+	thread->name = thread_name.data();
+	thread->name_len = static_cast<guint32>(thread_name.size());
+	if (thread_name_hook && wants(MONO_PROFILE_THREADS))
+		thread_name_hook(nullptr, thread->tid, name);
+}
+
+FAKE_MONO_EXPORT void fake_mono_allocate(void* klass, uint32_t size)
+{
+	used_size.fetch_add(size, std::memory_order_relaxed);
+	if (allocation_hook && wants(MONO_PROFILE_ALLOCATIONS))
+	{
+		FakeObject object{ { nullptr, nullptr }, size, klass };
+		allocation_hook(nullptr, &object.header, klass);
+	}
+}
+
+FAKE_MONO_EXPORT void fake_mono_lock_contended(void* klass, uint32_t wait_us, bool acquired)
+{
+	bool report = monitor_hook && wants(MONO_PROFILE_MONITOR_EVENTS);
+	FakeObject object{ { nullptr, nullptr }, 0, klass };
+	if (report)
+		monitor_hook(nullptr, &object.header, MONO_PROFILER_MONITOR_CONTENTION);
+	std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+	if (report)
+		monitor_hook(nullptr, &object.header, acquired ? MONO_PROFILER_MONITOR_DONE : MONO_PROFILER_MONITOR_FAIL);
+}
+
+FAKE_MONO_EXPORT void* fake_mono_assembly_load_start(const char* name)
+{
+	FakeImage* image;
+	{
+		std::lock_guard guard(metadata_mut);
+		image = get_image(name);
+	}
+	if (assembly_start_hook && wants(MONO_PROFILE_ASSEMBLY_EVENTS))
+		assembly_start_hook(nullptr, image);
+	return image;
+}
+
+FAKE_MONO_EXPORT void fake_mono_assembly_load_end(void* assembly, bool failed)
+{
+	if (assembly_end_hook && wants(MONO_PROFILE_ASSEMBLY_EVENTS))
+		assembly_end_hook(nullptr, assembly, failed ? MONO_PROFILE_FAILED : MONO_PROFILE_OK);
+}
+
+FAKE_MONO_EXPORT void fake_mono_class_load_start(void* klass)
+{
+	if (class_start_hook && wants(MONO_PROFILE_CLASS_EVENTS))
+		class_start_hook(nullptr, klass);
+}
+
+FAKE_MONO_EXPORT void fake_mono_class_load_end(void* klass, bool failed)
+{
+	if (class_end_hook && wants(MONO_PROFILE_CLASS_EVENTS))
+		class_end_hook(nullptr, klass, failed ? MONO_PROFILE_FAILED : MONO_PROFILE_OK);
+}
+
+FAKE_MONO_EXPORT void fake_mono_collect(int generation, uint64_t freed)
+{
+	std::lock_guard guard(gc_lock);
+	bool report = gc_hook && wants(MONO_PROFILE_GC);
+	if (report)
+	{
+		gc_hook(nullptr, MONO_GC_EVENT_PRE_STOP_WORLD, generation);
+		gc_hook(nullptr, MONO_GC_EVENT_POST_STOP_WORLD, generation);
+		gc_hook(nullptr, MONO_GC_EVENT_START, generation);
+	}
+
+	uint64_t used = used_size.load(std::memory_order_relaxed);
+	used_size.store(used > freed ? used - freed : 0, std::memory_order_relaxed);
+
+	if (report)
+	{
+		gc_hook(nullptr, MONO_GC_EVENT_END, generation);
+		gc_hook(nullptr, MONO_GC_EVENT_PRE_START_WORLD, generation);
+		gc_hook(nullptr, MONO_GC_EVENT_POST_START_WORLD, generation);
+	}
+}
+
+FAKE_MONO_EXPORT uint32_t fake_mono_events()
+{
+	return events.load(std::memory_order_relaxed);
+}
+
+// Runtime functions looked up by init_mono_funcs
+
+FAKE_MONO_EXPORT _MonoThread* mono_thread_current()
+{
+	static thread_local _MonoThread thread = [] {
+		_MonoThread current{};
+		current.small_id = next_small_id.fetch_add(1, std::memory_order_relaxed);
+		current.tid = current.small_id;
+		return current;
+	}();
+	return &thread;
+}
+
+FAKE_MONO_EXPORT char* mono_method_full_name(void* method)
+{
+	auto fake = static_cast<FakeMethod*>(method);
+	std::string name = fake->klass->name_space.empty() ? fake->klass->name : fake->klass->name_space + "." + fake->klass->name;
+	return duplicate(name + ":" + fake->name + " ()");
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install(void* /* prof */, MonoProfileFunc /* shutdown_callback */)
+{
+}
+
+FAKE_MONO_EXPORT void mono_profiler_set_events(MonoProfileFlags flags)
+{
+	events.store(flags, std::memory_order_relaxed);
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_enter_leave(MonoProfileMethodFunc enter, MonoProfileMethodFunc fleave)
+{
+	enter_hook = enter;
+	leave_hook = fleave;
+}
+
+FAKE_MONO_EXPORT uint64_t mono_gc_get_used_size()
+{
+	std::lock_guard guard(gc_lock);
+	return used_size.load(std::memory_order_relaxed);
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_gc(MonoProfileGCFunc callback, MonoProfileGCResizeFunc heap_resize_callback)
+{
+	gc_hook = callback;
+	heap_resize_hook = heap_resize_callback;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_allocation(MonoProfileAllocFunc callback)
+{
+	allocation_hook = callback;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_exception(MonoProfileExceptionFunc /* throw_callback */, MonoProfileMethodFunc exc_method_leave, MonoProfileExceptionClauseFunc /* clause_callback */)
+{
+	exception_leave_hook = exc_method_leave;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_jit_compile(MonoProfileMethodFunc start, MonoProfileMethodResult end)
+{
+	jit_start_hook = start;
+	jit_end_hook = end;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_jit_end(MonoProfileJitResult end)
+{
+	jit_end_info_hook = end;
+}
+
+FAKE_MONO_EXPORT int mono_jit_info_get_code_size(void* ji)
+{
+	return static_cast<FakeJitInfo*>(ji)->code_size;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_thread(MonoProfileThreadFunc start, MonoProfileThreadFunc end)
+{
+	thread_start_hook = start;
+	thread_end_hook = end;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_thread_name(MonoProfileThreadNameFunc name_callback)
+{
+	thread_name_hook = name_callback;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_monitor(MonoProfileMonitorFunc callback)
+{
+	monitor_hook = callback;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_assembly(MonoProfileAssemblyFunc start_load, MonoProfileAssemblyResult end_load, MonoProfileAssemblyFunc /* start_unload */, MonoProfileAssemblyFunc /* end_unload */)
+{
+	assembly_start_hook = start_load;
+	assembly_end_hook = end_load;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_class(MonoProfileClassFunc start_load, MonoProfileClassResult end_load, MonoProfileClassFunc /* start_unload */, MonoProfileClassFunc /* end_unload */)
+{
+	class_start_hook = start_load;
+	class_end_hook = end_load;
+}
+
+FAKE_MONO_EXPORT void* mono_assembly_get_image(void* assembly)
+{
+	return assembly;
+}
+
+FAKE_MONO_EXPORT void* mono_object_get_class(MonoObject* obj)
+{
+	return reinterpret_cast<FakeObject*>(obj)->klass;
+}
+
+FAKE_MONO_EXPORT guint32 mono_object_get_size(MonoObject* obj)
+{
+	return reinterpret_cast<FakeObject*>(obj)->size;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_statistical(MonoProfileStatFunc callback)
+{
+	statistical_hook = callback;
+}
+
+FAKE_MONO_EXPORT void mono_profiler_install_statistical_call_chain(MonoProfileStatCallChainFunc callback, int /* call_chain_depth */, MonoProfilerCallChainStrategy /* call_chain_strategy */)
+{
+	statistical_call_chain_hook = callback;
+}
+
+// Attaching and detaching report the thread to the thread hooks, like the runtime does
+FAKE_MONO_EXPORT void* mono_thread_attach(void* /* domain */)
+{
+	fake_mono_thread_start();
+	return mono_thread_current();
+}
+
+FAKE_MONO_EXPORT void mono_thread_detach(void* /* thread */)
+{
+	fake_mono_thread_end();
+}
+
+FAKE_MONO_EXPORT void* mono_get_root_domain()
+{
+	static char domain;
+	return &domain;
+}
+
+// There is no JIT, so no instruction pointer belongs to a method
+FAKE_MONO_EXPORT void* mono_jit_info_table_find(void* /* domain */, char* /* addr */)
+{
+	return nullptr;
+}
+
+FAKE_MONO_EXPORT void* mono_jit_info_get_method(void* /* ji */)
+{
+	return nullptr;
+}
+
+FAKE_MONO_EXPORT void* mono_method_get_class(void* method)
+{
+	return static_cast<FakeMethod*>(method)->klass;
+}
+
+FAKE_MONO_EXPORT const char* mono_method_get_name(void* method)
+{
+	return static_cast<FakeMethod*>(method)->name.c_str();
+}
+
+FAKE_MONO_EXPORT const char* mono_class_get_name(void* klass)
+{
+	return static_cast<FakeClass*>(klass)->name.c_str();
+}
+
+FAKE_MONO_EXPORT const char* mono_class_get_namespace(void* klass)
+{
+	return static_cast<FakeClass*>(klass)->name_space.c_str();
+}
+
+FAKE_MONO_EXPORT void* mono_class_get_nesting_type(void* /* klass */)
+{
+	return nullptr;
+}
+
+FAKE_MONO_EXPORT void* mono_class_get_image(void* klass)
+{
+	return static_cast<FakeClass*>(klass)->image;
+}
+
+FAKE_MONO_EXPORT const char* mono_image_get_name(void* image)
+{
+	return static_cast<FakeImage*>(image)->name.c_str();
+}
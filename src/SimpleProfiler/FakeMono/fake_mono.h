@@ -0,0 +1,64 @@
+#pragma once
+
+// Stand-in for the Mono runtime, used to run the native profiler outside of a game.
+// The library exports the mono_* functions that the profiler looks up in init_mono_funcs,
+// plus the fake_mono_* driver functions below that play the part of the runtime calling the
+// installed profiler hooks. Only meant for benchmarks, nothing is thread-safe beyond what
+// the real runtime would guarantee to the profiler.
+
+#include <cstdint>
+
+#include "../MonoProfiler/mono_types.h"
+
+#ifdef _WIN32
+#define FAKE_MONO_EXPORT extern "C" __declspec(dllexport)
+#else
+#define FAKE_MONO_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+// Returns a MonoMethod* stand-in that the mono_method_* and mono_class_* functions understand.
+// Methods live until the process exits.
+FAKE_MONO_EXPORT void* fake_mono_create_method(const char* name_space, const char* class_name, const char* method_name, const char* assembly);
+
+// Returns the MonoClass* stand-in of a method created by fake_mono_create_method
+FAKE_MONO_EXPORT void* fake_mono_method_class(void* method);
+
+// Calls the installed enter/leave hooks, if the profiler asked for MONO_PROFILE_ENTER_LEAVE
+FAKE_MONO_EXPORT void fake_mono_enter(void* method);
+FAKE_MONO_EXPORT void fake_mono_leave(void* method);
+
+// Calls the exception leave hook for a frame unwound by an exception, if the profiler asked for MONO_PROFILE_EXCEPTIONS
+FAKE_MONO_EXPORT void fake_mono_exception_leave(void* method);
+
+// Calls the JIT hooks around the compilation of `method`, if the profiler asked for MONO_PROFILE_JIT_COMPILATION
+FAKE_MONO_EXPORT void fake_mono_jit_start(void* method);
+FAKE_MONO_EXPORT void fake_mono_jit_end(void* method, int code_size);
+
+// Calls the thread hooks for the calling thread, if the profiler asked for MONO_PROFILE_THREADS
+FAKE_MONO_EXPORT void fake_mono_thread_start();
+FAKE_MONO_EXPORT void fake_mono_thread_end();
+
+// Sets the name of the calling thread's thread object and calls the thread name hook
+FAKE_MONO_EXPORT void fake_mono_thread_set_name(const char* name);
+
+// Reports an allocated object of `klass` to the allocation hook and adds it to the used heap size
+FAKE_MONO_EXPORT void fake_mono_allocate(void* klass, uint32_t size);
+
+// Blocks the calling thread for `wait_us` as if another thread held a lock on an object of `klass`,
+// and calls the monitor hook around the wait. `acquired` is false for a wait that timed out.
+FAKE_MONO_EXPORT void fake_mono_lock_contended(void* klass, uint32_t wait_us, bool acquired);
+
+// Call the assembly load hooks, if the profiler asked for MONO_PROFILE_ASSEMBLY_EVENTS. The MonoAssembly* stand-in
+// of assembly `name` is also its MonoImage*, so it can be passed to fake_mono_create_method's `assembly` by name.
+FAKE_MONO_EXPORT void* fake_mono_assembly_load_start(const char* name);
+FAKE_MONO_EXPORT void fake_mono_assembly_load_end(void* assembly, bool failed);
+
+// Call the class load hooks for the class of a method from fake_mono_method_class, if the profiler asked for MONO_PROFILE_CLASS_EVENTS
+FAKE_MONO_EXPORT void fake_mono_class_load_start(void* klass);
+FAKE_MONO_EXPORT void fake_mono_class_load_end(void* klass, bool failed);
+
+// Runs the GC hooks for a full collection that frees `freed` bytes
+FAKE_MONO_EXPORT void fake_mono_collect(int generation, uint64_t freed);
+
+// Events the profiler has asked for through mono_profiler_set_events
+FAKE_MONO_EXPORT uint32_t fake_mono_events();
@@ -0,0 +1,215 @@
+// LiveViewer.cpp : Shows the methods with the most self time while the game runs, using the profiler's live stats server.
+// Usage: LiveViewer [--port 7878] [--top 25] [--sort self|total|calls|alloc]
+//
+// The profiler sends what every method did since the previous frame, summed over all threads. Every
+// frame the console is redrawn with the top methods, with times and allocations scaled to one second.
+
+#include "../MonoProfiler/live_format.h"
+#include "../MonoProfiler/live_socket.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+enum class SortColumn
+{
+	Self,
+	Total,
+	Calls,
+	Allocation,
+};
+
+static int64_t sort_key(const LiveMethodStats& stats, SortColumn column)
+{
+	switch (column)
+	{
+	case SortColumn::Total:
+		return stats.total_runtime;
+	case SortColumn::Calls:
+		return static_cast<int64_t>(stats.call_count);
+	case SortColumn::Allocation:
+		return static_cast<int64_t>(stats.self_allocation);
+	default:
+		return stats.self_runtime;
+	}
+}
+
+static bool parse_uint(std::string_view text, uint32_t& out)
+{
+	auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+	return ec == std::errc() && end == text.data() + text.size() && out > 0;
+}
+
+static int usage()
+{
+	std::cerr << "Usage: LiveViewer [--port 7878] [--top 25] [--sort self|total|calls|alloc]" << std::endl;
+	return 2;
+}
+
+// Names longer than the console would wrap and break the redraw
+static std::string shorten(const std::string& name, size_t width)
+{
+	if (name.size() <= width)
+		return name;
+	return "..." + name.substr(name.size() - (width - 3));
+}
+
+static void print_frame(const LiveFrameHeader& header, std::vector<LiveMethodStats>& methods,
+	const std::unordered_map<uint32_t, std::string>& names, SortColumn column, uint32_t top)
+{
+	std::sort(methods.begin(), methods.end(), [&](auto& a, auto& b) {
+		return sort_key(a, column) > sort_key(b, column);
+	});
+
+	double seconds = std::max(header.elapsed_ns, uint64_t(1)) / 1e9;
+	int64_t self_sum = 0;
+	uint64_t call_sum = 0;
+	for (auto& it : methods)
+	{
+		self_sum += it.self_runtime;
+		call_sum += it.call_count;
+	}
+
+	// Clear the screen and move to the top left
+	std::string out = "\x1b[2J\x1b[H";
+	char line[512];
+	std::snprintf(line, sizeof(line), "%u threads, %zu methods, %.0f calls/s, %.1f ms/s self time in profiled methods\n\n",
+		header.thread_count, methods.size(), call_sum / seconds, self_sum / seconds / 1e6);
+	out += line;
+	std::snprintf(line, sizeof(line), "%10s %10s %12s %12s %7s  %s\n", "Self ms/s", "Total ms/s", "Calls/s", "Alloc KB/s", "Threads", "Method");
+	out += line;
+	for (size_t i = 0; i < methods.size() && i < top; i++)
+	{
+		const LiveMethodStats& it = methods[i];
+		auto name = names.find(it.method_id);
+		std::snprintf(line, sizeof(line), "%10.2f %10.2f %12.0f %12.1f %7u  %s\n", it.self_runtime / seconds / 1e6, it.total_runtime / seconds / 1e6,
+			it.call_count / seconds, it.self_allocation / seconds / 1024.0, it.thread_count,
+			name == names.end() ? "?" : shorten(name->second, 120).c_str());
+		out += line;
+	}
+	std::fwrite(out.data(), 1, out.size(), stdout);
+	std::fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t port = 7878;
+	uint32_t top = 25;
+	SortColumn column = SortColumn::Self;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (i + 1 >= argc)
+			return usage();
+		std::string_view value = argv[++i];
+
+		bool ok = true;
+		if (arg == "--port")
+			ok = parse_uint(value, port) && port <= 65535;
+		else if (arg == "--top")
+			ok = parse_uint(value, top);
+		else if (arg == "--sort")
+		{
+			if (value == "self")
+				column = SortColumn::Self;
+			else if (value == "total")
+				column = SortColumn::Total;
+			else if (value == "calls")
+				column = SortColumn::Calls;
+			else if (value == "alloc")
+				column = SortColumn::Allocation;
+			else
+				ok = false;
+		}
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			std::cerr << "Invalid argument " << arg << " " << value << std::endl;
+			return usage();
+		}
+	}
+
+#ifdef _WIN32
+	// The redraw uses escape sequences, which the Windows console only understands when asked to
+	HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+	DWORD mode = 0;
+	if (GetConsoleMode(console, &mode))
+		SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+#endif
+
+	if (!init_sockets())
+	{
+		std::cerr << "Could not initialize sockets" << std::endl;
+		return 1;
+	}
+	socket_handle connection = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in address = loopback_address(static_cast<uint16_t>(port));
+	if (connection == invalid_socket || connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+	{
+		std::cerr << "Could not connect to the profiler on port " << port << ". Is `Live view port` set in MonoProfilerLoader.cfg and the game running?" << std::endl;
+		return 1;
+	}
+	std::cout << "Connected, waiting for the first update..." << std::endl;
+
+	std::unordered_map<uint32_t, std::string> names;
+	std::vector<char> payload;
+	std::vector<LiveMethodStats> methods;
+	while (true)
+	{
+		LiveFrameHeader header;
+		if (!recv_all(connection, reinterpret_cast<char*>(&header), sizeof(header)))
+			break;
+		if (std::memcmp(header.magic, LIVE_MAGIC, sizeof(LIVE_MAGIC)) != 0 || header.version != LIVE_VERSION)
+		{
+			std::cerr << "Unsupported live stats version, LiveViewer and the profiler have to come from the same release" << std::endl;
+			return 1;
+		}
+		payload.resize(header.size);
+		if (!recv_all(connection, payload.data(), payload.size()))
+			break;
+
+		size_t offset = 0;
+		auto read = [&](void* out, size_t size) {
+			if (offset + size > payload.size())
+				return false;
+			std::memcpy(out, payload.data() + offset, size);
+			offset += size;
+			return true;
+		};
+
+		bool ok = true;
+		for (uint32_t i = 0; ok && i < header.name_count; i++)
+		{
+			uint32_t id, length;
+			ok = read(&id, sizeof(id)) && read(&length, sizeof(length)) && offset + length <= payload.size();
+			if (ok)
+			{
+				names[id].assign(payload.data() + offset, length);
+				offset += length;
+			}
+		}
+		methods.resize(header.method_count);
+		for (uint32_t i = 0; ok && i < header.method_count; i++)
+			ok = read(&methods[i], sizeof(LiveMethodStats));
+		if (!ok)
+		{
+			std::cerr << "Malformed frame" << std::endl;
+			return 1;
+		}
+
+		print_frame(header, methods, names, column, top);
+	}
+
+	std::cout << "The profiler closed the connection" << std::endl;
+	close_socket(connection);
+	return 0;
+}
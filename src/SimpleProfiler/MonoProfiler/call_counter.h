@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dllmain.h"
+#include "clock.h"
+#include "dump_writer.h"
+#include "method_names.h"
+#include "method_table.h"
+#include "options.h"
+#include "thread_names.h"
+
+// Call counts of one thread. Every method the thread calls gets a counter slot in a flat, chunked array
+// the first time it's seen, and the slot's address is cached per method, so a call is a single lookup in
+// the thread's own table plus an increment. Slots never move once assigned, which lets dump() read them
+// while the thread keeps counting, without the swap handshake ThreadProfilerInfo needs.
+class CounterThread
+{
+public:
+	struct Slot
+	{
+		void* method = nullptr;
+		std::atomic<uint64_t> count = 0; // Only written by the owner thread
+		uint64_t dumped = 0;             // count at the previous dump or reset. Needs lock: CallCounter::threads_mut
+	};
+
+	static constexpr uint32_t chunk_size = 1024;
+	static constexpr uint32_t max_chunks = 1024;
+
+	CounterThread(uint32_t thread_id, std::shared_ptr<ThreadRecord> record)
+		: thread_id(thread_id), thread_record(std::move(record))
+	{
+		overflow.method = &other_methods;
+	}
+
+	// Method of the overflow slot, its address is only used as a key
+	static inline char other_methods;
+
+	void count(void* method)
+	{
+		std::atomic<uint64_t>*& counter = counters.get(method);
+		if (!counter)
+			counter = &add_slot(method).count;
+		// Only this thread writes the counter, so no atomic read-modify-write is needed
+		counter->store(counter->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	// Calls every slot assigned so far with the calls made since the previous take(). Needs lock: CallCounter::threads_mut
+	template <typename TFunc>
+	void take(TFunc func)
+	{
+		uint32_t published = slot_count.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < published; i++)
+			take_slot(chunks[i / chunk_size][i % chunk_size], func);
+		take_slot(overflow, func);
+	}
+
+	const uint32_t thread_id;
+	const std::shared_ptr<ThreadRecord> thread_record;
+
+private:
+	MethodTable<std::atomic<uint64_t>*> counters = MethodTable<std::atomic<uint64_t>*>(1024); // Only used by the owner thread
+	std::unique_ptr<Slot[]> chunks[max_chunks];
+	std::atomic<uint32_t> slot_count = 0;
+	Slot overflow; // Shared by every method after the first chunk_size * max_chunks
+
+	Slot& add_slot(void* method)
+	{
+		uint32_t index = slot_count.load(std::memory_order_relaxed);
+		if (index == chunk_size * max_chunks)
+			return overflow;
+		if (index % chunk_size == 0)
+			chunks[index / chunk_size].reset(new Slot[chunk_size]);
+		Slot& slot = chunks[index / chunk_size][index % chunk_size];
+		slot.method = method;
+		slot_count.store(index + 1, std::memory_order_release);
+		return slot;
+	}
+
+	template <typename TFunc>
+	static void take_slot(Slot& slot, TFunc& func)
+	{
+		uint64_t count = slot.count.load(std::memory_order_relaxed);
+		if (count == slot.dumped)
+			return;
+		func(slot.method, count - slot.dumped);
+		slot.dumped = count;
+	}
+};
+
+// Counts calls per method and thread in ProfilerMode::Count. Only the enter hook is installed and it
+// does nothing but bump a counter, so there are no runtimes, allocations or call stacks, but the cost
+// per call is a fraction of the full instrumentation.
+class CallCounter
+{
+public:
+	static void start()
+	{
+		std::lock_guard guard(threads_mut);
+		window_start = ProfilerClock::now();
+	}
+
+	static CounterThread* add_thread(uint32_t thread_id, std::shared_ptr<ThreadRecord> record)
+	{
+		auto thread = std::make_unique<CounterThread>(thread_id, std::move(record));
+		std::lock_guard guard(threads_mut);
+		return threads.emplace_back(std::move(thread), false).first.get();
+	}
+
+	// Called on the owner thread when it exits. Its counts are kept until the next dump or reset takes them.
+	static void retire(CounterThread* thread)
+	{
+		std::lock_guard guard(threads_mut);
+		for (auto& [it, retired] : threads)
+		{
+			if (it.get() == thread)
+				retired = true;
+		}
+	}
+
+	static void reset()
+	{
+		std::lock_guard guard(threads_mut);
+		for (auto& [thread, retired] : threads)
+			thread->take([](void*, uint64_t) {});
+		remove_retired();
+		window_start = ProfilerClock::now();
+	}
+
+	// Takes the calls counted since the previous dump. The returned job writes them to MonoProfilerOutput.csv,
+	// and summed over all threads to MonoProfilerOutputByMethod.csv if merged_output is set.
+	static DumpWriter::Job dump()
+	{
+		auto snapshot = std::make_shared<Snapshot>();
+		{
+			std::lock_guard guard(threads_mut);
+			for (auto& [thread, retired] : threads)
+			{
+				const std::string& thread_name = snapshot->thread_names.emplace_back(ThreadRegistry::name(thread->thread_record.get()));
+				thread->take([&](void* method, uint64_t count) {
+					snapshot->rows.push_back(Row{ thread->thread_id, &thread_name, method, count });
+				});
+			}
+			remove_retired();
+
+			uint64_t now = ProfilerClock::now();
+			snapshot->duration_ns = ProfilerClock::to_ns(now - window_start).count();
+			window_start = now;
+		}
+
+		return [snapshot] {
+			write(*snapshot);
+			if (profiler_options.merged_output)
+				write_merged(*snapshot);
+		};
+	}
+
+private:
+	struct Row
+	{
+		uint32_t thread_id;
+		const std::string* thread_name;
+		void* method;
+		uint64_t count;
+	};
+
+	struct Snapshot
+	{
+		std::vector<Row> rows;
+		std::deque<std::string> thread_names; // Referenced by rows
+		int64_t duration_ns = 0;
+	};
+
+	static inline std::mutex threads_mut;
+	// Every thread that counted a call, and whether it exited since. Needs lock: threads_mut
+	static inline std::vector<std::pair<std::unique_ptr<CounterThread>, bool>> threads;
+	static inline uint64_t window_start = 0; // Needs lock: threads_mut
+
+	// Needs lock: threads_mut
+	static void remove_retired()
+	{
+		threads.erase(std::remove_if(threads.begin(), threads.end(), [](auto& it) { return it.second; }), threads.end());
+	}
+
+	static const char* method_name(void* method)
+	{
+		return method == &CounterThread::other_methods ? "[Other methods]" : MethodNames::get(method);
+	}
+
+	static void write(Snapshot& snapshot)
+	{
+		std::sort(snapshot.rows.begin(), snapshot.rows.end(), [](auto& a, auto& b) {
+			return a.count > b.count;
+		});
+
+		std::ostringstream fs;
+		fs << "\"Thread\",\"Thread name\",\"Call count\",\"Method name\"\n";
+		for (auto& it : snapshot.rows)
+			fs << it.thread_id << ",\"" << *it.thread_name << "\"," << it.count << ",\"" << method_name(it.method) << "\"\n";
+		fs << "\"Capture duration (ns)\"," << snapshot.duration_ns << "\n";
+		fs << "\"Call counts only, runtimes and allocations are not measured in this mode\"\n";
+		DumpWriter::write_file("MonoProfilerOutput.csv", fs.str());
+	}
+
+	static void write_merged(const Snapshot& snapshot)
+	{
+		MethodTable<uint64_t> counts(1024);
+		for (auto& it : snapshot.rows)
+			counts.get(it.method) += it.count;
+
+		std::vector<std::pair<void*, uint64_t>> rows;
+		counts.for_each([&](void* method, uint64_t count) {
+			rows.emplace_back(method, count);
+		});
+		std::sort(rows.begin(), rows.end(), [](auto& a, auto& b) {
+			return a.second > b.second;
+		});
+
+		std::ostringstream fs;
+		fs << "\"Call count\",\"Method name\"\n";
+		for (auto& [method, count] : rows)
+			fs << count << ",\"" << method_name(method) << "\"\n";
+		fs << "\"Capture duration (ns)\"," << snapshot.duration_ns << "\n";
+		DumpWriter::write_file("MonoProfilerOutputByMethod.csv", fs.str());
+	}
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Calling context tree of a single thread. Every node is one (parent node, method) pair, so the
+// same method called from two different places ends up in two different nodes.
+// Nodes live in one growing array and refer to each other by index, the profiled thread keeps the
+// index of the node it is currently in on its shadow stack and only ever looks at the children
+// of that node, so the full stack never needs to be hashed.
+// Not thread-safe: ownership is handed over the same way as MethodTable.
+class CallTree
+{
+public:
+	static constexpr uint32_t root = 0;
+	// Catches every call made once the tree is full, including everything called below it
+	static constexpr uint32_t overflow = 1;
+	static constexpr uint32_t none = UINT32_MAX;
+
+	struct Node
+	{
+		void* method;
+		uint32_t parent;
+		uint32_t first_child;
+		uint32_t next_sibling;
+		uint64_t call_count;
+		std::chrono::nanoseconds total_runtime;
+		std::chrono::nanoseconds self_runtime;
+	};
+
+	explicit CallTree(uint32_t max_nodes)
+		: max_nodes(max_nodes < 16 ? 16 : max_nodes)
+	{
+	}
+
+	// Returns the node for `method` called from `parent`, adding it if this path wasn't seen yet
+	uint32_t child(uint32_t parent, void* method)
+	{
+		if (nodes.empty())
+			reset();
+		if (parent == overflow)
+			return overflow;
+
+		// Children are kept in most recently used order, hot call sites are found in the first few steps
+		uint32_t prev = none;
+		for (uint32_t i = nodes[parent].first_child; i != none; i = nodes[i].next_sibling)
+		{
+			if (nodes[i].method == method)
+			{
+				if (prev != none)
+				{
+					nodes[prev].next_sibling = nodes[i].next_sibling;
+					nodes[i].next_sibling = nodes[parent].first_child;
+					nodes[parent].first_child = i;
+				}
+				return i;
+			}
+			prev = i;
+		}
+
+		if (nodes.size() >= max_nodes)
+			return overflow;
+
+		uint32_t index = static_cast<uint32_t>(nodes.size());
+		nodes.push_back(Node{ method, parent, none, nodes[parent].first_child, 0, {}, {} });
+		nodes[parent].first_child = index;
+		return index;
+	}
+
+	void add(uint32_t node, std::chrono::nanoseconds total_runtime, std::chrono::nanoseconds self_runtime)
+	{
+		Node& n = nodes[node];
+		n.call_count++;
+		n.total_runtime += total_runtime;
+		n.self_runtime += self_runtime;
+	}
+
+	// Used by the sampler, where call_count is the number of samples that had this node on top
+	void add_sample(uint32_t node)
+	{
+		nodes[node].call_count++;
+	}
+
+	size_t size() const { return nodes.size(); }
+
+	// No calls were added since the tree was created or cleared
+	bool empty() const
+	{
+		return nodes.size() <= 2 && (nodes.empty() || nodes[overflow].call_count == 0);
+	}
+
+	void clear()
+	{
+		if (!empty())
+			reset();
+	}
+
+	// Writes one line per path with self runtime in the collapsed stack format used by flamegraph tools:
+	// `prefix;outer method;...;inner method <self runtime in ns>`
+	// If `weight_by_count` is set the weight is call_count instead.
+	template <typename TNameFunc>
+	void write_folded(std::ostream& out, const std::string& prefix, TNameFunc&& method_name, bool weight_by_count = false) const
+	{
+		if (nodes.empty())
+			return;
+
+		std::vector<std::pair<uint32_t, size_t>> pending; // Node and length of its parent's path
+		std::string path = prefix;
+		for (uint32_t i = nodes[root].first_child; i != none; i = nodes[i].next_sibling)
+			pending.emplace_back(i, path.size());
+
+		while (!pending.empty())
+		{
+			auto [index, parent_length] = pending.back();
+			pending.pop_back();
+			const Node& node = nodes[index];
+
+			path.resize(parent_length);
+			path += ';';
+			if (index == overflow)
+				path += "[Call tree full]";
+			else
+				append_frame(path, method_name(node.method));
+
+			uint64_t weight = weight_by_count ? node.call_count : static_cast<uint64_t>(node.self_runtime.count());
+			if (weight > 0)
+				out << path << ' ' << weight << '\n';
+
+			for (uint32_t i = node.first_child; i != none; i = nodes[i].next_sibling)
+				pending.emplace_back(i, path.size());
+		}
+	}
+
+private:
+	std::vector<Node> nodes;
+	uint32_t max_nodes;
+
+	void reset()
+	{
+		nodes.clear();
+		nodes.reserve(max_nodes < 1024 ? max_nodes : 1024);
+		nodes.push_back(Node{ nullptr, none, none, none, 0, {}, {} });
+		nodes.push_back(Node{ nullptr, root, none, none, 0, {}, {} });
+		nodes[root].first_child = overflow;
+	}
+
+	// ';' separates frames and every path has to stay on one line
+	static void append_frame(std::string& path, const char* name)
+	{
+		for (; *name; name++)
+			path += *name == ';' ? ':' : *name == '\n' ? ' ' : *name;
+	}
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PROFILER_HAS_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define PROFILER_HAS_TSC 1
+#else
+#define PROFILER_HAS_TSC 0
+#endif
+
+enum class ClockSource
+{
+	Chrono, // std::chrono::high_resolution_clock, QueryPerformanceCounter on Windows
+	Tsc,    // Invariant timestamp counter read with rdtsc
+};
+
+// Clock used for all method timings. Ticks are only meaningful relative to each other,
+// use to_ns to turn a tick delta into nanoseconds.
+struct ProfilerClock
+{
+	static inline ClockSource source = ClockSource::Chrono;
+	static inline double ns_per_tick = 1.0;
+
+	static uint64_t now()
+	{
+		if (source == ClockSource::Tsc)
+			return read_tsc();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+	}
+
+	static std::chrono::nanoseconds to_ns(int64_t ticks)
+	{
+		if (source == ClockSource::Tsc)
+			return std::chrono::nanoseconds(static_cast<int64_t>(ticks * ns_per_tick));
+		return std::chrono::nanoseconds(ticks);
+	}
+
+	// Picks the TSC if allowed and the CPU reports it as invariant (constant rate, not stopped in deep
+	// C-states) and measures its frequency against steady_clock. Otherwise stays on chrono.
+	static void calibrate(bool allow_tsc = true)
+	{
+		if (!allow_tsc || !has_invariant_tsc())
+		{
+			source = ClockSource::Chrono;
+			ns_per_tick = 1.0;
+			return;
+		}
+
+		using namespace std::chrono;
+		auto start_time = steady_clock::now();
+		uint64_t start_tsc = read_tsc();
+		std::this_thread::sleep_for(milliseconds(20));
+		auto end_time = steady_clock::now();
+		uint64_t end_tsc = read_tsc();
+
+		if (end_tsc <= start_tsc)
+			return;
+
+		ns_per_tick = static_cast<double>(duration_cast<nanoseconds>(end_time - start_time).count()) / static_cast<double>(end_tsc - start_tsc);
+		source = ClockSource::Tsc;
+	}
+
+private:
+	static uint64_t read_tsc()
+	{
+#if PROFILER_HAS_TSC
+		return __rdtsc();
+#else
+		return 0;
+#endif
+	}
+
+	static bool has_invariant_tsc()
+	{
+#if !PROFILER_HAS_TSC
+		return false;
+#else
+		// CPUID.80000007H:EDX[8] is the invariant TSC flag
+		unsigned int regs[4] = {};
+#ifdef _MSC_VER
+		__cpuid(reinterpret_cast<int*>(regs), 0x80000000);
+		if (regs[0] < 0x80000007)
+			return false;
+		__cpuid(reinterpret_cast<int*>(regs), 0x80000007);
+#else
+		if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007)
+			return false;
+		__get_cpuid(0x80000007, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+		return (regs[3] & (1 << 8)) != 0;
+#endif
+	}
+};
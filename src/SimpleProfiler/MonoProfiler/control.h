@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dllmain.h"
+
+// Include/exclude rules set through the SetFilter export.
+// The pattern is a comma separated list of rules, each one is either a namespace prefix
+// (`MyMod` matches MyMod and MyMod.UI but not MyModExtra) or an assembly name in brackets (`[Assembly-CSharp]`).
+// Rules starting with `-` exclude instead. A method is profiled if it matches any include rule
+// (or there are none) and no exclude rule.
+class MethodFilter
+{
+public:
+	MethodFilter() = default;
+
+	explicit MethodFilter(std::string_view pattern)
+	{
+		while (!pattern.empty())
+		{
+			size_t end = pattern.find(',');
+			std::string_view part = trim(pattern.substr(0, end));
+			pattern = end == std::string_view::npos ? std::string_view() : pattern.substr(end + 1);
+
+			Rule rule{};
+			if (!part.empty() && part.front() == '-')
+			{
+				rule.exclude = true;
+				part = trim(part.substr(1));
+			}
+			if (part.size() >= 2 && part.front() == '[' && part.back() == ']')
+			{
+				rule.assembly = true;
+				part = part.substr(1, part.size() - 2);
+			}
+			if (part.empty())
+				continue;
+
+			rule.value = part;
+			has_includes |= !rule.exclude;
+			rules.push_back(std::move(rule));
+		}
+	}
+
+	bool empty() const { return rules.empty(); }
+
+	bool matches(void* method) const
+	{
+		void* klass = mono_method_get_class(method);
+		// Nested classes have no namespace of their own
+		while (mono_class_get_nesting_type && mono_class_get_nesting_type(klass))
+			klass = mono_class_get_nesting_type(klass);
+		std::string_view name_space = mono_class_get_namespace(klass);
+		std::string_view assembly = mono_image_get_name(mono_class_get_image(klass));
+
+		bool included = !has_includes;
+		for (const Rule& rule : rules)
+		{
+			bool match = rule.assembly ? assembly == rule.value : is_namespace_prefix(rule.value, name_space);
+			if (match && rule.exclude)
+				return false;
+			included |= match;
+		}
+		return included;
+	}
+
+private:
+	struct Rule
+	{
+		bool exclude;
+		bool assembly;
+		std::string value;
+	};
+
+	std::vector<Rule> rules;
+	bool has_includes = false;
+
+	static std::string_view trim(std::string_view value)
+	{
+		while (!value.empty() && value.front() == ' ')
+			value.remove_prefix(1);
+		while (!value.empty() && value.back() == ' ')
+			value.remove_suffix(1);
+		return value;
+	}
+
+	static bool is_namespace_prefix(std::string_view prefix, std::string_view name_space)
+	{
+		return name_space.substr(0, prefix.size()) == prefix && (name_space.size() == prefix.size() || name_space[prefix.size()] == '.');
+	}
+};
+
+// Switches that can be flipped through the exports while the game runs.
+// Everything the hooks need is packed into one word, so a disabled profiler costs a single relaxed load.
+class ProfilerControl
+{
+public:
+	static constexpr uint32_t enabled_bit = 1;
+	static constexpr uint32_t filtered_bit = 2;
+	// The rest of the word is a counter bumped whenever profiling restarts or the filter changes,
+	// threads drop their shadow stack and cached filter decisions when they see it change.
+	static constexpr uint32_t generation_step = 4;
+
+	static uint32_t state() { return current.load(std::memory_order_relaxed); }
+
+	static void set_enabled(bool enabled)
+	{
+		std::lock_guard guard(control_mut);
+		uint32_t value = current.load(std::memory_order_relaxed);
+		if (enabled && !(value & enabled_bit))
+			value += generation_step;
+		value = enabled ? value | enabled_bit : value & ~enabled_bit;
+		current.store(value, std::memory_order_release);
+	}
+
+	static void set_filter(std::string_view pattern)
+	{
+		std::lock_guard guard(control_mut);
+		filter = MethodFilter(pattern);
+		uint32_t value = current.load(std::memory_order_relaxed) + generation_step;
+		value = filter.empty() ? value & ~filtered_bit : value | filtered_bit;
+		current.store(value, std::memory_order_release);
+	}
+
+	// Callers should cache the result per method since this takes a global lock
+	static bool is_included(void* method)
+	{
+		std::lock_guard guard(control_mut);
+		return filter.matches(method);
+	}
+
+private:
+	static inline std::atomic<uint32_t> current = enabled_bit;
+	static inline std::mutex control_mut;
+	static inline MethodFilter filter; // Needs lock: control_mut
+};
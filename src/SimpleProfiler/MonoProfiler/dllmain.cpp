@@ -2,11 +2,36 @@
 #include "pch.h"
 #include "dllmain.h"
 
+#include <deque>
 #include <set>
 #include <algorithm>
 #include <vector>
 #include <functional>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
+#include "call_counter.h"
+#include "call_tree.h"
+#include "clock.h"
+#include "control.h"
+#include "dump_writer.h"
+#include "flight_recorder.h"
+#include "gc_events.h"
+#include "heavy_hitters.h"
+#include "histogram.h"
+#include "jit_events.h"
+#include "live_server.h"
+#include "load_events.h"
+#include "method_names.h"
+#include "method_owners.h"
+#include "method_table.h"
+#include "monitor_events.h"
+#include "options.h"
+#include "sampler.h"
+#include "thread_names.h"
+#include "trace.h"
 
 using namespace std::chrono;
 
@@ -14,210 +39,1487 @@ struct MethodStats
 {
 	uint64_t call_count = 0;
 	uint64_t total_allocation = 0;
+	uint64_t self_allocation = 0;
 	nanoseconds total_runtime = nanoseconds(0);
 	nanoseconds self_runtime = nanoseconds(0);
+	// Runtimes with the profiler's own enter/leave overhead subtracted
+	nanoseconds corrected_total_runtime = nanoseconds(0);
+	nanoseconds corrected_self_runtime = nanoseconds(0);
+	// Time spent blocked on contended monitors while the method was on top of the stack, left out of the self runtimes
+	nanoseconds blocked_time = nanoseconds(0);
+	// Only with max_methods: self runtime (ns) the method may have had in calls that were evicted before its entry was added
+	int64_t error_bound = 0;
+	// Set when the entry is added from the thread's cached decision, the calls of static constructors are also reported to LoadRecorder
+	bool static_constructor = false;
+
+	// Methods with the least self runtime are the first to be evicted with max_methods
+	int64_t weight() const { return self_runtime.count(); }
+
+	void add(const MethodStats& other)
+	{
+		call_count += other.call_count;
+		total_allocation += other.total_allocation;
+		self_allocation += other.self_allocation;
+		total_runtime += other.total_runtime;
+		self_runtime += other.self_runtime;
+		corrected_total_runtime += other.corrected_total_runtime;
+		corrected_self_runtime += other.corrected_self_runtime;
+		blocked_time += other.blocked_time;
+		error_bound += other.error_bound;
+	}
+};
+
+struct ClassAllocationStats
+{
+	uint64_t count = 0;
+	uint64_t bytes = 0;
+};
+
+// How well the shadow stack matched the enter/leave events, counted between two dumps
+struct ShadowStackStats
+{
+	uint64_t exception_frames = 0; // Frames the runtime reported as unwound by an exception
+	uint64_t resynced_frames = 0;  // Frames that never got a leave event, closed when a caller further down left
+	uint64_t dropped_leaves = 0;   // Leave events without a matching frame, their calls are missing from the stats
+
+	void add(const ShadowStackStats& other)
+	{
+		exception_frames += other.exception_frames;
+		resynced_frames += other.resynced_frames;
+		dropped_leaves += other.dropped_leaves;
+	}
+
+	bool empty() const
+	{
+		return exception_frames == 0 && resynced_frames == 0 && dropped_leaves == 0;
+	}
 };
 
 struct StackEntry
 {
 	void* method;
-	time_point<high_resolution_clock> entry_time;
+	uint64_t entry_ticks;
 	uint64_t entry_alloc;
+	uint64_t entry_jit;
+	uint64_t child_allocation;
 	nanoseconds child_runtime;
+	int64_t child_calls;      // Direct children only
+	int64_t descendant_calls; // All calls made below this frame
+	uint32_t node;            // CallTree node of this call, only used in call tree mode
+	uint64_t blocked_ticks;   // Time this frame itself spent waiting for monitors
 };
 
 // Per-thread profiler info.
 struct ThreadProfilerInfo
 {
-	using table_t = std::unordered_map<void*, MethodStats>;
-	std::mutex stats_mut;
-	table_t table; // Needs lock: stats_mut
+	using table_t = MethodTable<MethodStats>;
+
+	// Stats are double-buffered so that the owner thread never has to take a lock.
+	// The owner only writes to tables[swaps & 1] while `writing` is set, dump() increments
+	// swaps and waits for `writing` to clear before taking over the old table.
+	table_t tables[2];
+	CallTree trees[2]; // Swapped together with tables, only filled in call tree mode
+	MethodTable<ClassAllocationStats> class_allocations[2] = { MethodTable<ClassAllocationStats>(64), MethodTable<ClassAllocationStats>(64) }; // Swapped together with tables, keyed by MonoClass*
+	std::unique_ptr<MethodTable<MethodHistograms>> histograms[2]; // Swapped together with tables, only allocated if histograms are enabled
+	ShadowStackStats shadow_stack_stats[2];                       // Swapped together with tables
+	EvictedEntries<MethodStats> evicted[2];                       // Swapped together with tables, only used with max_methods
+	std::atomic<uint32_t> swaps = 0;
+	std::atomic<bool> writing = false;
+	// The live server reads the buffers without emptying them, these are the totals of tables[i] it already sent.
+	// Needs lock: all_instances_mut
+	MethodTable<LiveMethodStats> live_sent[2] = { MethodTable<LiveMethodStats>(16), MethodTable<LiveMethodStats>(16) };
+	bool live_read = false; // Both buffers can hold stats of the current window. Needs lock: all_instances_mut
 
 	const uint32_t thread_id;
+	std::shared_ptr<ThreadRecord> thread_record; // Name and lifetime of the thread, null for calibration
+
+	// Instrumentation cost measured by calibrate_overhead.
+	// inner_overhead ends up in the profiled method's own runtime,
+	// outer_overhead is the rest of an enter/leave pair that lands in the caller's self runtime.
+	static inline nanoseconds inner_overhead = nanoseconds(0);
+	static inline nanoseconds outer_overhead = nanoseconds(0);
 
 	std::vector<StackEntry> stack; // Used exclusively by the owner thread. Needs lock: none
+	uint64_t allocated_bytes = 0;  // Bytes allocated by this thread so far, only counted with AllocationTracking::Events. Needs lock: none
+	uint64_t jit_ticks = 0;        // Time this thread spent compiling methods, only counted with jit_subtract. Needs lock: none
+	uint32_t stack_swaps = 0;      // Value of swaps when the nodes in stack were resolved. Needs lock: none
+
+	// Only set when the event trace or the flight recorder is enabled
+	std::shared_ptr<TraceRing> trace_ring;
+	std::shared_ptr<FlightRing> flight_ring;
+	MethodTable<uint32_t> trace_ids = MethodTable<uint32_t>(16); // Cached TraceWriter ids. Needs lock: none
+
+	uint32_t seen_state = 0; // Last ProfilerControl state seen by the owner thread. Needs lock: none
+	MethodTable<uint8_t> filter_decisions = MethodTable<uint8_t>(64); // 0 not resolved yet, 1 included, 2 excluded. Needs lock: none
+	// Whether methods are static constructors, 0 not resolved yet, 1 yes, 2 no. Unlike the stats it's kept across dumps,
+	// so every method's name is only compared once per thread. Needs lock: none
+	MethodTable<uint8_t> static_constructors = MethodTable<uint8_t>(64);
 
 	static std::mutex all_instances_mut;
 	static std::set<ThreadProfilerInfo*> all_instances; // Needs lock: all_instances_mut
+	static std::vector<ThreadProfilerInfo*> retired;    // Exited threads whose stats haven't been dumped yet. Needs lock: all_instances_mut
+	static uint64_t window_start;                       // When the period covered by the next dump started. Needs lock: all_instances_mut
 
-	ThreadProfilerInfo()
-		: thread_id(mono_thread_current()->small_id)
+	explicit ThreadProfilerInfo(uint32_t thread_id)
+		: trees{ CallTree(profiler_options.call_tree_max_nodes), CallTree(profiler_options.call_tree_max_nodes) }
+		, thread_id(thread_id)
 	{
 		stack.reserve(100);
 
+		// A capped table never holds more than max_methods entries, so it doesn't need the default size
+		if (profiler_options.max_methods != 0)
+		{
+			size_t capacity = std::min<size_t>(1024, HeavyHitters<MethodStats>::table_capacity(profiler_options.max_methods));
+			tables[0] = table_t(capacity);
+			tables[1] = table_t(capacity);
+		}
+
+		if (profiler_options.histograms)
+		{
+			histograms[0] = std::make_unique<MethodTable<MethodHistograms>>(64);
+			histograms[1] = std::make_unique<MethodTable<MethodHistograms>>(64);
+		}
+
+		if (TraceWriter::is_running())
+			trace_ring = TraceWriter::create_ring(thread_id);
+		if (FlightRecorder::is_running())
+			flight_ring = FlightRecorder::create_ring(thread_id);
+
 		std::lock_guard guard(all_instances_mut);
 		all_instances.insert(this);
 	}
 
 	~ThreadProfilerInfo()
 	{
+		if (trace_ring)
+			trace_ring->retired.store(true, std::memory_order_release);
+		if (flight_ring)
+			flight_ring->retired.store(true, std::memory_order_release);
+
 		std::lock_guard guard(all_instances_mut);
 		all_instances.erase(this);
 	}
 
-	void enter_method(void* method)
+	// Called on the owner thread when it exits. The stats it collected since the last dump are kept
+	// until the next dump or reset takes them, instead of going away with the thread.
+	static void retire(ThreadProfilerInfo* info)
+	{
+		if (info->trace_ring)
+			info->trace_ring->retired.store(true, std::memory_order_release);
+		if (info->flight_ring)
+			info->flight_ring->retired.store(true, std::memory_order_release);
+		info->stack = std::vector<StackEntry>();
+
+		{
+			std::lock_guard guard(all_instances_mut);
+			if (info->has_stats())
+			{
+				all_instances.erase(info);
+				retired.push_back(info);
+				return;
+			}
+		}
+		// Not under the lock, the destructor takes it
+		delete info;
+	}
+
+	// Empties one pair of buffers, which must have been handed over by swap_tables. Needs lock: all_instances_mut
+	void clear_buffers(uint32_t old_table)
+	{
+		tables[old_table].clear();
+		trees[old_table].clear();
+		class_allocations[old_table].clear();
+		if (histograms[old_table])
+			histograms[old_table]->clear();
+		shadow_stack_stats[old_table] = ShadowStackStats{};
+		evicted[old_table] = EvictedEntries<MethodStats>{};
+		live_sent[old_table].clear();
+	}
+
+	// Whether anything was recorded that the next dump still has to take, in either buffer. Needs lock: all_instances_mut
+	bool has_stats() const
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			if (tables[i].size() > 0 || evicted[i].count > 0 || class_allocations[i].size() > 0 || !trees[i].empty() ||
+				!shadow_stack_stats[i].empty())
+				return true;
+		}
+		return false;
+	}
+
+	void trace_event(uint64_t now, void* method, uint32_t flags)
+	{
+		// Only a cache, so it's simply started over when it reaches the method cap
+		if (profiler_options.max_methods != 0 && trace_ids.size() >= profiler_options.max_methods)
+			trace_ids.clear();
+		uint32_t& id = trace_ids.get(method);
+		if (id == 0)
+			id = TraceWriter::register_method(method);
+		if (trace_ring)
+			trace_ring->push(TraceWriter::ticks_since_start(now), id | flags);
+		if (flight_ring)
+			flight_ring->push(now, id | flags);
+	}
+
+	bool is_static_constructor(void* method)
 	{
-		stack.push_back(StackEntry{ method, high_resolution_clock::now(), mono_gc_get_used_size(), nanoseconds(0) });
+		// Only a cache, so it's simply started over when it reaches the method cap
+		if (profiler_options.max_methods != 0 && static_constructors.size() >= profiler_options.max_methods)
+			static_constructors.clear();
+		uint8_t& decision = static_constructors.get(method);
+		if (decision == 0)
+			decision = LoadRecorder::is_static_constructor(method) ? 1 : 2;
+		return decision == 1;
 	}
 
-	MethodStats* get_method_stats(void* method)
+	// Returns false if the method is filtered out. `state` is ProfilerControl::state() loaded by the hook.
+	bool accept(void* method, uint32_t state)
 	{
-		table_t::iterator it = table.find(method);
+		if (state != seen_state)
+		{
+			// Frames entered before profiling was paused or the filter changed can't be matched anymore
+			stack.clear();
+			filter_decisions.clear();
+			seen_state = state;
+		}
 
-		if (it == table.end())
-			it = table.insert({ method, {} }).first;
+		if (!(state & ProfilerControl::filtered_bit))
+			return true;
 
-		return &it->second;
+		if (profiler_options.max_methods != 0 && filter_decisions.size() >= profiler_options.max_methods)
+			filter_decisions.clear();
+		uint8_t& decision = filter_decisions.get(method);
+		if (decision == 0)
+			decision = ProfilerControl::is_included(method) ? 1 : 2;
+		return decision == 1;
 	}
 
-	void leave_method(void* method)
+	void enter_method(void* method, uint32_t state)
 	{
-		auto now = high_resolution_clock::now();
-		if (stack.empty())
+		if (!accept(method, state))
 			return;
 
-		StackEntry top = stack.back();
-		stack.pop_back();
+		uint64_t now = ProfilerClock::now();
+		if (trace_ring || flight_ring)
+			trace_event(now, method, 0);
+
+		uint32_t node = 0;
+		if (profiler_options.call_tree)
+		{
+			writing.store(true, std::memory_order_seq_cst);
+			CallTree& tree = active_tree();
+			node = tree.child(stack.empty() ? CallTree::root : stack.back().node, method);
+			writing.store(false, std::memory_order_release);
+		}
 
-		if (method != top.method)
+		stack.push_back(StackEntry{ method, now, allocation_counter(), jit_ticks, 0, nanoseconds(0), 0, 0, node, 0 });
+	}
+
+	// Value that allocations are measured against, the difference between two readings is what was allocated in between
+	uint64_t allocation_counter() const
+	{
+		switch (profiler_options.allocations)
+		{
+		case AllocationTracking::HeapSize:
+			return mono_gc_get_used_size();
+		case AllocationTracking::Events:
+			return allocated_bytes;
+		default:
+			return 0;
+		}
+	}
+
+	// Called by the runtime on the allocating thread, only with AllocationTracking::Events
+	void allocation(void* klass, uint64_t size)
+	{
+		allocated_bytes += size;
+
+		writing.store(true, std::memory_order_seq_cst);
+		ClassAllocationStats& stats = class_allocations[swaps.load(std::memory_order_seq_cst) & 1].get(klass);
+		stats.count++;
+		stats.bytes += size;
+		writing.store(false, std::memory_order_release);
+	}
+
+	// Called by the runtime on the thread that waited for a contended monitor
+	void monitor_wait(uint64_t ticks)
+	{
+		if (!stack.empty())
+			stack.back().blocked_ticks += ticks;
+	}
+
+	// `unwound` is set when the runtime reports the frame as left because of an exception
+	void leave_method(void* method, uint32_t state, bool unwound = false)
+	{
+		if (!accept(method, state))
 			return;
 
-		std::lock_guard guard(stats_mut);
+		uint64_t now = ProfilerClock::now();
+
+		// Normally the leaving method is on top. If it's further down, the frames above it were left
+		// without an event (e.g. unwound by an exception the runtime didn't report) and are closed too.
+		size_t depth = stack.size();
+		while (depth > 0 && stack[depth - 1].method != method)
+			depth--;
 
-		auto stats = get_method_stats(method);
+		uint64_t alloc_now = allocation_counter();
 
-		auto time = now - top.entry_time;
-		stats->total_runtime += time;
-		stats->self_runtime += time - top.child_runtime;
-		stats->call_count++;
-		uint64_t used_size = mono_gc_get_used_size();
-		// If a GC has happened since the method was entered, our allocation
-		// estimate will be messed up. Here we use a simple heuristic:
+		// Must be sequentially consistent with the exchange in swap_tables
+		writing.store(true, std::memory_order_seq_cst);
+		uint32_t active = swaps.load(std::memory_order_seq_cst) & 1;
+		ShadowStackStats& stack_stats = shadow_stack_stats[active];
+		if (depth == 0)
+		{
+			// Entered before profiling was resumed or the filter changed, or the stack is out of sync
+			stack_stats.dropped_leaves++;
+			if (trace_ring || flight_ring)
+				trace_event(now, method, TRACE_LEAVE_FLAG);
+		}
+		else
+		{
+			stack_stats.resynced_frames += stack.size() - depth;
+			stack_stats.exception_frames += unwound ? 1 : 0;
+			while (stack.size() >= depth)
+				close_frame(now, alloc_now, active);
+		}
+		writing.store(false, std::memory_order_release);
+	}
+
+	// Pops the top of the shadow stack and adds the call to the stats. Needs `writing` to be set.
+	void close_frame(uint64_t now, uint64_t alloc_now, uint32_t active)
+	{
+		StackEntry top = stack.back();
+		stack.pop_back();
+
+		if (trace_ring || flight_ring)
+			trace_event(now, top.method, TRACE_LEAVE_FLAG);
+
+		// Methods first called from this frame were compiled on the way, which isn't the frame's own work
+		uint64_t elapsed = now - top.entry_ticks;
+		nanoseconds time = ProfilerClock::to_ns(elapsed - std::min(elapsed, jit_ticks - top.entry_jit));
+		// With AllocationTracking::HeapSize the counter goes down if a GC has happened since the
+		// method was entered, which would mess up our estimate. Here we use a simple heuristic:
 		// ignore any negative allocation number.
-		if (used_size > top.entry_alloc)
+		uint64_t allocation = alloc_now > top.entry_alloc ? alloc_now - top.entry_alloc : 0;
+		// Waiting for another thread's lock isn't work this method did, it still counts towards the total
+		nanoseconds blocked = ProfilerClock::to_ns(top.blocked_ticks);
+		nanoseconds self_time = std::max(nanoseconds(0), time - top.child_runtime - blocked);
+
+		MethodStats& stats = method_stats(active, top.method);
+		if (stats.call_count == 0)
+			stats.static_constructor = is_static_constructor(top.method);
+		if (stats.static_constructor)
+			LoadRecorder::add_static_constructor(top.method, top.entry_ticks, now);
+		if (profiler_options.call_tree)
+			active_tree(&top).add(top.node, time, self_time);
+		if (histograms[active])
 		{
-			stats->total_allocation += used_size - top.entry_alloc;
+			MethodHistograms& method_histograms = histograms[active]->get(top.method);
+			method_histograms.total.record(time.count());
+			method_histograms.self.record(self_time.count());
 		}
 
+		stats.total_runtime += time;
+		stats.self_runtime += self_time;
+		stats.corrected_total_runtime += std::max(nanoseconds(0), time - inner_overhead - (inner_overhead + outer_overhead) * top.descendant_calls);
+		stats.corrected_self_runtime += std::max(nanoseconds(0), self_time - inner_overhead - outer_overhead * top.child_calls);
+		stats.blocked_time += blocked;
+		stats.call_count++;
+		stats.total_allocation += allocation;
+		stats.self_allocation += allocation - std::min(allocation, top.child_allocation);
+
 		if (!stack.empty())
 		{
 			StackEntry& parent = stack.back();
 			parent.child_runtime += time;
+			parent.child_allocation += allocation;
+			parent.child_calls++;
+			parent.descendant_calls += top.descendant_calls + 1;
 		}
 	}
 
-	table_t get_table()
+	// Entry of `method` in the active table. With max_methods this can evict other methods to make room.
+	MethodStats& method_stats(uint32_t active, void* method)
 	{
-		std::lock_guard guard(stats_mut);
-		table_t ret(std::move(table));
-		table.clear();
-		return ret;
+		// Histograms of evicted methods go with them
+		return HeavyHitters<MethodStats>::get(tables[active], method, profiler_options.max_methods, evicted[active], [&](void* evicted_method) {
+			if (histograms[active])
+				histograms[active]->erase(evicted_method);
+		});
+	}
+
+	// Returns the active call tree. If dump() took the tree that the nodes on the shadow stack
+	// point into, the current stack (plus `popped`, the frame that was just removed from it)
+	// is re-added to the new tree first. Needs `writing` to be set.
+	CallTree& active_tree(StackEntry* popped = nullptr)
+	{
+		uint32_t current_swaps = swaps.load(std::memory_order_seq_cst);
+		CallTree& tree = trees[current_swaps & 1];
+		if (stack_swaps != current_swaps)
+		{
+			uint32_t parent = CallTree::root;
+			for (StackEntry& entry : stack)
+				parent = entry.node = tree.child(parent, entry.method);
+			if (popped)
+				popped->node = tree.child(parent, popped->method);
+			stack_swaps = current_swaps;
+		}
+		return tree;
+	}
+
+	// Hands the currently active table and call tree over to the caller and makes the owner thread
+	// continue in the other ones. Returns the index of the old pair, which belongs to the caller until the next swap.
+	// Only one caller at a time. Needs lock: all_instances_mut
+	uint32_t swap_tables()
+	{
+		uint32_t old_table = swaps.fetch_add(1, std::memory_order_seq_cst) & 1;
+		while (writing.load(std::memory_order_acquire))
+			std::this_thread::yield();
+		return old_table;
+	}
+
+	// Measures inner_overhead and outer_overhead by timing synthetic empty calls
+	// nested in a synthetic parent. Must be called before any real method is profiled.
+	static void calibrate_overhead()
+	{
+		static char parent_method, child_method;
+		const int calls = 10000;
+		const uint32_t state = ProfilerControl::state();
+
+		nanoseconds best_inner = nanoseconds::max();
+		nanoseconds best_outer = nanoseconds::max();
+		// Take the best of several rounds to filter out preemption and cache misses
+		for (int round = 0; round < 5; round++)
+		{
+			ThreadProfilerInfo info(0);
+			info.enter_method(&parent_method, state);
+			for (int i = 0; i < calls; i++)
+			{
+				info.enter_method(&child_method, state);
+				info.leave_method(&child_method, state);
+			}
+			info.leave_method(&parent_method, state);
+
+			table_t& table = info.tables[info.swaps.load() & 1];
+			best_inner = std::min(best_inner, table.get(&child_method).total_runtime / calls);
+			best_outer = std::min(best_outer, table.get(&parent_method).self_runtime / calls);
+		}
+
+		inner_overhead = best_inner;
+		outer_overhead = best_outer;
 	}
 
 	struct Row
 	{
 		uint32_t thread_id;
-		const char* name;
+		const std::string* thread_name; // Owned by the dump's Snapshot
+		void* method;
+		const MethodHistograms* histograms; // Owned by the dump's Snapshot, null if histograms are disabled
 		uint64_t count;
 		int64_t total_runtime;
 		int64_t self_runtime;
+		int64_t corrected_total_runtime;
+		int64_t corrected_self_runtime;
 		uint64_t total_allocation;
+		uint64_t self_allocation;
+		int64_t blocked_time;
+		int64_t error_bound;
 	};
 
-	static void dump()
+	// Stats of one method summed over all threads
+	struct MergedRow
 	{
-		std::vector<Row> rows;
+		uint32_t thread_count = 0;
+		uint64_t count = 0;
+		int64_t total_runtime = 0;
+		int64_t self_runtime = 0;
+		int64_t corrected_total_runtime = 0;
+		int64_t corrected_self_runtime = 0;
+		uint64_t total_allocation = 0;
+		uint64_t self_allocation = 0;
+		int64_t blocked_time = 0;
+		int64_t error_bound = 0;
+
+		void add(const MergedRow& other)
+		{
+			thread_count += other.thread_count;
+			count += other.count;
+			total_runtime += other.total_runtime;
+			self_runtime += other.self_runtime;
+			corrected_total_runtime += other.corrected_total_runtime;
+			corrected_self_runtime += other.corrected_self_runtime;
+			total_allocation += other.total_allocation;
+			self_allocation += other.self_allocation;
+			blocked_time += other.blocked_time;
+			error_bound += other.error_bound;
+		}
+
+		void add(const Row& row)
+		{
+			add(MergedRow{ 1, row.count, row.total_runtime, row.self_runtime, row.corrected_total_runtime,
+				row.corrected_self_runtime, row.total_allocation, row.self_allocation, row.blocked_time, row.error_bound });
+		}
+	};
+
+	static void reset()
+	{
+		std::vector<ThreadProfilerInfo*> exited;
 		{
 			std::lock_guard guard(all_instances_mut);
 			for (auto& thread_info : all_instances)
 			{
-				table_t thread_table(thread_info->get_table());
-				for (const auto& entry : thread_table)
+				thread_info->clear_buffers(thread_info->swap_tables());
+				// The other buffers are only handed over once the owner has empty ones to continue in
+				if (thread_info->live_read)
+					thread_info->clear_buffers(thread_info->swap_tables());
+				thread_info->live_read = false;
+			}
+			exited.swap(retired);
+			window_start = ProfilerClock::now();
+		}
+		// Not under the lock, the destructor takes it
+		for (ThreadProfilerInfo* thread_info : exited)
+			delete thread_info;
+	}
+
+	struct Snapshot
+	{
+		std::vector<Row> rows;
+		std::vector<std::pair<std::string, CallTree>> call_trees; // Keyed by thread label
+		MethodTable<ClassAllocationStats> class_allocations = MethodTable<ClassAllocationStats>(1024);
+		std::vector<std::unique_ptr<MethodTable<MethodHistograms>>> histograms; // Referenced by rows
+		std::deque<std::string> thread_names;                                   // Referenced by rows
+		ShadowStackStats shadow_stack;
+		uint64_t evicted_count = 0; // Method entries evicted because of max_methods
+		int64_t duration_ns = 0;    // Time since the previous dump or reset
+	};
+
+	// Takes everything collected since the previous dump from all threads, including the ones that exited since.
+	// Returns the job that writes it, which can run on any thread.
+	static DumpWriter::Job dump()
+	{
+		auto snapshot = std::make_shared<Snapshot>();
+		std::vector<ThreadProfilerInfo*> exited;
+		{
+			std::lock_guard guard(all_instances_mut);
+			for (auto& thread_info : all_instances)
+				take_stats(thread_info, *snapshot);
+			for (auto& thread_info : retired)
+				take_stats(thread_info, *snapshot);
+			exited.swap(retired);
+
+			uint64_t now = ProfilerClock::now();
+			snapshot->duration_ns = ProfilerClock::to_ns(now - window_start).count();
+			window_start = now;
+		}
+		// Not under the lock, the destructor takes it
+		for (ThreadProfilerInfo* thread_info : exited)
+			delete thread_info;
+
+		return [snapshot] { write(*snapshot); };
+	}
+
+	// Adds the method stats every thread recorded since the previous call to `delta` for the live server.
+	// The buffers are only read, so the next dump still takes everything along with the call trees and histograms
+	// that belong to it. Returns the number of threads that recorded anything.
+	static uint32_t collect_live(MethodTable<LiveMethodStats>& delta)
+	{
+		uint32_t thread_count = 0;
+		uint32_t thread_index = 0;
+		MethodTable<uint32_t> last_thread(1024); // Index of the last thread counted in a method's thread_count
+
+		auto collect = [&](ThreadProfilerInfo* thread_info) {
+			thread_index++;
+			bool recorded = false;
+			// The owner continues in the other buffers, which still have what it recorded before the previous swap.
+			// Both keep accumulating until the dump, so only the growth since they were last read is new.
+			uint32_t old_table = thread_info->swap_tables();
+			thread_info->live_read = true;
+			const table_t& table = thread_info->tables[old_table];
+			MethodTable<LiveMethodStats>& sent = thread_info->live_sent[old_table];
+			table.for_each([&](void* method, const MethodStats& stats) {
+				LiveMethodStats& previous = sent.get(method);
+				// An entry that was evicted and added again since starts over
+				if (previous.call_count > stats.call_count)
+					previous = LiveMethodStats{};
+				if (previous.call_count == stats.call_count)
+					return;
+				recorded = true;
+
+				LiveMethodStats& total = delta.get(method);
+				uint32_t& last = last_thread.get(method);
+				if (last != thread_index)
 				{
-					rows.push_back(Row{
-						.thread_id = thread_info->thread_id,
-						.name = mono_method_full_name(entry.first),
-						.count = entry.second.call_count,
-						.total_runtime = entry.second.total_runtime.count(),
-						.self_runtime = entry.second.self_runtime.count(),
-						.total_allocation = entry.second.total_allocation });
+					total.thread_count++;
+					last = thread_index;
 				}
+				total.call_count += stats.call_count - previous.call_count;
+				total.total_runtime += stats.total_runtime.count() - previous.total_runtime;
+				total.self_runtime += stats.self_runtime.count() - previous.self_runtime;
+				total.total_allocation += stats.total_allocation - previous.total_allocation;
+				total.self_allocation += stats.self_allocation - previous.self_allocation;
+
+				previous.call_count = stats.call_count;
+				previous.total_runtime = stats.total_runtime.count();
+				previous.self_runtime = stats.self_runtime.count();
+				previous.total_allocation = stats.total_allocation;
+				previous.self_allocation = stats.self_allocation;
+			});
+			// Methods evicted from the table would otherwise pile up in `sent` with a max_methods cap
+			if (sent.size() > table.size())
+			{
+				std::vector<void*> stale;
+				sent.for_each([&](void* method, const LiveMethodStats&) {
+					if (!table.find(method))
+						stale.push_back(method);
+				});
+				for (void* method : stale)
+					sent.erase(method);
 			}
+			thread_count += recorded ? 1 : 0;
+		};
+
+		std::lock_guard guard(all_instances_mut);
+		for (auto& thread_info : all_instances)
+			collect(thread_info);
+		for (auto& thread_info : retired)
+			collect(thread_info);
+		return thread_count;
+	}
+
+	// Moves the stats of one thread into the snapshot. Needs lock: all_instances_mut
+	static void take_stats(ThreadProfilerInfo* thread_info, Snapshot& snapshot)
+	{
+		uint32_t old_table = thread_info->swap_tables();
+		table_t* dumped_table = &thread_info->tables[old_table];
+		EvictedEntries<MethodStats>* dumped_evicted = &thread_info->evicted[old_table];
+		const std::string& thread_name = snapshot.thread_names.emplace_back(ThreadRegistry::name(thread_info->thread_record.get()));
+
+		// Histograms are too big to copy per row, the whole table is handed over instead
+		MethodTable<MethodHistograms>* thread_histograms = nullptr;
+		if (thread_info->histograms[old_table])
+		{
+			auto replacement = std::make_unique<MethodTable<MethodHistograms>>(thread_info->histograms[old_table]->size() * 2);
+			thread_histograms = thread_info->histograms[old_table].get();
+			snapshot.histograms.push_back(std::exchange(thread_info->histograms[old_table], std::move(replacement)));
 		}
+		take_side_stats(thread_info, old_table, snapshot);
 
-		std::ofstream fs;
+		// Since the live server read the buffers, the ones the owner is in now hold stats of this window as well.
+		// They're only handed over once the owner can continue in empty ones, so the first buffers are merged
+		// into a table of the snapshot and emptied before swapping again.
+		table_t merged(16);
+		EvictedEntries<MethodStats> merged_evicted;
+		if (thread_info->live_read)
+		{
+			HeavyHitters<MethodStats>::merge(merged, merged_evicted, *dumped_table, *dumped_evicted, profiler_options.max_methods);
+			dumped_table->clear();
+			*dumped_evicted = EvictedEntries<MethodStats>{};
 
-		fs.open("MonoProfilerOutput.csv", std::fstream::out | std::fstream::trunc);
+			old_table = thread_info->swap_tables();
+			HeavyHitters<MethodStats>::merge(merged, merged_evicted, thread_info->tables[old_table], thread_info->evicted[old_table], profiler_options.max_methods);
+			thread_info->tables[old_table].clear();
+			thread_info->evicted[old_table] = EvictedEntries<MethodStats>{};
+			if (thread_histograms)
+			{
+				thread_info->histograms[old_table]->for_each([&](void* method, const MethodHistograms& histograms) {
+					thread_histograms->get(method).add(histograms);
+				});
+				thread_info->histograms[old_table]->clear();
+			}
+			take_side_stats(thread_info, old_table, snapshot);
 
+			thread_info->live_sent[0].clear();
+			thread_info->live_sent[1].clear();
+			thread_info->live_read = false;
+			dumped_table = &merged;
+			dumped_evicted = &merged_evicted;
+		}
+
+		dumped_table->for_each([&](void* method, const MethodStats& stats) {
+			snapshot.rows.push_back(Row{
+				.thread_id = thread_info->thread_id,
+				.thread_name = &thread_name,
+				.method = method,
+				.histograms = thread_histograms ? thread_histograms->find(method) : nullptr,
+				.count = stats.call_count,
+				.total_runtime = stats.total_runtime.count(),
+				.self_runtime = stats.self_runtime.count(),
+				.corrected_total_runtime = stats.corrected_total_runtime.count(),
+				.corrected_self_runtime = stats.corrected_self_runtime.count(),
+				.total_allocation = stats.total_allocation,
+				.self_allocation = stats.self_allocation,
+				.blocked_time = stats.blocked_time.count(),
+				.error_bound = stats.error_bound });
+		});
+		dumped_table->clear();
+
+		// Everything that was evicted from the thread's table becomes one row
+		if (dumped_evicted->count > 0)
+		{
+			const MethodStats& stats = dumped_evicted->stats;
+			snapshot.rows.push_back(Row{
+				.thread_id = thread_info->thread_id,
+				.thread_name = &thread_name,
+				.method = &evicted_methods,
+				.histograms = nullptr,
+				.count = stats.call_count,
+				.total_runtime = stats.total_runtime.count(),
+				.self_runtime = stats.self_runtime.count(),
+				.corrected_total_runtime = stats.corrected_total_runtime.count(),
+				.corrected_self_runtime = stats.corrected_self_runtime.count(),
+				.total_allocation = stats.total_allocation,
+				.self_allocation = stats.self_allocation,
+				.blocked_time = stats.blocked_time.count(),
+				.error_bound = 0 });
+			snapshot.evicted_count += dumped_evicted->count;
+			*dumped_evicted = EvictedEntries<MethodStats>{};
+		}
+	}
+
+	// Moves what is simply added up over the buffers into the snapshot: class allocations, shadow stack counts
+	// and the call tree. Needs lock: all_instances_mut
+	static void take_side_stats(ThreadProfilerInfo* thread_info, uint32_t old_table, Snapshot& snapshot)
+	{
+		MethodTable<ClassAllocationStats>& thread_allocations = thread_info->class_allocations[old_table];
+		thread_allocations.for_each([&](void* klass, const ClassAllocationStats& stats) {
+			ClassAllocationStats& total = snapshot.class_allocations.get(klass);
+			total.count += stats.count;
+			total.bytes += stats.bytes;
+		});
+		thread_allocations.clear();
+
+		snapshot.shadow_stack.add(thread_info->shadow_stack_stats[old_table]);
+		thread_info->shadow_stack_stats[old_table] = ShadowStackStats{};
+
+		// A thread can have two trees when the live server was reading, folded stack tools add up identical paths
+		CallTree& tree = thread_info->trees[old_table];
+		if (profiler_options.call_tree && !tree.empty())
+			snapshot.call_trees.emplace_back(ThreadRegistry::label(thread_info->thread_record.get(), thread_info->thread_id), std::move(tree));
+	}
+
+	static void write(Snapshot& snapshot)
+	{
+		if (profiler_options.call_tree)
+			dump_call_trees(snapshot.call_trees);
+		if (profiler_options.allocations == AllocationTracking::Events)
+			dump_class_allocations(snapshot.class_allocations);
+		if (profiler_options.merged_output)
+			dump_merged(snapshot.rows, snapshot.duration_ns);
+		if (profiler_options.rollups)
+			dump_rollups(snapshot.rows);
+
+		std::vector<Row>& rows = snapshot.rows;
 
 		//Sort by time
 		sort(rows.begin(), rows.end(), [=](auto& a, auto& b) {
 			return a.total_runtime > b.total_runtime;
 		});
 
-		fs << "\"Thread\",\"Call count\",\"Method name\",\"Total runtime (ns)\",\"Self runtime (ns)\",\"Total allocation (bytes)\"" << std::endl;
+		std::ostringstream fs;
+		fs << "\"Thread\",\"Thread name\",\"Call count\",\"Method name\",\"Total runtime (ns)\",\"Self runtime (ns)\",\"Corrected total runtime (ns)\",\"Corrected self runtime (ns)\",\"Total allocation (bytes)\",\"Self allocation (bytes)\",\"Blocked time (ns)\"";
+		write_error_bound_header(fs);
+		write_histogram_header(fs);
+		fs << "\n";
 
 		//Dump into csv
 		for (auto& it : rows)
 		{
-			fs << it.thread_id << "," << it.count << ",\"" << it.name << "\"," <<
-				it.total_runtime << "," << it.self_runtime << "," << it.total_allocation << std::endl;
+			fs << it.thread_id << ",\"" << *it.thread_name << "\"," << it.count << ",\"" << method_name(it.method) << "\"," <<
+				it.total_runtime << "," << it.self_runtime << "," << it.corrected_total_runtime << "," << it.corrected_self_runtime << "," << it.total_allocation << "," << it.self_allocation << "," << it.blocked_time;
+			write_error_bound_column(fs, it.error_bound);
+			write_histogram_columns(fs, it.histograms);
+			fs << "\n";
+		}
+
+		// Lets tools compare captures of different lengths
+		fs << "\"Capture duration (ns)\"," << snapshot.duration_ns << "\n";
+
+		const ShadowStackStats& shadow_stack = snapshot.shadow_stack;
+		if (shadow_stack.exception_frames > 0)
+			fs << "\"" << shadow_stack.exception_frames << " calls were ended by exceptions\"\n";
+		if (shadow_stack.resynced_frames > 0)
+			fs << "\"" << shadow_stack.resynced_frames << " calls had no leave event, they were ended when their caller returned\"\n";
+		if (shadow_stack.dropped_leaves > 0)
+			fs << "\"" << shadow_stack.dropped_leaves << " calls could not be matched to their start and are missing\"\n";
+		if (snapshot.evicted_count > 0)
+			fs << "\"" << snapshot.evicted_count << " method entries were evicted to stay under the method cap, their stats are in the " << evicted_methods_name << " rows\"\n";
+
+		DumpWriter::write_file("MonoProfilerOutput.csv", fs.str());
+	}
+
+	static void dump_class_allocations(const MethodTable<ClassAllocationStats>& class_allocations)
+	{
+		struct ClassRow
+		{
+			const char* name_space;
+			const char* name;
+			ClassAllocationStats stats;
+		};
+
+		std::vector<ClassRow> rows;
+		rows.reserve(class_allocations.size());
+		class_allocations.for_each([&](void* klass, const ClassAllocationStats& stats) {
+			rows.push_back(ClassRow{ mono_class_get_namespace(klass), mono_class_get_name(klass), stats });
+		});
+
+		std::sort(rows.begin(), rows.end(), [](auto& a, auto& b) {
+			return a.stats.bytes > b.stats.bytes;
+		});
+
+		std::ostringstream fs;
+		fs << "\"Namespace\",\"Class\",\"Allocation count\",\"Allocated (bytes)\"\n";
+		for (auto& it : rows)
+			fs << "\"" << it.name_space << "\",\"" << it.name << "\"," << it.stats.count << "," << it.stats.bytes << "\n";
+		DumpWriter::write_file("MonoProfilerAllocations.csv", fs.str());
+	}
+
+	static void dump_call_trees(const std::vector<std::pair<std::string, CallTree>>& call_trees)
+	{
+		std::ostringstream fs;
+		for (auto& [label, tree] : call_trees)
+			tree.write_folded(fs, label, MethodNames::get);
+		DumpWriter::write_file("MonoProfilerCallTree.folded", fs.str());
+	}
+
+	// Sums the rows of every method over all threads and writes them to MonoProfilerOutputByMethod.csv.
+	// Large dumps are split between several threads that each reduce a slice of the rows, the partial
+	// tables are then added up.
+	static void dump_merged(const std::vector<Row>& rows, int64_t duration_ns)
+	{
+		const size_t rows_per_worker = 1 << 14;
+		size_t worker_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), rows.size() / rows_per_worker + 1);
+		size_t slice = (rows.size() + worker_count - 1) / worker_count;
+
+		std::vector<MethodTable<MergedRow>> partials;
+		std::vector<std::unique_ptr<MethodTable<MethodHistograms>>> partial_histograms;
+		for (size_t i = 0; i < worker_count; i++)
+		{
+			partials.emplace_back(1024);
+			if (profiler_options.histograms)
+				partial_histograms.push_back(std::make_unique<MethodTable<MethodHistograms>>(1024));
+		}
+
+		auto reduce = [&](size_t worker) {
+			size_t end = std::min(rows.size(), (worker + 1) * slice);
+			for (size_t i = worker * slice; i < end; i++)
+			{
+				partials[worker].get(rows[i].method).add(rows[i]);
+				if (rows[i].histograms)
+					partial_histograms[worker]->get(rows[i].method).add(*rows[i].histograms);
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (size_t i = 1; i < worker_count; i++)
+			workers.emplace_back(reduce, i);
+		reduce(0);
+		for (auto& worker : workers)
+			worker.join();
+
+		MethodTable<MergedRow>& merged = partials[0];
+		for (size_t i = 1; i < worker_count; i++)
+		{
+			partials[i].for_each([&](void* method, const MergedRow& row) {
+				merged.get(method).add(row);
+			});
+			if (profiler_options.histograms)
+			{
+				partial_histograms[i]->for_each([&](void* method, const MethodHistograms& histograms) {
+					partial_histograms[0]->get(method).add(histograms);
+				});
+			}
+		}
+
+		std::vector<std::pair<void*, MergedRow>> sorted;
+		sorted.reserve(merged.size());
+		merged.for_each([&](void* method, const MergedRow& row) {
+			sorted.emplace_back(method, row);
+		});
+		std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) {
+			return a.second.total_runtime > b.second.total_runtime;
+		});
+
+		std::ostringstream fs;
+		fs << "\"Threads\",\"Call count\",\"Method name\",\"Total runtime (ns)\",\"Self runtime (ns)\",\"Corrected total runtime (ns)\",\"Corrected self runtime (ns)\",\"Total allocation (bytes)\",\"Self allocation (bytes)\",\"Blocked time (ns)\"";
+		write_error_bound_header(fs);
+		write_histogram_header(fs);
+		fs << "\n";
+		for (auto& [method, it] : sorted)
+		{
+			fs << it.thread_count << "," << it.count << ",\"" << method_name(method) << "\"," <<
+				it.total_runtime << "," << it.self_runtime << "," << it.corrected_total_runtime << "," << it.corrected_self_runtime << "," << it.total_allocation << "," << it.self_allocation << "," << it.blocked_time;
+			write_error_bound_column(fs, it.error_bound);
+			write_histogram_columns(fs, profiler_options.histograms ? partial_histograms[0]->find(method) : nullptr);
+			fs << "\n";
 		}
+		fs << "\"Capture duration (ns)\"," << duration_ns << "\n";
+		DumpWriter::write_file("MonoProfilerOutputByMethod.csv", fs.str());
+	}
+
+	// Sums the self stats of all rows per class, namespace and assembly and writes them to MonoProfilerRollup.csv.
+	// Only self numbers add up, a total runtime would count calls between methods of the same class twice.
+	static void dump_rollups(const std::vector<Row>& rows)
+	{
+		struct Rollup
+		{
+			uint64_t methods = 0;
+			uint64_t count = 0;
+			int64_t self_runtime = 0;
+			int64_t corrected_self_runtime = 0;
+			uint64_t self_allocation = 0;
+			int64_t blocked_time = 0;
+
+			void add(const MergedRow& row)
+			{
+				methods++;
+				count += row.count;
+				self_runtime += row.self_runtime;
+				corrected_self_runtime += row.corrected_self_runtime;
+				self_allocation += row.self_allocation;
+				blocked_time += row.blocked_time;
+			}
+		};
+
+		// Owners are looked up once per method, not once per thread and method
+		MethodTable<MergedRow> by_method(1024);
+		for (const Row& row : rows)
+			by_method.get(row.method).add(row);
 
-		fs.close();
+		std::unordered_map<uint32_t, Rollup> levels[3]; // Keyed by MethodOwner ids: assembly, namespace, class
+		Rollup evicted;
+		int64_t self_sum = 0;
+		by_method.for_each([&](void* method, const MergedRow& row) {
+			self_sum += row.self_runtime;
+			if (method == &evicted_methods)
+			{
+				evicted.add(row);
+				return;
+			}
+			MethodOwner owner = MethodOwners::get(method);
+			levels[0][owner.assembly_id].add(row);
+			levels[1][owner.namespace_id].add(row);
+			levels[2][owner.class_id].add(row);
+		});
+
+		static const char* level_names[3] = { "Assembly", "Namespace", "Class" };
+		std::ostringstream fs;
+		fs << "\"Level\",\"Name\",\"Methods\",\"Call count\",\"Self runtime (ns)\",\"Self runtime (%)\",\"Corrected self runtime (ns)\",\"Self allocation (bytes)\",\"Blocked time (ns)\"\n";
+		auto write_row = [&](const char* level, const std::string& name, const Rollup& it) {
+			fs << "\"" << level << "\",\"" << name << "\"," << it.methods << "," << it.count << "," << it.self_runtime << "," <<
+				(self_sum > 0 ? 100.0 * it.self_runtime / self_sum : 0.0) << "," << it.corrected_self_runtime << "," << it.self_allocation << "," << it.blocked_time << "\n";
+		};
+		for (int level = 0; level < 3; level++)
+		{
+			std::vector<std::pair<uint32_t, Rollup>> sorted(levels[level].begin(), levels[level].end());
+			std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) {
+				return a.second.self_runtime > b.second.self_runtime;
+			});
+			for (auto& [id, it] : sorted)
+				write_row(level_names[level], MethodOwners::name(id), it);
+			if (evicted.methods > 0)
+				write_row(level_names[level], evicted_methods_name, evicted);
+		}
+		DumpWriter::write_file("MonoProfilerRollup.csv", fs.str());
+	}
+
+	// Key of the rows that sum up the evicted methods, never a real method
+	static inline char evicted_methods = 0;
+	static constexpr const char* evicted_methods_name = "[Evicted methods]";
+
+	static const char* method_name(void* method)
+	{
+		return method == &evicted_methods ? evicted_methods_name : MethodNames::get(method);
+	}
+
+	// The error bound is only added with max_methods, without it every row is exact
+	static void write_error_bound_header(std::ostream& out)
+	{
+		if (profiler_options.max_methods != 0)
+			out << ",\"Max missing self runtime (ns)\"";
+	}
+
+	static void write_error_bound_column(std::ostream& out, int64_t error_bound)
+	{
+		if (profiler_options.max_methods != 0)
+			out << "," << error_bound;
+	}
+
+	static void write_histogram_header(std::ostream& out)
+	{
+		if (!profiler_options.histograms)
+			return;
+		LatencyHistogram::write_header(out, "Total");
+		LatencyHistogram::write_header(out, "Self");
+	}
+
+	static void write_histogram_columns(std::ostream& out, const MethodHistograms* histograms)
+	{
+		if (!profiler_options.histograms)
+			return;
+		static const MethodHistograms empty;
+		if (!histograms)
+			histograms = &empty;
+		histograms->total.write_columns(out);
+		histograms->self.write_columns(out);
 	}
 };
 
 std::mutex ThreadProfilerInfo::all_instances_mut;
 std::set<ThreadProfilerInfo*> ThreadProfilerInfo::all_instances;
+std::vector<ThreadProfilerInfo*> ThreadProfilerInfo::retired;
+uint64_t ThreadProfilerInfo::window_start = 0;
 
 static thread_local ThreadProfilerInfo* thread_profiler_info;
+static thread_local CounterThread* counter_thread; // Only used in ProfilerMode::Count
+
+static void thread_detach();
+
+#ifndef _WIN32
+// There is no DLL_THREAD_DETACH outside of Windows, the destructor of a thread_local runs at the same point instead.
+// It's only registered once the thread touches it, see create_thread_profiler_info.
+struct ThreadDetachGuard
+{
+	~ThreadDetachGuard() { thread_detach(); }
+};
+static thread_local ThreadDetachGuard thread_detach_guard;
+
+// Using the guard constructs it on the calling thread, which registers its destructor
+static void arm_thread_detach_guard()
+{
+	static_cast<void>(&thread_detach_guard);
+}
+#endif
+
+static ThreadProfilerInfo* create_thread_profiler_info()
+{
+	// The registry's thread_local has to be created first, so it's still alive when the guard runs
+	std::shared_ptr<ThreadRecord> record = ThreadRegistry::current();
+#ifndef _WIN32
+	arm_thread_detach_guard();
+#endif
+	thread_profiler_info = new ThreadProfilerInfo(mono_thread_current()->small_id);
+	thread_profiler_info->thread_record = std::move(record);
+	return thread_profiler_info;
+}
+
+static CounterThread* create_counter_thread()
+{
+	std::shared_ptr<ThreadRecord> record = ThreadRegistry::current();
+#ifndef _WIN32
+	arm_thread_detach_guard();
+#endif
+	counter_thread = CallCounter::add_thread(mono_thread_current()->small_id, std::move(record));
+	return counter_thread;
+}
 
+#ifdef _WIN32
+// Only called from DllMain
 static void shutdown(void* prof)
 {
 	//dump();
 }
+#endif
 
 static void method_enter(void* prof, void* method)
 {
+	uint32_t state = ProfilerControl::state();
+	if (!(state & ProfilerControl::enabled_bit))
+		return;
+
 	if (!thread_profiler_info)
-	{
-		thread_profiler_info = new ThreadProfilerInfo();
-	}
-	thread_profiler_info->enter_method(method);
+		create_thread_profiler_info();
+	thread_profiler_info->enter_method(method, state);
 }
 
+// The only hook installed in ProfilerMode::Count
+static void count_enter(void* prof, void* method)
+{
+	if (!(ProfilerControl::state() & ProfilerControl::enabled_bit))
+		return;
+
+	if (!counter_thread)
+		create_counter_thread();
+	counter_thread->count(method);
+}
 
 static void method_leave(void* prof, void* method)
 {
+	uint32_t state = ProfilerControl::state();
+	if (!(state & ProfilerControl::enabled_bit))
+		return;
+
+	if (thread_profiler_info)
+		thread_profiler_info->leave_method(method, state);
+}
+
+// Called instead of method_leave for every frame unwound by an exception
+static void exception_method_leave(void* prof, void* method)
+{
+	uint32_t state = ProfilerControl::state();
+	if (!(state & ProfilerControl::enabled_bit))
+		return;
+
 	if (thread_profiler_info)
-		thread_profiler_info->leave_method(method);
+		thread_profiler_info->leave_method(method, state, true);
+}
+
+static void exception_thrown(void* prof, MonoObject* exception)
+{
+}
+
+static void exception_clause(void* prof, void* method, int clause_type, int clause_num)
+{
+}
+
+static void jit_finished(void* method, int32_t code_size, bool failed)
+{
+	uint64_t ticks = JitRecorder::compile_finished(method, code_size, failed);
+	if (profiler_options.jit_subtract && thread_profiler_info)
+		thread_profiler_info->jit_ticks += ticks;
+}
+
+static void jit_started(void* prof, void* method)
+{
+	JitRecorder::compile_started(method);
+}
+
+static void jit_ended(void* prof, void* method, int result)
+{
+	jit_finished(method, -1, result != MONO_PROFILE_OK);
+}
+
+static void jit_ended_with_info(void* prof, void* method, void* jinfo, int result)
+{
+	bool failed = result != MONO_PROFILE_OK || !jinfo;
+	jit_finished(method, failed ? -1 : mono_jit_info_get_code_size(jinfo), failed);
+}
+
+static void object_allocated(void* prof, MonoObject* obj, void* klass)
+{
+	if (!(ProfilerControl::state() & ProfilerControl::enabled_bit))
+		return;
+
+	if (!thread_profiler_info)
+		create_thread_profiler_info();
+	thread_profiler_info->allocation(klass, mono_object_get_size(obj));
+}
+
+static void gc_event(void* prof, MonoGCEvent event, int generation)
+{
+	GcRecorder::gc_event(event, generation);
+}
+
+static void gc_heap_resize(void* prof, int64_t new_size)
+{
+	GcRecorder::heap_resized(new_size);
+}
+
+// Installs the JIT hooks if enabled and returns `events` plus the JIT ones
+static MonoProfileFlags add_jit_events(MonoProfileFlags events)
+{
+	if (!profiler_options.jit_events || !mono_profiler_install_jit_compile)
+		return events;
+
+	JitRecorder::start();
+	if (mono_profiler_install_jit_end && mono_jit_info_get_code_size)
+	{
+		mono_profiler_install_jit_compile(jit_started, nullptr);
+		mono_profiler_install_jit_end(jit_ended_with_info);
+	}
+	else
+	{
+		mono_profiler_install_jit_compile(jit_started, jit_ended);
+	}
+	return static_cast<MonoProfileFlags>(events | MONO_PROFILE_JIT_COMPILATION);
+}
+
+static void monitor_event(void* prof, MonoObject* obj, MonoProfilerMonitorEvent event)
+{
+	if (event == MONO_PROFILER_MONITOR_CONTENTION)
+	{
+		MonitorRecorder::contention_started(obj);
+		return;
+	}
+
+	uint64_t ticks = MonitorRecorder::contention_finished(event == MONO_PROFILER_MONITOR_DONE);
+	if (thread_profiler_info && (ProfilerControl::state() & ProfilerControl::enabled_bit))
+		thread_profiler_info->monitor_wait(ticks);
+}
+
+// Installs the monitor hook if enabled and returns `events` plus the monitor ones
+static MonoProfileFlags add_monitor_events(MonoProfileFlags events)
+{
+	if (!profiler_options.monitor_events || !mono_profiler_install_monitor || !mono_object_get_class)
+		return events;
+
+	MonitorRecorder::start();
+	mono_profiler_install_monitor(monitor_event);
+	return static_cast<MonoProfileFlags>(events | MONO_PROFILE_MONITOR_EVENTS);
+}
+
+static void assembly_load_started(void* prof, void* assembly)
+{
+	LoadRecorder::load_started(LoadKind::Assembly, assembly);
+}
+
+static void assembly_load_ended(void* prof, void* assembly, int result)
+{
+	LoadRecorder::load_finished(LoadKind::Assembly, assembly, result != MONO_PROFILE_OK);
+}
+
+static void class_load_started(void* prof, void* klass)
+{
+	LoadRecorder::load_started(LoadKind::Class, klass);
+}
+
+static void class_load_ended(void* prof, void* klass, int result)
+{
+	LoadRecorder::load_finished(LoadKind::Class, klass, result != MONO_PROFILE_OK);
+}
+
+// Installs the assembly and class load hooks if enabled and returns `events` plus the load ones.
+// Static constructors are timed by the enter/leave hooks, so they're only recorded in ProfilerMode::Instrument.
+static MonoProfileFlags add_load_events(MonoProfileFlags events)
+{
+	if (!profiler_options.load_events || !mono_profiler_install_assembly || !mono_profiler_install_class)
+		return events;
+
+	LoadRecorder::start();
+	mono_profiler_install_assembly(assembly_load_started, assembly_load_ended, nullptr, nullptr);
+	mono_profiler_install_class(class_load_started, class_load_ended, nullptr, nullptr);
+	return static_cast<MonoProfileFlags>(events | MONO_PROFILE_ASSEMBLY_EVENTS | MONO_PROFILE_CLASS_EVENTS);
+}
+
+static void thread_started(void* prof, uintptr_t tid)
+{
+	ThreadRegistry::thread_started();
+}
+
+static void thread_ended(void* prof, uintptr_t tid)
+{
+	ThreadRegistry::thread_ended();
+	// The runtime is done with the thread, so its stats are handed over now instead of when the OS thread exits
+	thread_detach();
+}
+
+static void thread_named(void* prof, uintptr_t tid, const char* name)
+{
+	ThreadRegistry::thread_named(tid, name);
+}
+
+// Installs the thread hooks if the runtime has them and returns `events` plus the thread ones
+static MonoProfileFlags add_thread_events(MonoProfileFlags events)
+{
+	ThreadRegistry::start();
+	if (!mono_profiler_install_thread)
+		return events;
+
+	mono_profiler_install_thread(thread_started, thread_ended);
+	if (mono_profiler_install_thread_name)
+		mono_profiler_install_thread_name(thread_named);
+	return static_cast<MonoProfileFlags>(events | MONO_PROFILE_THREADS);
+}
+
+// Installs the GC hooks if enabled and turns on `events` plus the GC ones. Must be the last install step.
+static void add_gc_events(MonoProfileFlags events)
+{
+	if (profiler_options.gc_events)
+	{
+		GcRecorder::start();
+		mono_profiler_install_gc(gc_event, gc_heap_resize);
+		events = static_cast<MonoProfileFlags>(events | MONO_PROFILE_GC);
+	}
+	mono_profiler_set_events(events);
+}
+
+static void sample_hit(void* prof, guint8* ip, void* context)
+{
+	if (!(ProfilerControl::state() & ProfilerControl::enabled_bit))
+		return;
+
+	void* ips[1] = { ip };
+	Sampler::hit(ips, 1);
+}
+
+static void sample_call_chain(void* prof, int call_chain_depth, guint8** ip, void* context)
+{
+	if (!(ProfilerControl::state() & ProfilerControl::enabled_bit))
+		return;
+
+	Sampler::hit(reinterpret_cast<void**>(ip), static_cast<uint32_t>(call_chain_depth));
+}
+
+// Sampling replaces enter/leave instrumentation completely, so none of the ThreadProfilerInfo machinery is used
+static void add_sampling_profiler()
+{
+	Sampler::start();
+
+	mono_profiler_install(NULL, NULL);
+	uint32_t depth = std::min<uint32_t>(profiler_options.sample_call_depth, SAMPLE_MAX_FRAMES);
+	if (depth > 1 && mono_profiler_install_statistical_call_chain)
+		mono_profiler_install_statistical_call_chain(sample_call_chain, depth, MONO_PROFILER_CALL_CHAIN_MANAGED);
+	else
+		mono_profiler_install_statistical(sample_hit);
+	add_gc_events(add_thread_events(add_load_events(add_monitor_events(add_jit_events(MONO_PROFILE_STATISTICAL)))));
+}
+
+// Counting only needs the enter hook. The JIT still emits the leave instrumentation, but with no leave
+// callback installed it only costs the runtime's null check, and there is no shadow stack to keep in sync,
+// so exceptions don't need a hook either.
+static void add_call_counter()
+{
+	ProfilerClock::calibrate(profiler_options.clock != ClockSetting::Chrono);
+	CallCounter::start();
+
+	mono_profiler_install(NULL, NULL);
+	mono_profiler_install_enter_leave(count_enter, nullptr);
+	add_gc_events(add_thread_events(add_load_events(add_monitor_events(add_jit_events(MONO_PROFILE_ENTER_LEAVE)))));
 }
 
 static void thread_detach()
 {
 	if (thread_profiler_info)
-		delete thread_profiler_info;
+		ThreadProfilerInfo::retire(thread_profiler_info);
 	thread_profiler_info = nullptr;
+	if (counter_thread)
+		CallCounter::retire(counter_thread);
+	counter_thread = nullptr;
+	ThreadRegistry::thread_detached();
 }
 
-extern "C" void __declspec(dllexport) AddProfiler(HMODULE mono)
+// `mono` is the runtime's module handle on Windows, and a dlopen handle (or null) elsewhere
+PROFILER_EXPORT void AddProfiler(module_handle mono)
 {
 	init_mono_funcs(mono);
 
+	if (profiler_options.mode == ProfilerMode::Sample)
+	{
+		add_sampling_profiler();
+		return;
+	}
+	if (profiler_options.mode == ProfilerMode::Count)
+	{
+		add_call_counter();
+		return;
+	}
+
+	ProfilerClock::calibrate(profiler_options.clock != ClockSetting::Chrono);
+	ThreadProfilerInfo::calibrate_overhead();
+	ThreadProfilerInfo::window_start = ProfilerClock::now();
+
+	// Started after calibration so the synthetic calls don't end up in the trace
+	if (profiler_options.trace)
+		TraceWriter::start("MonoProfilerTrace.bin");
+	if (profiler_options.flight_recorder)
+		FlightRecorder::start();
+	if (profiler_options.live_port != 0)
+		LiveServer::start(static_cast<uint16_t>(profiler_options.live_port), profiler_options.live_interval_ms, ThreadProfilerInfo::collect_live);
+
 	//Install profiler, shutdown doesn't fire so do this manually on DLL_PROCESS_DETACH
 	//prof = new MonoProfiler();
 	mono_profiler_install(NULL, NULL);
 	mono_profiler_install_enter_leave(method_enter, method_leave);
-	mono_profiler_set_events(MONO_PROFILE_ENTER_LEAVE);
+	int events = MONO_PROFILE_ENTER_LEAVE;
+	if (profiler_options.allocations == AllocationTracking::Events)
+	{
+		mono_profiler_install_allocation(object_allocated);
+		events |= MONO_PROFILE_ALLOCATIONS;
+	}
+	// Frames unwound by an exception don't get a regular leave event
+	if (mono_profiler_install_exception)
+	{
+		mono_profiler_install_exception(exception_thrown, exception_method_leave, exception_clause);
+		events |= MONO_PROFILE_EXCEPTIONS;
+	}
+	add_gc_events(add_thread_events(add_load_events(add_monitor_events(add_jit_events(static_cast<MonoProfileFlags>(events))))));
+}
+
+// Must be called before AddProfiler. Returns false if the option is not known.
+PROFILER_EXPORT bool SetOption(const char* name, int64_t value)
+{
+	return profiler_options.set(name, value);
+}
+
+// Snapshots have to be submitted in the order they were taken, and a reset must not take the data of a dump in progress
+static std::mutex dump_mut;
+
+// Takes a snapshot of everything collected since the previous dump and writes it on a background thread.
+// Returns an id for IsDumpFinished, the output files are complete once it returns true.
+PROFILER_EXPORT uint32_t DumpAsync()
+{
+	std::lock_guard guard(dump_mut);
+
+	std::vector<DumpWriter::Job> jobs;
+	if (auto job = GcRecorder::dump())
+		jobs.push_back(std::move(job));
+	if (auto job = JitRecorder::dump())
+		jobs.push_back(std::move(job));
+	if (auto job = MonitorRecorder::dump())
+		jobs.push_back(std::move(job));
+	if (auto job = LoadRecorder::dump())
+		jobs.push_back(std::move(job));
+	jobs.push_back(ThreadRegistry::dump());
+	if (profiler_options.mode == ProfilerMode::Sample)
+		jobs.push_back(Sampler::dump());
+	else if (profiler_options.mode == ProfilerMode::Count)
+		jobs.push_back(CallCounter::dump());
+	else
+		jobs.push_back(ThreadProfilerInfo::dump());
+	return DumpWriter::submit(std::move(jobs));
+}
+
+PROFILER_EXPORT bool IsDumpFinished(uint32_t id)
+{
+	return DumpWriter::is_finished(id);
+}
+
+// Same as DumpAsync, but only returns once the files are written
+PROFILER_EXPORT void Dump()
+{
+	DumpWriter::wait(DumpAsync());
+}
+
+// Called by the game at the end of every frame. Returns true if the frame was over the flight recorder's
+// budget and is being written to a MonoProfilerSlowFrame file. Does nothing unless the flight recorder is enabled.
+PROFILER_EXPORT bool MarkFrame()
+{
+	return FlightRecorder::mark_frame();
+}
+
+// Pauses or resumes profiling. While paused the hooks stay installed but return right away.
+PROFILER_EXPORT void SetEnabled(bool enabled)
+{
+	ProfilerControl::set_enabled(enabled);
+}
+
+// Only profile methods matching `pattern`, see MethodFilter. An empty pattern profiles everything again.
+// Only affects the instrumenting mode.
+PROFILER_EXPORT void SetFilter(const char* pattern)
+{
+	ProfilerControl::set_filter(pattern ? pattern : "");
 }
 
-extern "C" void __declspec(dllexport) Dump()
+// Throws away everything collected since the last dump
+PROFILER_EXPORT void ResetStats()
 {
-	ThreadProfilerInfo::dump();
+	std::lock_guard guard(dump_mut);
+	GcRecorder::reset();
+	JitRecorder::reset();
+	MonitorRecorder::reset();
+	LoadRecorder::reset();
+	ThreadRegistry::reset();
+	if (profiler_options.mode == ProfilerMode::Sample)
+		Sampler::reset();
+	else if (profiler_options.mode == ProfilerMode::Count)
+		CallCounter::reset();
+	else
+		ThreadProfilerInfo::reset();
 }
 
 
+#ifdef _WIN32
 BOOL WINAPI DllMain(HINSTANCE /* hInstDll */, DWORD reasonForDllLoad, LPVOID /* reserved */)
 {
 	if (reasonForDllLoad == DLL_PROCESS_DETACH)
@@ -226,3 +1528,4 @@ BOOL WINAPI DllMain(HINSTANCE /* hInstDll */, DWORD reasonForDllLoad, LPVOID /*
 		thread_detach();
 	return TRUE;
 }
+#endif
@@ -4,82 +4,14 @@
 #include <map>
 #include <fstream>
 #include <time.h>
-#include <Windows.h> // Windows Platform SDK
+
+#include "platform.h"
+#include "mono_types.h"
 
 #define MONO_FUN(name, ret, ...) \
 	typedef ret (*name##_t)(__VA_ARGS__); \
 	static name##_t name;
 
-
-typedef struct {
-	void* vtable;
-	void* synchronisation;
-} MonoObject;
-
-typedef char MonoBoolean;
-typedef void* gpointer;
-typedef unsigned __int16	gunichar2;
-typedef unsigned __int8		guint8;
-typedef unsigned __int32	guint32;
-typedef __int32				gint32;
-typedef unsigned __int64	guint64;
-typedef unsigned long gsize;
-
-struct _MonoThread {
-	MonoObject  obj;
-	int         lock_thread_id; /* to be used as the pre-shifted thread id in thin locks */
-	HANDLE	    handle;
-	void* cached_culture_info;
-	gpointer    unused1;
-	MonoBoolean threadpool_thread;
-	gunichar2* name;
-	guint32	    name_len;
-	guint32	    state;
-	/* MonoException* */ void* abort_exc;
-	int abort_state_handle;
-	guint64 tid;	/* This is accessed as a gsize in the code (so it can hold a 64bit pointer on systems that need it), but needs to reserve 64 bits of space on all machines as it corresponds to a field in managed code */
-	HANDLE	    start_notify;
-	gpointer stack_ptr;
-	gpointer* static_data;
-	gpointer jit_data;
-	gpointer lock_data;
-	/* MonoAppContext* */ void* current_appcontext;
-	int stack_size;
-	MonoObject* start_obj;
-	/* GSList* */ void* appdomain_refs;
-	/* This is modified using atomic ops, so keep it a gint32 */
-	gint32 interruption_requested;
-	gpointer suspend_event;
-	gpointer suspended_event;
-	gpointer resume_event;
-	CRITICAL_SECTION* synch_cs;
-	guint8* serialized_culture_info;
-	guint32 serialized_culture_info_len;
-	guint8* serialized_ui_culture_info;
-	guint32 serialized_ui_culture_info_len;
-	MonoBoolean thread_dump_requested;
-	gpointer end_stack; /* This is only used when running in the debugger. */
-	MonoBoolean thread_interrupt_requested;
-	guint8	apartment_state;
-	gint32 critical_region_level;
-	guint32 small_id; /* A small, unique id, used for the hazard pointer table. */
-	/* MonoThreadManageCallback* */ void* manage_callback;
-	/* MonoException* */ void* pending_exception;
-	MonoObject* ec_to_set;
-	/*
-	 * These fields are used to avoid having to increment corlib versions
-	 * when a new field is added to the unmanaged MonoThread structure.
-	 */
-	gpointer interrupt_on_stop;
-	gsize    flags;
-	gpointer unused4;
-	gpointer unused5;
-	gpointer unused6;
-	MonoObject* threadstart;
-	int managed_id;
-	MonoObject* principal;
-};
-
 MONO_FUN(mono_thread_current, _MonoThread*);
 MONO_FUN(mono_method_full_name, char*, void* method);
 
@@ -90,43 +22,45 @@ MONO_FUN(mono_method_full_name, char*, void* method);
 
 //static MonoProfiler* prof;
 
-typedef enum
-{
-	MONO_PROFILE_NONE = 0,
-	MONO_PROFILE_APPDOMAIN_EVENTS = 1 << 0,
-	MONO_PROFILE_ASSEMBLY_EVENTS = 1 << 1,
-	MONO_PROFILE_MODULE_EVENTS = 1 << 2,
-	MONO_PROFILE_CLASS_EVENTS = 1 << 3,
-	MONO_PROFILE_JIT_COMPILATION = 1 << 4,
-	MONO_PROFILE_INLINING = 1 << 5,
-	MONO_PROFILE_EXCEPTIONS = 1 << 6,
-	MONO_PROFILE_ALLOCATIONS = 1 << 7,
-	MONO_PROFILE_GC = 1 << 8,
-	MONO_PROFILE_THREADS = 1 << 9,
-	MONO_PROFILE_REMOTING = 1 << 10,
-	MONO_PROFILE_TRANSITIONS = 1 << 11,
-	MONO_PROFILE_ENTER_LEAVE = 1 << 12,
-	MONO_PROFILE_COVERAGE = 1 << 13,
-	MONO_PROFILE_INS_COVERAGE = 1 << 14,
-	MONO_PROFILE_STATISTICAL = 1 << 15,
-	MONO_PROFILE_METHOD_EVENTS = 1 << 16,
-	MONO_PROFILE_MONITOR_EVENTS = 1 << 17,
-	MONO_PROFILE_IOMAP_EVENTS = 1 << 18,
-	/* this should likely be removed, too */
-	MONO_PROFILE_GC_MOVES = 1 << 19
-} MonoProfileFlags;
-
-typedef void (*MonoProfileFunc)(void* prof);
-typedef void (*MonoProfileMethodFunc)(void* prof, void* method);
-
 MONO_FUN(mono_profiler_install, void, void* prof, MonoProfileFunc shutdown_callback);
 MONO_FUN(mono_profiler_set_events, void, MonoProfileFlags events);
 MONO_FUN(mono_profiler_install_enter_leave, void, MonoProfileMethodFunc enter, MonoProfileMethodFunc fleave);
 MONO_FUN(mono_gc_get_used_size, uint64_t);
-
-inline void init_mono_funcs(HMODULE mono)
+MONO_FUN(mono_profiler_install_gc, void, MonoProfileGCFunc callback, MonoProfileGCResizeFunc heap_resize_callback);
+MONO_FUN(mono_profiler_install_allocation, void, MonoProfileAllocFunc callback);
+MONO_FUN(mono_object_get_size, guint32, MonoObject* obj);
+MONO_FUN(mono_class_get_name, const char*, void* klass);
+MONO_FUN(mono_profiler_install_statistical, void, MonoProfileStatFunc callback);
+// Older runtimes only take the first two arguments, the extra one is ignored there
+MONO_FUN(mono_profiler_install_statistical_call_chain, void, MonoProfileStatCallChainFunc callback, int call_chain_depth, MonoProfilerCallChainStrategy call_chain_strategy);
+MONO_FUN(mono_get_root_domain, void*);
+MONO_FUN(mono_jit_info_table_find, void*, void* domain, char* addr);
+MONO_FUN(mono_jit_info_get_method, void*, void* ji);
+MONO_FUN(mono_method_get_class, void*, void* method);
+MONO_FUN(mono_class_get_namespace, const char*, void* klass);
+MONO_FUN(mono_class_get_nesting_type, void*, void* klass);
+MONO_FUN(mono_class_get_image, void*, void* klass);
+MONO_FUN(mono_image_get_name, const char*, void* image);
+MONO_FUN(mono_profiler_install_jit_compile, void, MonoProfileMethodFunc start, MonoProfileMethodResult end);
+// Newer than mono_profiler_install_jit_compile, only used for the code size
+MONO_FUN(mono_profiler_install_jit_end, void, MonoProfileJitResult end);
+MONO_FUN(mono_jit_info_get_code_size, int, void* ji);
+MONO_FUN(mono_profiler_install_thread, void, MonoProfileThreadFunc start, MonoProfileThreadFunc end);
+// Only in newer runtimes, names are read from the thread object otherwise
+MONO_FUN(mono_profiler_install_thread_name, void, MonoProfileThreadNameFunc name_callback);
+MONO_FUN(mono_profiler_install_exception, void, MonoProfileExceptionFunc throw_callback, MonoProfileMethodFunc exc_method_leave, MonoProfileExceptionClauseFunc clause_callback);
+MONO_FUN(mono_profiler_install_monitor, void, MonoProfileMonitorFunc callback);
+MONO_FUN(mono_object_get_class, void*, MonoObject* obj);
+MONO_FUN(mono_profiler_install_assembly, void, MonoProfileAssemblyFunc start_load, MonoProfileAssemblyResult end_load, MonoProfileAssemblyFunc start_unload, MonoProfileAssemblyFunc end_unload);
+MONO_FUN(mono_profiler_install_class, void, MonoProfileClassFunc start_load, MonoProfileClassResult end_load, MonoProfileClassFunc start_unload, MonoProfileClassFunc end_unload);
+MONO_FUN(mono_assembly_get_image, void*, void* assembly);
+MONO_FUN(mono_method_get_name, const char*, void* method);
+MONO_FUN(mono_thread_attach, void*, void* domain);
+MONO_FUN(mono_thread_detach, void, void* thread);
+
+inline void init_mono_funcs(module_handle mono)
 {
-#define GET_FUN(name) name = reinterpret_cast<name##_t>(GetProcAddress(mono, #name));
+#define GET_FUN(name) name = reinterpret_cast<name##_t>(get_export(mono, #name));
 
 	GET_FUN(mono_method_full_name);
 	GET_FUN(mono_profiler_install);
@@ -134,8 +68,50 @@ inline void init_mono_funcs(HMODULE mono)
 	GET_FUN(mono_profiler_install_enter_leave);
 	GET_FUN(mono_thread_current);
 	GET_FUN(mono_gc_get_used_size);
+	GET_FUN(mono_profiler_install_gc);
+	GET_FUN(mono_profiler_install_allocation);
+	GET_FUN(mono_object_get_size);
+	GET_FUN(mono_class_get_name);
+	GET_FUN(mono_profiler_install_statistical);
+	GET_FUN(mono_profiler_install_statistical_call_chain);
+	GET_FUN(mono_get_root_domain);
+	GET_FUN(mono_jit_info_table_find);
+	GET_FUN(mono_jit_info_get_method);
+	GET_FUN(mono_method_get_class);
+	GET_FUN(mono_class_get_namespace);
+	GET_FUN(mono_class_get_nesting_type);
+	GET_FUN(mono_class_get_image);
+	GET_FUN(mono_image_get_name);
+	GET_FUN(mono_profiler_install_exception);
+	GET_FUN(mono_profiler_install_thread);
+	GET_FUN(mono_profiler_install_thread_name);
+	GET_FUN(mono_profiler_install_jit_compile);
+	GET_FUN(mono_profiler_install_jit_end);
+	GET_FUN(mono_jit_info_get_code_size);
+	GET_FUN(mono_profiler_install_monitor);
+	GET_FUN(mono_object_get_class);
+	GET_FUN(mono_profiler_install_assembly);
+	GET_FUN(mono_profiler_install_class);
+	GET_FUN(mono_assembly_get_image);
+	GET_FUN(mono_method_get_name);
+	GET_FUN(mono_thread_attach);
+	GET_FUN(mono_thread_detach);
 
 #undef GET_FUN
 }
 
+// The profiler's own background threads have to be attached to the runtime before they read metadata such as
+// method and class names, so the GC knows about them. Returns the handle for detach_profiler_thread,
+// null if the runtime functions weren't looked up yet.
+inline void* attach_profiler_thread()
+{
+	return mono_thread_attach && mono_get_root_domain ? mono_thread_attach(mono_get_root_domain()) : nullptr;
+}
+
+inline void detach_profiler_thread(void* thread)
+{
+	if (thread && mono_thread_detach)
+		mono_thread_detach(thread);
+}
+
 static void method_leave(void* prof, void* method);
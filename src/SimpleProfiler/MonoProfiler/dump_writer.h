@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "dllmain.h"
+
+// Formats and writes dumps on a background thread.
+// The exports only take a snapshot of the collected data on the calling (usually the game's main) thread
+// and queue jobs that sort, resolve names and write the files here, so a dump doesn't stall a frame.
+// Dumps are written in the order they were submitted. The writer thread only runs while there are dumps
+// queued, so nothing is left waiting on a condition variable when the process exits. It's attached to the
+// runtime while it runs, since the jobs resolve method and class names.
+class DumpWriter
+{
+public:
+	using Job = std::function<void()>;
+
+	// Queues all jobs of one dump. Returns the dump's id, which is never 0.
+	static uint32_t submit(std::vector<Job> jobs)
+	{
+		std::lock_guard guard(queue_mut);
+		uint32_t id = ++last_submitted;
+		queue.emplace_back(id, std::move(jobs));
+		if (!running)
+		{
+			running = true;
+			std::thread(run).detach();
+		}
+		return id;
+	}
+
+	static bool is_finished(uint32_t id)
+	{
+		return last_finished.load(std::memory_order_acquire) >= id;
+	}
+
+	static void wait(uint32_t id)
+	{
+		std::unique_lock lock(queue_mut);
+		finished_cv.wait(lock, [&] { return is_finished(id); });
+	}
+
+	// Files are formatted in memory first and written with a single call
+	static void write_file(const char* path, std::string_view content)
+	{
+		std::ofstream fs(path, std::fstream::out | std::fstream::binary | std::fstream::trunc);
+		fs.write(content.data(), static_cast<std::streamsize>(content.size()));
+	}
+
+private:
+	static inline std::mutex queue_mut;
+	static inline std::condition_variable finished_cv;
+	static inline std::deque<std::pair<uint32_t, std::vector<Job>>> queue; // Needs lock: queue_mut
+	static inline uint32_t last_submitted = 0;                             // Needs lock: queue_mut
+	static inline bool running = false;                                    // Needs lock: queue_mut
+	static inline std::atomic<uint32_t> last_finished = 0;
+
+	static void run()
+	{
+		void* runtime_thread = attach_profiler_thread();
+		while (true)
+		{
+			std::pair<uint32_t, std::vector<Job>> dump;
+			{
+				std::lock_guard guard(queue_mut);
+				if (queue.empty())
+				{
+					running = false;
+					break;
+				}
+				dump = std::move(queue.front());
+				queue.pop_front();
+			}
+
+			for (Job& job : dump.second)
+				job();
+
+			{
+				std::lock_guard guard(queue_mut);
+				last_finished.store(dump.first, std::memory_order_release);
+			}
+			finished_cv.notify_all();
+		}
+		detach_profiler_thread(runtime_thread);
+	}
+};
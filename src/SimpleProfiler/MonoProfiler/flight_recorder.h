@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "clock.h"
+#include "dump_writer.h"
+#include "method_names.h"
+#include "options.h"
+#include "trace.h"
+#include "trace_format.h"
+
+// Per-thread ring of the most recent enter/leave events. Unlike TraceRing it never drops new
+// events, the oldest ones are overwritten instead, so memory use doesn't depend on how long the game runs.
+// Only the owner thread writes. copy() may run at the same time and discards every slot that
+// could have been overwritten while it was copying.
+class FlightRing
+{
+public:
+	const uint32_t thread_id;
+	std::atomic<bool> retired = false; // Set once the owner thread is gone and will not push anymore
+	// Value of head at each of the recent frame ends, indexed like FlightRecorder::frame_ends. Needs lock: FlightRecorder::frames_mut
+	std::vector<uint64_t> frame_heads;
+
+	FlightRing(uint32_t thread_id, uint32_t capacity, size_t frame_marks)
+		: thread_id(thread_id), frame_heads(frame_marks, 0)
+	{
+		size = 1024;
+		while (size < capacity)
+			size <<= 1;
+		slots.reset(new Slot[size]);
+	}
+
+	void push(uint64_t ticks, uint32_t method_id)
+	{
+		uint64_t h = head.load(std::memory_order_relaxed);
+		Slot& slot = slots[h & (size - 1)];
+		// Overwrites the event at h - size. If copy() sees any part of this write, the fence makes sure it
+		// also sees head at h afterwards, so it knows that event is gone.
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.ticks.store(ticks, std::memory_order_relaxed);
+		slot.method_id.store(method_id, std::memory_order_relaxed);
+		// Publishes the event
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	// Number of events pushed so far, every event below it is published
+	uint64_t pushed() const
+	{
+		return head.load(std::memory_order_acquire);
+	}
+
+	// Appends the events [begin, end) that are still in the ring, oldest first, and returns how many of them
+	// were already overwritten. `end` must come from pushed().
+	uint64_t copy(uint64_t begin, uint64_t end, std::vector<TraceEvent>& out) const
+	{
+		uint64_t first = std::max(begin, end > size ? end - size : 0);
+		size_t offset = out.size();
+		for (uint64_t i = first; i < end; i++)
+		{
+			const Slot& slot = slots[i & (size - 1)];
+			out.push_back(TraceEvent{ slot.ticks.load(std::memory_order_relaxed), slot.method_id.load(std::memory_order_relaxed), thread_id });
+		}
+
+		// The owner may have wrapped around while we were copying. The slot it is writing right now
+		// is covered by the extra 1.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t after = head.load(std::memory_order_relaxed);
+		uint64_t valid_begin = std::clamp(after + 1 > size ? after + 1 - size : 0, first, end);
+		out.erase(out.begin() + offset, out.begin() + offset + static_cast<size_t>(valid_begin - first));
+		return valid_begin - begin;
+	}
+
+private:
+	struct Slot
+	{
+		std::atomic<uint64_t> ticks = 0;
+		std::atomic<uint32_t> method_id = 0;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	uint64_t size;
+	alignas(64) std::atomic<uint64_t> head = 0;
+};
+
+// Keeps the last few frames of events of every thread and writes them to a trace file when a frame
+// takes longer than the budget. The game marks frame ends through the MarkFrame export, which only
+// notes where every ring is at. The events are copied out of the rings on the writer thread.
+// The files use the MonoProfilerTrace.bin format, so TraceConverter can open them. Every frame in the
+// window is shown as a slice on thread 0, and events a thread's ring lost inside the window are reported
+// as dropped.
+class FlightRecorder
+{
+public:
+	static bool is_running() { return running; }
+
+	static void start()
+	{
+		frame_ends.assign(std::max<uint32_t>(profiler_options.flight_frames, 1) + 1, 0);
+		running = true;
+	}
+
+	static std::shared_ptr<FlightRing> create_ring(uint32_t thread_id)
+	{
+		// frame_ends is only resized by start(), before any ring is created
+		auto ring = std::make_shared<FlightRing>(thread_id, profiler_options.flight_buffer_events, frame_ends.size());
+		std::lock_guard guard(rings_mut);
+		rings.push_back(ring);
+		return ring;
+	}
+
+	// Marks the end of a frame. Returns true if that frame was over budget and is being written.
+	static bool mark_frame()
+	{
+		if (!running)
+			return false;
+
+		std::lock_guard guard(frames_mut);
+		uint64_t now = ProfilerClock::now();
+		uint64_t previous = frame_ends[frame_count % frame_ends.size()];
+		frame_count++;
+		frame_ends[frame_count % frame_ends.size()] = now;
+		mark_rings();
+
+		// The first call only tells us where the first frame starts
+		if (frame_count == 1 || captures >= profiler_options.flight_max_captures)
+			return false;
+		if (ProfilerClock::to_ns(now - previous).count() <= static_cast<int64_t>(profiler_options.flight_budget_us) * 1000)
+			return false;
+		// Slow frames tend to come in bursts, only one capture is written at a time
+		if (pending_capture != 0 && !DumpWriter::is_finished(pending_capture))
+			return false;
+
+		capture();
+		return true;
+	}
+
+private:
+	static inline bool running = false;
+
+	static inline std::mutex rings_mut;
+	static inline std::vector<std::shared_ptr<FlightRing>> rings; // Needs lock: rings_mut
+
+	static inline std::mutex frames_mut;
+	static inline std::vector<uint64_t> frame_ends; // Ring of the last flight_frames + 1 frame ends. Needs lock: frames_mut
+	static inline uint64_t frame_count = 0;         // Needs lock: frames_mut
+	static inline uint32_t captures = 0;            // Needs lock: frames_mut
+	static inline uint32_t pending_capture = 0;     // DumpWriter id of the last capture. Needs lock: frames_mut
+
+	// Events of one ring between two frame ends
+	struct RingWindow
+	{
+		std::shared_ptr<FlightRing> ring;
+		uint64_t begin;
+		uint64_t end;
+	};
+
+	struct ThreadEvents
+	{
+		uint32_t thread_id;
+		std::vector<TraceEvent> events;
+		uint64_t lost; // Events inside the window that the ring had already overwritten
+	};
+
+	struct Capture
+	{
+		std::vector<uint64_t> frame_ends; // Oldest first, the first entry is where the window starts
+		std::vector<RingWindow> rings;
+		std::vector<ThreadEvents> threads;
+		uint32_t number;
+	};
+
+	// Index into frame_ends of the oldest frame end that is still kept. Needs lock: frames_mut
+	static size_t oldest_frame_end()
+	{
+		uint64_t kept = std::min<uint64_t>(frame_count, frame_ends.size());
+		return static_cast<size_t>((frame_count - kept + 1) % frame_ends.size());
+	}
+
+	// Notes where every ring is at the frame end that was just added. Rings of exited threads are
+	// dropped once none of their events can be part of a capture anymore. Needs lock: frames_mut
+	static void mark_rings()
+	{
+		size_t current = frame_count % frame_ends.size();
+		size_t oldest = oldest_frame_end();
+		std::lock_guard guard(rings_mut);
+		for (auto& ring : rings)
+			ring->frame_heads[current] = ring->pushed();
+		std::erase_if(rings, [&](auto& ring) {
+			return ring->retired.load(std::memory_order_acquire) && ring->frame_heads[oldest] == ring->frame_heads[current];
+		});
+	}
+
+	// Needs lock: frames_mut
+	static void capture()
+	{
+		auto snapshot = std::make_shared<Capture>();
+		snapshot->number = ++captures;
+
+		size_t kept = std::min<uint64_t>(frame_count, frame_ends.size());
+		for (size_t i = kept; i-- > 0;)
+			snapshot->frame_ends.push_back(frame_ends[(frame_count - i) % frame_ends.size()]);
+
+		// Only the positions are taken here, the events are copied on the writer thread. The rings keep
+		// going in the meantime, whatever they overwrite before the copy gets to it is counted as lost.
+		size_t current = frame_count % frame_ends.size();
+		size_t oldest = oldest_frame_end();
+		{
+			std::lock_guard guard(rings_mut);
+			for (auto& ring : rings)
+			{
+				if (ring->frame_heads[current] > ring->frame_heads[oldest])
+					snapshot->rings.push_back(RingWindow{ ring, ring->frame_heads[oldest], ring->frame_heads[current] });
+			}
+		}
+
+		pending_capture = DumpWriter::submit({ [snapshot] {
+			for (RingWindow& window : snapshot->rings)
+			{
+				ThreadEvents& thread = snapshot->threads.emplace_back(ThreadEvents{ window.ring->thread_id, {}, 0 });
+				thread.lost = window.ring->copy(window.begin, window.end, thread.events);
+			}
+			snapshot->rings.clear();
+			write(*snapshot);
+		} });
+	}
+
+	template <typename T>
+	static void append(std::string& buffer, const T& value)
+	{
+		buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	static void append_chunk(std::string& file, TraceChunkType type, const std::string& payload)
+	{
+		append(file, TraceChunkHeader{ type, static_cast<uint32_t>(payload.size()) });
+		file.append(payload);
+	}
+
+	static void write(Capture& capture)
+	{
+		uint64_t window_start = capture.frame_ends.front();
+
+		std::string file;
+		TraceFileHeader header{};
+		std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+		header.version = TRACE_VERSION;
+		header.ns_per_tick = ProfilerClock::ns_per_tick;
+		append(file, header);
+
+		// Every id in the copied events was registered before it was pushed, so all of them are in here
+		std::vector<std::string> names;
+		for (void* method : TraceWriter::registered_methods())
+			names.emplace_back(MethodNames::get(method));
+		uint32_t frame_id = static_cast<uint32_t>(names.size()) + 1;
+		uint32_t slow_frame_id = frame_id + 1;
+		names.push_back("Frame");
+		names.push_back("Slow frame");
+
+		std::string payload;
+		append(payload, static_cast<uint32_t>(names.size()));
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			append(payload, static_cast<uint32_t>(i + 1));
+			append(payload, static_cast<uint32_t>(names[i].size()));
+			payload.append(names[i]);
+		}
+		append_chunk(file, TraceChunkType::MethodNames, payload);
+
+		std::vector<TraceEvent> frames;
+		for (size_t i = 1; i < capture.frame_ends.size(); i++)
+		{
+			uint32_t id = i + 1 == capture.frame_ends.size() ? slow_frame_id : frame_id;
+			frames.push_back(TraceEvent{ capture.frame_ends[i - 1], id, TRACE_FRAMES_THREAD_ID });
+			frames.push_back(TraceEvent{ capture.frame_ends[i], id | TRACE_LEAVE_FLAG, TRACE_FRAMES_THREAD_ID });
+		}
+		capture.threads.push_back(ThreadEvents{ TRACE_FRAMES_THREAD_ID, std::move(frames), 0 });
+
+		for (auto& [thread_id, events, lost] : capture.threads)
+		{
+			payload.clear();
+			append(payload, TraceEventsHeader{ thread_id, static_cast<uint32_t>(events.size()), lost });
+			for (TraceEvent& event : events)
+			{
+				event.ticks -= std::min(event.ticks, window_start);
+				append(payload, event);
+			}
+			append_chunk(file, TraceChunkType::Events, payload);
+		}
+
+		char timestamp[32];
+		std::time_t now = std::time(nullptr);
+		std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%d_%H-%M-%S", std::localtime(&now));
+		std::string path = "MonoProfilerSlowFrame_" + std::string(timestamp) + "_" + std::to_string(capture.number) + ".bin";
+		DumpWriter::write_file(path.c_str(), file);
+	}
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "dllmain.h"
+#include "clock.h"
+#include "dump_writer.h"
+#include "options.h"
+
+struct GcRecord
+{
+	uint64_t start_ticks;
+	uint64_t end_ticks;
+	uint64_t world_stopped_ticks; // From the stop-the-world request until all threads were resumed
+	int32_t generation;
+	int64_t heap_capacity;         // Last size the heap resize callback reported by the end of the collection, 0 if it never fired
+};
+
+// Records every garbage collection reported by the runtime.
+// Collections never overlap, so the runtime callbacks are the only producer and dump() is
+// the only consumer of a ring of finished records.
+// The callbacks run with the GC lock held, which isn't recursive with Boehm on Linux, so they must not call
+// back into the GC: mono_gc_get_used_size() takes that lock. Collections only record the heap capacity the resize
+// callback reported, and the used size is read by dump() instead, outside of any collection.
+class GcRecorder
+{
+public:
+	static void start()
+	{
+		size_t size = 64;
+		while (size < profiler_options.gc_buffer_events)
+			size <<= 1;
+		records.reset(new GcRecord[size]);
+		mask = size - 1;
+		capture_start = ProfilerClock::now();
+		started = true;
+	}
+
+	static void gc_event(MonoGCEvent event, int generation)
+	{
+		uint64_t now = ProfilerClock::now();
+		switch (event)
+		{
+		case MONO_GC_EVENT_START:
+			if (pending)
+				push(current);
+			pending = false;
+			current = GcRecord{ now, 0, 0, generation, 0 };
+			break;
+		case MONO_GC_EVENT_PRE_STOP_WORLD:
+			stop_world_start = now;
+			break;
+		case MONO_GC_EVENT_POST_START_WORLD:
+			if (stop_world_start != 0)
+				current.world_stopped_ticks += now - stop_world_start;
+			stop_world_start = 0;
+			// Depending on the GC the world is restarted after MONO_GC_EVENT_END
+			if (pending)
+				push(current);
+			pending = false;
+			break;
+		case MONO_GC_EVENT_END:
+			current.end_ticks = now;
+			current.heap_capacity = heap_capacity.load(std::memory_order_relaxed);
+			if (stop_world_start != 0)
+				pending = true;
+			else
+				push(current);
+			break;
+		default:
+			break;
+		}
+	}
+
+	static void heap_resized(int64_t new_size)
+	{
+		heap_capacity.store(new_size, std::memory_order_relaxed);
+	}
+
+	static void reset()
+	{
+		if (!started)
+			return;
+
+		std::vector<GcRecord> finished;
+		take_finished(finished);
+		capture_start = ProfilerClock::now();
+	}
+
+	// Takes all collections finished since the previous dump, the returned job writes them to MonoProfilerGC.csv.
+	// Times are relative to the previous dump, the same window the method stats cover.
+	static DumpWriter::Job dump()
+	{
+		if (!started)
+			return nullptr;
+
+		uint64_t window_start = capture_start;
+		capture_start = ProfilerClock::now();
+
+		auto finished = std::make_shared<std::vector<GcRecord>>();
+		uint64_t lost = take_finished(*finished);
+		uint64_t used = mono_gc_get_used_size();
+
+		return [finished, window_start, lost, used] {
+			std::ostringstream fs;
+			fs << "\"Start (ns since previous dump)\",\"Duration (ns)\",\"World stopped (ns)\",\"Generation\",\"Heap capacity (bytes)\"\n";
+			for (auto& it : *finished)
+			{
+				int64_t start = it.start_ticks > window_start ? ProfilerClock::to_ns(it.start_ticks - window_start).count() : 0;
+				fs << start << "," << ProfilerClock::to_ns(it.end_ticks - it.start_ticks).count() << "," <<
+					ProfilerClock::to_ns(it.world_stopped_ticks).count() << "," << it.generation << "," <<
+					it.heap_capacity << "\n";
+			}
+			fs << "\"Heap used at dump (bytes)\"," << used << "\n";
+			if (lost > 0)
+				fs << "\"" << lost << " collections were not recorded because the buffer was full\"\n";
+			DumpWriter::write_file("MonoProfilerGC.csv", fs.str());
+		};
+	}
+
+private:
+	static inline std::unique_ptr<GcRecord[]> records;
+	static inline size_t mask = 0;
+	static inline bool started = false;
+
+	// Only touched from the GC callbacks
+	static inline GcRecord current{};
+	static inline uint64_t stop_world_start = 0;
+	static inline bool pending = false; // current has ended but the world hasn't been restarted yet
+
+	static inline std::atomic<int64_t> heap_capacity = 0;
+	static inline std::atomic<uint64_t> head = 0;
+	static inline std::atomic<uint64_t> dropped = 0;
+	static inline std::atomic<uint64_t> tail = 0; // Written by dump()
+	static inline uint64_t capture_start = 0;     // Only used by dump()
+
+	// Returns how many records were dropped since the last call
+	static uint64_t take_finished(std::vector<GcRecord>& out)
+	{
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		uint64_t h = head.load(std::memory_order_acquire);
+		for (; t != h; t++)
+			out.push_back(records[t & mask]);
+		tail.store(t, std::memory_order_release);
+		return dropped.exchange(0, std::memory_order_relaxed);
+	}
+
+	static void push(const GcRecord& record)
+	{
+		uint64_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) > mask)
+		{
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		records[h & mask] = record;
+		head.store(h + 1, std::memory_order_release);
+	}
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "method_table.h"
+
+// Entries a capped table had to let go of, summed up into one
+template <typename TStats>
+struct EvictedEntries
+{
+	TStats stats;         // Sum of every evicted entry
+	uint64_t count = 0;   // Entries evicted
+	int64_t floor = 0;    // Highest weight evicted so far. Entries added since may have lost up to this much before they were added.
+
+	void add(const EvictedEntries& other)
+	{
+		stats.add(other.stats);
+		count += other.count;
+		floor = std::max(floor, other.floor);
+	}
+};
+
+// Keeps a per-thread method table at a fixed number of entries. When the table is full, the entries with the
+// lowest weight are moved into an EvictedEntries bucket and new methods start with an error bound of the
+// highest weight evicted so far.
+//
+// This is a batched variant of Space-Saving (Metwally et al.), with a weaker guarantee in two ways:
+// - An eighth of the table is evicted at once instead of only the minimum, so an entry can be evicted while
+//   entries slightly heavier than it stay. Entries compete by weight() + error_bound, like Space-Saving's counters.
+// - A new entry's stats start at 0 instead of inheriting the evicted weight, which is kept in error_bound instead.
+//   The stats of a method are a lower bound and stats + error_bound an upper bound of what it really had.
+// What still holds: a method without its own entry had at most `floor` weight in total, and a method whose
+// error bound is 0 has exact stats.
+//
+// An eviction costs one scan of the table, which is sized for the cap, plus one backward-shift delete per
+// evicted entry, so a stream of new methods costs O(8) per method. Lookups of methods that are already in
+// the table cost the same as without a cap.
+// TStats needs add(), weight() and an int64_t error_bound in the same unit as the weight.
+template <typename TStats>
+class HeavyHitters
+{
+public:
+	// Capacity a table needs so that it never grows below the cap
+	static size_t table_capacity(size_t cap)
+	{
+		return cap * 2;
+	}
+
+	// Entry of `method`, added if needed. A cap of 0 means unbounded.
+	// `on_evict` is called with every method that had to make room.
+	template <typename TOnEvict>
+	static TStats& get(MethodTable<TStats>& table, void* method, size_t cap, EvictedEntries<TStats>& evicted, TOnEvict on_evict)
+	{
+		if (cap == 0)
+			return table.get(method);
+		if (TStats* existing = table.find(method))
+			return *existing;
+
+		if (table.size() >= cap)
+			evict(table, cap, evicted, on_evict);
+		TStats& stats = table.get(method);
+		stats.error_bound = evicted.floor;
+		return stats;
+	}
+
+	static TStats& get(MethodTable<TStats>& table, void* method, size_t cap, EvictedEntries<TStats>& evicted)
+	{
+		return get(table, method, cap, evicted, [](void*) {});
+	}
+
+	// Adds a whole table and its bucket to another capped table, e.g. to sum up the tables of several dumps
+	static void merge(MethodTable<TStats>& table, EvictedEntries<TStats>& evicted, const MethodTable<TStats>& from,
+		const EvictedEntries<TStats>& from_evicted, size_t cap)
+	{
+		evicted.add(from_evicted);
+		from.for_each([&](void* method, const TStats& stats) {
+			get(table, method, cap, evicted).add(stats);
+		});
+	}
+
+private:
+	template <typename TOnEvict>
+	static void evict(MethodTable<TStats>& table, size_t cap, EvictedEntries<TStats>& evicted, TOnEvict& on_evict)
+	{
+		// Reused so evictions don't allocate. Every thread only evicts from its own tables.
+		static thread_local std::vector<std::pair<int64_t, void*>> candidates;
+		candidates.clear();
+		table.for_each([&](void* method, const TStats& stats) {
+			candidates.emplace_back(stats.weight() + stats.error_bound, method);
+		});
+
+		size_t to_evict = std::min(candidates.size(), std::max<size_t>(1, cap / 8));
+		std::nth_element(candidates.begin(), candidates.begin() + (to_evict - 1), candidates.end());
+		for (size_t i = 0; i < to_evict; i++)
+		{
+			auto [weight, method] = candidates[i];
+			evicted.stats.add(*table.find(method));
+			evicted.count++;
+			evicted.floor = std::max(evicted.floor, weight);
+			table.erase(method);
+			on_evict(method);
+		}
+	}
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+
+// Log-linear histogram of durations in nanoseconds, in the style of HdrHistogram.
+// Every power of two is split into 2^sub_bucket_bits linear buckets, so a recorded value is only
+// off by at most 1/8 of itself. Values below 16 ns are exact. Histograms only hold counts,
+// so adding two of them gives exactly the histogram of all values recorded in both.
+// Buckets are allocated for the whole range when the first value is recorded, so a histogram never grows
+// afterwards and record() only allocates once per method. Histograms nothing was recorded in are just a pointer.
+class LatencyHistogram
+{
+public:
+	static constexpr uint32_t sub_bucket_bits = 3;
+	static constexpr uint32_t max_value_bits = 36; // About 68 seconds, longer values are counted in the last bucket
+	static constexpr uint32_t bucket_count = (max_value_bits - sub_bucket_bits + 1) << sub_bucket_bits;
+
+	uint64_t count = 0;
+	uint64_t min = 0; // Exact, only valid if count > 0
+	uint64_t max = 0; // Exact
+
+	void record(uint64_t value)
+	{
+		min = count == 0 ? value : std::min(min, value);
+		max = std::max(max, value);
+		count++;
+		if (!buckets)
+			allocate();
+		buckets[bucket_index(value)]++;
+	}
+
+	void add(const LatencyHistogram& other)
+	{
+		if (other.count == 0)
+			return;
+		min = count == 0 ? other.min : std::min(min, other.min);
+		max = std::max(max, other.max);
+		count += other.count;
+		if (!buckets)
+			allocate();
+		for (uint32_t i = 0; i < bucket_count; i++)
+			buckets[i] += other.buckets[i];
+	}
+
+	// Smallest value that at least `percentile` % of the recorded values are less than or equal to,
+	// rounded up to the end of its bucket
+	uint64_t value_at_percentile(double percentile) const
+	{
+		if (count == 0)
+			return 0;
+
+		uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(count))));
+		uint64_t seen = 0;
+		for (uint32_t i = 0; i < bucket_count; i++)
+		{
+			seen += buckets[i];
+			if (seen >= target)
+				return std::clamp(highest_value_in_bucket(i), min, max);
+		}
+		return max;
+	}
+
+	// Writes the column headers matching write_columns, each prefixed with `name`
+	static void write_header(std::ostream& out, const char* name)
+	{
+		out << ",\"" << name << " min (ns)\",\"" << name << " max (ns)\",\"" << name << " p50 (ns)\",\"" << name << " p90 (ns)\",\"" <<
+			name << " p99 (ns)\",\"" << name << " p99.9 (ns)\"";
+	}
+
+	void write_columns(std::ostream& out) const
+	{
+		out << "," << (count == 0 ? 0 : min) << "," << max << "," << value_at_percentile(50.0) << "," << value_at_percentile(90.0) << "," <<
+			value_at_percentile(99.0) << "," << value_at_percentile(99.9);
+	}
+
+private:
+	std::unique_ptr<uint64_t[]> buckets; // All bucket_count buckets, null while nothing was recorded
+
+	void allocate()
+	{
+		buckets.reset(new uint64_t[bucket_count]());
+	}
+
+	static uint32_t bucket_index(uint64_t value)
+	{
+		constexpr uint64_t largest = (uint64_t(1) << max_value_bits) - 1;
+		constexpr uint64_t sub_bucket_mask = (uint64_t(1) << (sub_bucket_bits + 1)) - 1;
+		value = std::min(value, largest);
+		// Power of two above the linear range, 0 for values that are stored exactly
+		uint32_t shift = static_cast<uint32_t>(std::bit_width(value | sub_bucket_mask)) - (sub_bucket_bits + 1);
+		return (shift << sub_bucket_bits) + static_cast<uint32_t>(value >> shift);
+	}
+
+	static uint64_t highest_value_in_bucket(uint32_t index)
+	{
+		uint32_t shift = index < (2u << sub_bucket_bits) ? 0 : (index >> sub_bucket_bits) - 1;
+		uint64_t sub_bucket = index - (shift << sub_bucket_bits);
+		return ((sub_bucket + 1) << shift) - 1;
+	}
+};
+
+// Inclusive and self time of every call of one method
+struct MethodHistograms
+{
+	LatencyHistogram total;
+	LatencyHistogram self;
+
+	void add(const MethodHistograms& other)
+	{
+		total.add(other.total);
+		self.add(other.self);
+	}
+};
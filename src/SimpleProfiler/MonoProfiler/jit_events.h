@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "dllmain.h"
+#include "clock.h"
+#include "dump_writer.h"
+#include "method_names.h"
+
+struct JitRecord
+{
+	void* method;
+	uint32_t thread_id;
+	uint64_t start_ticks;
+	uint64_t end_ticks;
+	int32_t code_size; // -1 if the runtime didn't report the compiled code
+};
+
+// Records every method compilation reported by the runtime.
+// The first call of a method is compiled on the calling thread, which shows up as a stall in the caller.
+// Compilations are rare compared to calls and the runtime serializes them on its own locks anyway,
+// so finished records go to a plain vector under a mutex.
+class JitRecorder
+{
+public:
+	static void start()
+	{
+		capture_start = ProfilerClock::now();
+		started = true;
+	}
+
+	static void compile_started(void* method)
+	{
+		pending.push_back(Pending{ method, ProfilerClock::now() });
+	}
+
+	// Returns the compile time in ticks that the calling thread's callers should not be charged for.
+	// Compiling can run managed code (e.g. static constructors) that compiles other methods, only the
+	// outermost compilation counts there since it already includes the nested ones.
+	static uint64_t compile_finished(void* method, int32_t code_size, bool failed)
+	{
+		uint64_t now = ProfilerClock::now();
+		auto it = std::find_if(pending.rbegin(), pending.rend(), [&](const Pending& entry) { return entry.method == method; });
+		if (it == pending.rend())
+			return 0;
+
+		uint64_t start_ticks = it->start_ticks;
+		pending.erase(std::next(it).base(), pending.end());
+
+		uint32_t thread_id = mono_thread_current()->small_id;
+		std::lock_guard guard(records_mut);
+		if (failed)
+			failed_count++;
+		else
+			records.push_back(JitRecord{ method, thread_id, start_ticks, now, code_size });
+		return pending.empty() ? now - start_ticks : 0;
+	}
+
+	static void reset()
+	{
+		if (!started)
+			return;
+
+		std::lock_guard guard(records_mut);
+		records.clear();
+		failed_count = 0;
+		capture_start = ProfilerClock::now();
+	}
+
+	// Takes all compilations finished since the previous dump, the returned job writes them to MonoProfilerJit.csv.
+	// Times are relative to the previous dump, the same window the method stats cover.
+	static DumpWriter::Job dump()
+	{
+		if (!started)
+			return nullptr;
+
+		auto finished = std::make_shared<std::vector<JitRecord>>();
+		uint64_t window_start;
+		uint64_t failed;
+		{
+			std::lock_guard guard(records_mut);
+			finished->swap(records);
+			failed = failed_count;
+			failed_count = 0;
+			window_start = capture_start;
+			capture_start = ProfilerClock::now();
+		}
+
+		return [finished, window_start, failed] {
+			// Slowest first, those are the best candidates for warming up ahead of time
+			std::sort(finished->begin(), finished->end(), [](const JitRecord& a, const JitRecord& b) {
+				return a.end_ticks - a.start_ticks > b.end_ticks - b.start_ticks;
+			});
+
+			std::ostringstream fs;
+			fs << "\"Thread\",\"Method name\",\"Start (ns since previous dump)\",\"Duration (ns)\",\"Code size (bytes)\"\n";
+			for (auto& it : *finished)
+			{
+				int64_t start = it.start_ticks > window_start ? ProfilerClock::to_ns(it.start_ticks - window_start).count() : 0;
+				fs << it.thread_id << ",\"" << MethodNames::get(it.method) << "\"," << start << "," <<
+					ProfilerClock::to_ns(it.end_ticks - it.start_ticks).count() << ",";
+				if (it.code_size >= 0)
+					fs << it.code_size;
+				fs << "\n";
+			}
+			if (failed > 0)
+				fs << "\"" << failed << " compilations failed\"\n";
+			DumpWriter::write_file("MonoProfilerJit.csv", fs.str());
+		};
+	}
+
+private:
+	struct Pending
+	{
+		void* method;
+		uint64_t start_ticks;
+	};
+
+	static inline bool started = false;
+	static inline thread_local std::vector<Pending> pending; // Compilations in progress on this thread, innermost last
+
+	static inline std::mutex records_mut;
+	static inline std::vector<JitRecord> records; // Needs lock: records_mut
+	static inline uint64_t failed_count = 0;      // Needs lock: records_mut
+	static inline uint64_t capture_start = 0;     // Needs lock: records_mut
+};
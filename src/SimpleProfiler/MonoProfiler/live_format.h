@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+
+// Wire format of the live stats server. Shared between the profiler and LiveViewer, so
+// keep it free of any Mono or Windows dependencies.
+//
+// Once a client connects, the server sends one frame per update interval until the client disconnects.
+// Every frame starts with a LiveFrameHeader, followed by `name_count` method names and `method_count`
+// LiveMethodStats. The stats are deltas: everything recorded since the previous frame, summed over all threads.
+// A method id is always named in an earlier frame or in the same frame before it is used.
+
+constexpr char LIVE_MAGIC[4] = { 'M', 'P', 'L', 'V' };
+constexpr uint32_t LIVE_VERSION = 1;
+
+#pragma pack(push, 1)
+
+struct LiveFrameHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t size;         // Bytes that follow this header
+	uint32_t name_count;   // Each one is uint32_t method_id, uint32_t length, char name[length]
+	uint32_t method_count; // LiveMethodStats records after the names
+	uint32_t thread_count; // Threads that recorded anything in this frame
+	uint64_t elapsed_ns;   // Time covered by the frame
+};
+
+struct LiveMethodStats
+{
+	uint32_t method_id;
+	uint32_t thread_count; // Threads that called the method in this frame
+	uint64_t call_count;
+	int64_t total_runtime; // ns
+	int64_t self_runtime;  // ns
+	uint64_t total_allocation;
+	uint64_t self_allocation;
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(LiveMethodStats) == 48, "LiveMethodStats is part of the wire format");
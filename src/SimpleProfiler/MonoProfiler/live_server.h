@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dllmain.h"
+#include "clock.h"
+#include "live_format.h"
+#include "live_socket.h"
+#include "method_names.h"
+#include "method_table.h"
+
+// Streams the method stats to local clients (e.g. LiveViewer) while the game runs, see live_format.h.
+// Everything happens on the server's own thread: it accepts clients on a loopback port and once per
+// interval takes the stats recorded since the previous frame from the profiled threads and sends them.
+// Nothing is collected while no client is connected, and the dumps are not affected either way.
+class LiveServer
+{
+public:
+	// Called on the server thread. Adds everything recorded since the previous call to `delta` and
+	// returns the number of threads that recorded anything.
+	using CollectFunc = uint32_t (*)(MethodTable<LiveMethodStats>& delta);
+
+	// Returns false if the port can't be used
+	static bool start(uint16_t port, uint32_t interval_ms, CollectFunc collect)
+	{
+		if (!init_sockets())
+			return false;
+
+		socket_handle listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listener == invalid_socket)
+			return false;
+#ifndef _WIN32
+		// Lets the port be reused right after the game restarts
+		int reuse = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+		sockaddr_in address = loopback_address(port);
+		if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, max_clients) != 0)
+		{
+			close_socket(listener);
+			return false;
+		}
+
+		std::thread(run, listener, std::max<uint32_t>(interval_ms, 10), collect).detach();
+		return true;
+	}
+
+private:
+	static constexpr size_t max_clients = 8;
+
+	struct Client
+	{
+		socket_handle socket;
+		uint32_t names_sent; // Method ids up to this one were already named to this client
+	};
+
+	// All state lives on the server thread's stack, so nothing is left for static destructors to race with
+	static void run(socket_handle listener, uint32_t interval_ms, CollectFunc collect)
+	{
+		using namespace std::chrono;
+		// Method names are resolved here
+		attach_profiler_thread();
+
+		std::vector<Client> clients;
+		std::vector<std::string> names; // Indexed by method id - 1
+		MethodTable<uint32_t> ids(1024);
+		MethodTable<LiveMethodStats> delta(1024);
+		std::string methods_payload;
+		std::string frame;
+
+		milliseconds interval(interval_ms);
+		steady_clock::time_point next_frame = steady_clock::now() + interval;
+		uint64_t frame_start = ProfilerClock::now();
+
+		while (true)
+		{
+			fd_set readable;
+			FD_ZERO(&readable);
+			FD_SET(listener, &readable);
+			socket_handle max_socket = listener;
+			for (Client& client : clients)
+			{
+				FD_SET(client.socket, &readable);
+				max_socket = std::max(max_socket, client.socket);
+			}
+
+			microseconds wait = duration_cast<microseconds>(std::max(next_frame - steady_clock::now(), steady_clock::duration::zero()));
+			timeval timeout{ static_cast<long>(wait.count() / 1000000), static_cast<long>(wait.count() % 1000000) };
+			if (select(static_cast<int>(max_socket + 1), &readable, nullptr, nullptr, &timeout) > 0)
+			{
+				// Clients never send anything, so a readable client has disconnected
+				std::erase_if(clients, [&](Client& client) {
+					char discard[64];
+					if (!FD_ISSET(client.socket, &readable) || recv(client.socket, discard, sizeof(discard), 0) > 0)
+						return false;
+					close_socket(client.socket);
+					return true;
+				});
+
+				if (FD_ISSET(listener, &readable))
+				{
+					socket_handle accepted = accept(listener, nullptr, nullptr);
+					if (accepted != invalid_socket && clients.size() >= max_clients)
+						close_socket(accepted);
+					else if (accepted != invalid_socket)
+					{
+						// The first frame only covers the time since the first client connected
+						if (clients.empty())
+						{
+							collect(delta);
+							delta.clear();
+							frame_start = ProfilerClock::now();
+						}
+						clients.push_back(Client{ accepted, 0 });
+					}
+				}
+			}
+
+			steady_clock::time_point now = steady_clock::now();
+			if (now < next_frame)
+				continue;
+			next_frame = std::max(next_frame + interval, now);
+			if (clients.empty())
+				continue;
+
+			uint32_t thread_count = collect(delta);
+			uint64_t frame_end = ProfilerClock::now();
+
+			methods_payload.clear();
+			uint32_t method_count = 0;
+			delta.for_each([&](void* method, const LiveMethodStats& stats) {
+				uint32_t& id = ids.get(method);
+				if (id == 0)
+				{
+					names.emplace_back(MethodNames::get(method));
+					id = static_cast<uint32_t>(names.size());
+				}
+				LiveMethodStats record = stats;
+				record.method_id = id;
+				append(methods_payload, record);
+				method_count++;
+			});
+			delta.clear();
+
+			std::erase_if(clients, [&](Client& client) {
+				frame.clear();
+				LiveFrameHeader header{};
+				std::copy(std::begin(LIVE_MAGIC), std::end(LIVE_MAGIC), header.magic);
+				header.version = LIVE_VERSION;
+				header.name_count = static_cast<uint32_t>(names.size()) - client.names_sent;
+				header.method_count = method_count;
+				header.thread_count = thread_count;
+				header.elapsed_ns = static_cast<uint64_t>(ProfilerClock::to_ns(frame_end - frame_start).count());
+				append(frame, header);
+				for (uint32_t id = client.names_sent + 1; id <= names.size(); id++)
+				{
+					const std::string& name = names[id - 1];
+					append(frame, id);
+					append(frame, static_cast<uint32_t>(name.size()));
+					frame.append(name);
+				}
+				frame.append(methods_payload);
+				reinterpret_cast<LiveFrameHeader*>(frame.data())->size = static_cast<uint32_t>(frame.size() - sizeof(LiveFrameHeader));
+
+				if (send_all(client.socket, frame.data(), frame.size()))
+				{
+					client.names_sent = static_cast<uint32_t>(names.size());
+					return false;
+				}
+				close_socket(client.socket);
+				return true;
+			});
+			frame_start = frame_end;
+		}
+	}
+
+	template <typename T>
+	static void append(std::string& buffer, const T& value)
+	{
+		buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Loopback TCP helpers shared by the live stats server and LiveViewer.
+// Only the differences between Winsock and BSD sockets are wrapped, everything else uses the common API.
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+
+typedef SOCKET socket_handle;
+constexpr socket_handle invalid_socket = INVALID_SOCKET;
+constexpr int socket_send_flags = 0;
+
+inline bool init_sockets()
+{
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+}
+
+inline void close_socket(socket_handle socket)
+{
+	closesocket(socket);
+}
+
+#else
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef int socket_handle;
+constexpr socket_handle invalid_socket = -1;
+// A client that went away must not kill the game with SIGPIPE
+constexpr int socket_send_flags = MSG_NOSIGNAL;
+
+inline bool init_sockets()
+{
+	return true;
+}
+
+inline void close_socket(socket_handle socket)
+{
+	close(socket);
+}
+
+#endif
+
+// 127.0.0.1:port, the server never listens on other interfaces
+inline sockaddr_in loopback_address(uint16_t port)
+{
+	sockaddr_in address;
+	std::memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return address;
+}
+
+inline bool send_all(socket_handle socket, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+		int sent = send(socket, data, static_cast<int>(size), socket_send_flags);
+		if (sent <= 0)
+			return false;
+		data += sent;
+		size -= static_cast<size_t>(sent);
+	}
+	return true;
+}
+
+inline bool recv_all(socket_handle socket, char* data, size_t size)
+{
+	while (size > 0)
+	{
+		int received = recv(socket, data, static_cast<int>(size), 0);
+		if (received <= 0)
+			return false;
+		data += received;
+		size -= static_cast<size_t>(received);
+	}
+	return true;
+}
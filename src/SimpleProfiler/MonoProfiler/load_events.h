@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dllmain.h"
+#include "clock.h"
+#include "dump_writer.h"
+
+enum class LoadKind : uint8_t
+{
+	Assembly,
+	Class,
+	StaticConstructor,
+};
+
+struct LoadRecord
+{
+	LoadKind kind;
+	void* subject; // MonoAssembly*, MonoClass* or the MonoMethod* of the static constructor
+	uint32_t thread_id;
+	uint64_t start_ticks;
+	uint64_t end_ticks;
+	uint64_t child_ticks; // Time spent in loads nested inside this one, e.g. base classes or referenced assemblies
+};
+
+// Records how long the runtime took to load every assembly and class, and how long every static constructor ran.
+// These mostly happen during startup, which is where they add up: every mod loads its assembly, its classes
+// and whatever they reference, and runs their static constructors before the first frame.
+// Loads are rare compared to calls and the runtime serializes them on its loader lock anyway,
+// so finished records go to a plain vector under a mutex. A class is only loaded once, so the vector
+// can't grow without bound even if the game is never dumped.
+class LoadRecorder
+{
+public:
+	static void start()
+	{
+		capture_start = ProfilerClock::now();
+		started = true;
+	}
+
+	static void load_started(LoadKind kind, void* subject)
+	{
+		pending.push_back(Pending{ kind, subject, ProfilerClock::now(), 0 });
+	}
+
+	static void load_finished(LoadKind kind, void* subject, bool failed)
+	{
+		uint64_t now = ProfilerClock::now();
+		auto it = std::find_if(pending.rbegin(), pending.rend(), [&](const Pending& entry) { return entry.kind == kind && entry.subject == subject; });
+		if (it == pending.rend())
+			return;
+
+		Pending load = *it;
+		// Loads above this one never got their end event, they're dropped
+		pending.erase(std::next(it).base(), pending.end());
+		if (!pending.empty())
+			pending.back().child_ticks += now - load.start_ticks;
+
+		// A failed load can leave the assembly or class half initialized, so only the failure is counted
+		if (failed)
+		{
+			std::lock_guard guard(records_mut);
+			failed_count++;
+			return;
+		}
+		add(LoadRecord{ kind, subject, mono_thread_current()->small_id, load.start_ticks, now, load.child_ticks });
+	}
+
+	// Only static constructors are reported through add_static_constructor
+	static bool is_static_constructor(void* method)
+	{
+		return started && mono_method_get_name && std::strcmp(mono_method_get_name(method), ".cctor") == 0;
+	}
+
+	// Called when a static constructor returns, with the thread's own call timing
+	static void add_static_constructor(void* method, uint64_t start_ticks, uint64_t end_ticks)
+	{
+		add(LoadRecord{ LoadKind::StaticConstructor, method, mono_thread_current()->small_id, start_ticks, end_ticks, 0 });
+	}
+
+	static void reset()
+	{
+		if (!started)
+			return;
+
+		std::lock_guard guard(records_mut);
+		records.clear();
+		failed_count = 0;
+		capture_start = ProfilerClock::now();
+	}
+
+	// Takes all loads finished since the previous dump, the returned job writes them to MonoProfilerLoads.csv.
+	// Times are relative to the previous dump, the same window the method stats cover.
+	static DumpWriter::Job dump()
+	{
+		if (!started)
+			return nullptr;
+
+		auto finished = std::make_shared<std::vector<LoadRecord>>();
+		uint64_t window_start;
+		uint64_t failed;
+		{
+			std::lock_guard guard(records_mut);
+			finished->swap(records);
+			failed = failed_count;
+			failed_count = 0;
+			window_start = capture_start;
+			capture_start = ProfilerClock::now();
+		}
+
+		return [finished, window_start, failed] {
+			// Most expensive first, those are the best candidates for loading lazily or trimming
+			std::sort(finished->begin(), finished->end(), [](const LoadRecord& a, const LoadRecord& b) {
+				return self_ticks(a) > self_ticks(b);
+			});
+
+			static const char* const total_names[] = { "Total assembly load time (ns)", "Total class load time (ns)", "Total static constructor time (ns)" };
+			uint64_t totals[3] = {};
+			std::ostringstream fs;
+			fs << "\"Kind\",\"Thread\",\"Name\",\"Assembly\",\"Start (ns since previous dump)\",\"Duration (ns)\",\"Self duration (ns)\"\n";
+			for (auto& it : *finished)
+			{
+				int64_t start = it.start_ticks > window_start ? ProfilerClock::to_ns(it.start_ticks - window_start).count() : 0;
+				fs << "\"" << kind_name(it.kind) << "\"," << it.thread_id << ",";
+				write_names(fs, it);
+				fs << "," << start << "," << ProfilerClock::to_ns(it.end_ticks - it.start_ticks).count() << "," <<
+					ProfilerClock::to_ns(self_ticks(it)).count() << "\n";
+				totals[static_cast<int>(it.kind)] += self_ticks(it);
+			}
+			// Self durations, so nested loads aren't counted twice
+			for (int i = 0; i < 3; i++)
+				fs << "\"" << total_names[i] << "\"," << ProfilerClock::to_ns(totals[i]).count() << "\n";
+			if (failed > 0)
+				fs << "\"" << failed << " assembly or class loads failed\"\n";
+			DumpWriter::write_file("MonoProfilerLoads.csv", fs.str());
+		};
+	}
+
+private:
+	struct Pending
+	{
+		LoadKind kind;
+		void* subject;
+		uint64_t start_ticks;
+		uint64_t child_ticks;
+	};
+
+	static inline bool started = false;
+	static inline thread_local std::vector<Pending> pending; // Loads in progress on this thread, innermost last
+
+	static inline std::mutex records_mut;
+	static inline std::vector<LoadRecord> records; // Needs lock: records_mut
+	static inline uint64_t failed_count = 0;       // Needs lock: records_mut
+	static inline uint64_t capture_start = 0;      // Needs lock: records_mut
+
+	static void add(const LoadRecord& record)
+	{
+		std::lock_guard guard(records_mut);
+		records.push_back(record);
+	}
+
+	static uint64_t self_ticks(const LoadRecord& record)
+	{
+		uint64_t duration = record.end_ticks - record.start_ticks;
+		return duration - std::min(duration, record.child_ticks);
+	}
+
+	static const char* kind_name(LoadKind kind)
+	{
+		switch (kind)
+		{
+		case LoadKind::Assembly:
+			return "Assembly";
+		case LoadKind::Class:
+			return "Class";
+		default:
+			return "Static constructor";
+		}
+	}
+
+	// Writes the quoted Name and Assembly columns
+	static void write_names(std::ostringstream& fs, const LoadRecord& record)
+	{
+		if (record.kind == LoadKind::Assembly)
+		{
+			void* image = mono_assembly_get_image ? mono_assembly_get_image(record.subject) : nullptr;
+			const char* name = image ? mono_image_get_name(image) : "";
+			fs << "\"" << name << "\",\"" << name << "\"";
+			return;
+		}
+
+		void* klass = record.kind == LoadKind::Class ? record.subject : mono_method_get_class(record.subject);
+		const char* name_space = mono_class_get_namespace(klass);
+		fs << "\"" << name_space << (*name_space ? "." : "") << mono_class_get_name(klass) << "\",\"" <<
+			mono_image_get_name(mono_class_get_image(klass)) << "\"";
+	}
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+#include "dllmain.h"
+#include "method_table.h"
+
+// Process-wide cache of method names.
+// mono_method_full_name builds a new heap string on every call that is never freed by the profiler,
+// so every method is resolved only once and the string is kept for the rest of the session.
+// MonoMethod pointers stay valid as long as their domain is loaded, which is the whole game in a player.
+// Names end up in quoted CSV fields, so the quotes that dynamic methods can have in their names become apostrophes.
+class MethodNames
+{
+public:
+	static const char* get(void* method)
+	{
+		std::lock_guard guard(names_mut);
+		const char*& name = names.get(method);
+		if (!name)
+		{
+			char* full_name = mono_method_full_name(method);
+			std::replace(full_name, full_name + std::strlen(full_name), '"', '\'');
+			name = full_name;
+		}
+		return name;
+	}
+
+private:
+	static inline std::mutex names_mut;
+	static inline MethodTable<const char*> names = MethodTable<const char*>(4096); // Needs lock: names_mut
+};
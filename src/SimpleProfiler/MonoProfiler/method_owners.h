@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "dllmain.h"
+#include "method_table.h"
+
+// Class, namespace and assembly of a method, as ids into MethodOwners::names
+struct MethodOwner
+{
+	uint32_t class_id;
+	uint32_t namespace_id;
+	uint32_t assembly_id;
+};
+
+// Process-wide cache of which class, namespace and assembly every method belongs to, for the rollups in the dump.
+// Every method and class is resolved through the runtime only once. Classes with the same full name in the same
+// assembly share an id, so all instantiations of a generic class are rolled up together. Class names carry their
+// assembly like assembly-qualified .NET names, since two mods can well have a class of the same name.
+class MethodOwners
+{
+public:
+	static MethodOwner get(void* method)
+	{
+		std::lock_guard guard(owners_mut);
+		MethodOwner*& owner = by_method.get(method);
+		if (!owner)
+		{
+			void* klass = mono_method_get_class(method);
+			MethodOwner*& class_owner = by_class.get(klass);
+			if (!class_owner)
+				class_owner = &owners.emplace_back(resolve(klass));
+			owner = class_owner;
+		}
+		return *owner;
+	}
+
+	// Name of an id from MethodOwner
+	static std::string name(uint32_t id)
+	{
+		std::lock_guard guard(owners_mut);
+		return names[id];
+	}
+
+private:
+	static inline std::mutex owners_mut;
+	static inline MethodTable<MethodOwner*> by_method = MethodTable<MethodOwner*>(4096); // Needs lock: owners_mut
+	static inline MethodTable<MethodOwner*> by_class = MethodTable<MethodOwner*>(1024);  // Keyed by MonoClass*. Needs lock: owners_mut
+	static inline std::deque<MethodOwner> owners;                                        // Needs lock: owners_mut
+	// Class, namespace and assembly names share one list, they can't be confused since every id has a single use.
+	static inline std::vector<std::string> names;                         // Needs lock: owners_mut
+	static inline std::unordered_map<std::string, uint32_t> class_ids;     // Keyed by assembly-qualified name. Needs lock: owners_mut
+	static inline std::unordered_map<std::string, uint32_t> namespace_ids; // Needs lock: owners_mut
+	static inline std::unordered_map<std::string, uint32_t> assembly_ids;  // Needs lock: owners_mut
+
+	// Needs lock: owners_mut
+	static MethodOwner resolve(void* klass)
+	{
+		// Nested classes have no namespace of their own, they're named Outer/Inner like the runtime does
+		std::string class_name = mono_class_get_name(klass);
+		void* outer = klass;
+		while (mono_class_get_nesting_type && mono_class_get_nesting_type(outer))
+		{
+			outer = mono_class_get_nesting_type(outer);
+			class_name = std::string(mono_class_get_name(outer)) + "/" + class_name;
+		}
+		std::string name_space = mono_class_get_namespace(outer);
+		if (!name_space.empty())
+			class_name = name_space + "." + class_name;
+		else
+			name_space = "(no namespace)";
+
+		std::string assembly = mono_image_get_name(mono_class_get_image(outer));
+		return MethodOwner{
+			id(class_ids, class_name + ", " + assembly),
+			id(namespace_ids, name_space),
+			id(assembly_ids, assembly) };
+	}
+
+	// Needs lock: owners_mut
+	static uint32_t id(std::unordered_map<std::string, uint32_t>& ids, const std::string& name)
+	{
+		auto [it, added] = ids.emplace(name, static_cast<uint32_t>(names.size()));
+		if (added)
+			names.push_back(name);
+		return it->second;
+	}
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// Open-addressing hash table keyed by MonoMethod*.
+// Not thread-safe: a table is only ever touched by a single thread at a time,
+// ownership is handed over between the profiled thread and dump() by ThreadProfilerInfo.
+template <typename TValue>
+class MethodTable
+{
+public:
+	struct Slot
+	{
+		void* method;
+		TValue value;
+	};
+
+	explicit MethodTable(size_t initial_capacity = 1024)
+	{
+		allocate(round_up_pow2(initial_capacity));
+	}
+
+	TValue& get(void* method)
+	{
+		size_t i = hash(method) & mask;
+		while (true)
+		{
+			Slot& slot = slots[i];
+			if (slot.method == method)
+				return slot.value;
+			if (slot.method == nullptr)
+				break;
+			i = (i + 1) & mask;
+		}
+
+		// Keep load factor at or below 1/2 so probe chains stay short
+		if ((count + 1) * 2 > capacity)
+		{
+			grow();
+			return get(method);
+		}
+
+		count++;
+		slots[i].method = method;
+		return slots[i].value;
+	}
+
+	// Returns null if the method has no entry, never inserts
+	const TValue* find(void* method) const
+	{
+		size_t i = hash(method) & mask;
+		while (slots[i].method != nullptr)
+		{
+			if (slots[i].method == method)
+				return &slots[i].value;
+			i = (i + 1) & mask;
+		}
+		return nullptr;
+	}
+
+	TValue* find(void* method)
+	{
+		return const_cast<TValue*>(static_cast<const MethodTable*>(this)->find(method));
+	}
+
+	// Removes the entry of `method`, returns false if it had none. The entries after it in the probe chain are
+	// shifted back into the hole (backward-shift deletion), so no tombstones are left behind and nothing is rehashed.
+	bool erase(void* method)
+	{
+		size_t hole = hash(method) & mask;
+		while (slots[hole].method != method)
+		{
+			if (slots[hole].method == nullptr)
+				return false;
+			hole = (hole + 1) & mask;
+		}
+
+		for (size_t i = (hole + 1) & mask; slots[i].method != nullptr; i = (i + 1) & mask)
+		{
+			// An entry can fill the hole unless its home slot lies between the hole and itself
+			size_t home = hash(slots[i].method) & mask;
+			if (((i - home) & mask) >= ((i - hole) & mask))
+			{
+				slots[hole] = std::move(slots[i]);
+				hole = i;
+			}
+		}
+		slots[hole] = Slot{};
+		count--;
+		return true;
+	}
+
+	template <typename TFunc>
+	void for_each(TFunc func) const
+	{
+		for (size_t i = 0; i < capacity; i++)
+		{
+			if (slots[i].method != nullptr)
+				func(slots[i].method, slots[i].value);
+		}
+	}
+
+	size_t size() const { return count; }
+
+	void clear()
+	{
+		if (count == 0)
+			return;
+		for (size_t i = 0; i < capacity; i++)
+			slots[i] = Slot{};
+		count = 0;
+	}
+
+private:
+	std::unique_ptr<Slot[]> slots;
+	size_t capacity = 0;
+	size_t mask = 0;
+	size_t count = 0;
+
+	static size_t round_up_pow2(size_t value)
+	{
+		size_t result = 16;
+		while (result < value)
+			result <<= 1;
+		return result;
+	}
+
+	static size_t hash(void* method)
+	{
+		// Methods are heap allocated and aligned, so the low bits carry no information.
+		// Fibonacci hashing spreads the remaining bits over the whole word.
+		uint64_t key = reinterpret_cast<uintptr_t>(method) >> 3;
+		return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 16);
+	}
+
+	void allocate(size_t new_capacity)
+	{
+		slots.reset(new Slot[new_capacity]());
+		capacity = new_capacity;
+		mask = new_capacity - 1;
+		count = 0;
+	}
+
+	void grow()
+	{
+		std::unique_ptr<Slot[]> old_slots(std::move(slots));
+		size_t old_capacity = capacity;
+		allocate(old_capacity * 2);
+
+		for (size_t i = 0; i < old_capacity; i++)
+		{
+			if (old_slots[i].method != nullptr)
+				get(old_slots[i].method) = std::move(old_slots[i].value);
+		}
+	}
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "dllmain.h"
+#include "clock.h"
+#include "dump_writer.h"
+#include "method_table.h"
+
+struct MonitorStats
+{
+	uint64_t contended_count = 0;
+	uint64_t failed_count = 0; // Waits that timed out without getting the lock, e.g. Monitor.TryEnter
+	uint64_t total_wait = 0;   // ticks
+	uint64_t max_wait = 0;     // ticks
+};
+
+// Records how long threads waited for monitors (`lock` blocks) that another thread was holding,
+// per class of the locked object. Uncontended locks don't raise any event, so this costs nothing
+// until threads actually block, and a thread that just waited can afford a mutex.
+class MonitorRecorder
+{
+public:
+	static void start()
+	{
+		started = true;
+	}
+
+	// The calling thread is about to block on `obj`
+	static void contention_started(MonoObject* obj)
+	{
+		pending_class = mono_object_get_class(obj);
+		pending_start = ProfilerClock::now();
+	}
+
+	// The calling thread got the monitor, or gave up on it. Returns how long it waited in ticks.
+	static uint64_t contention_finished(bool acquired)
+	{
+		if (pending_start == 0)
+			return 0;
+		uint64_t wait = ProfilerClock::now() - pending_start;
+		pending_start = 0;
+
+		std::lock_guard guard(stats_mut);
+		MonitorStats& stats = stats_by_class.get(pending_class);
+		stats.contended_count++;
+		stats.failed_count += acquired ? 0 : 1;
+		stats.total_wait += wait;
+		stats.max_wait = std::max(stats.max_wait, wait);
+		return wait;
+	}
+
+	static void reset()
+	{
+		if (!started)
+			return;
+
+		std::lock_guard guard(stats_mut);
+		stats_by_class.clear();
+	}
+
+	// Takes the waits recorded since the previous dump, the returned job writes them to MonoProfilerContention.csv
+	static DumpWriter::Job dump()
+	{
+		if (!started)
+			return nullptr;
+
+		auto classes = std::make_shared<std::vector<std::pair<void*, MonitorStats>>>();
+		{
+			std::lock_guard guard(stats_mut);
+			stats_by_class.for_each([&](void* klass, const MonitorStats& stats) {
+				classes->emplace_back(klass, stats);
+			});
+			stats_by_class.clear();
+		}
+
+		return [classes] {
+			std::sort(classes->begin(), classes->end(), [](auto& a, auto& b) {
+				return a.second.total_wait > b.second.total_wait;
+			});
+
+			uint64_t failed = 0;
+			std::ostringstream fs;
+			fs << "\"Namespace\",\"Class\",\"Contended count\",\"Total wait (ns)\",\"Max wait (ns)\"\n";
+			for (auto& [klass, stats] : *classes)
+			{
+				fs << "\"" << mono_class_get_namespace(klass) << "\",\"" << mono_class_get_name(klass) << "\"," << stats.contended_count << "," <<
+					ProfilerClock::to_ns(stats.total_wait).count() << "," << ProfilerClock::to_ns(stats.max_wait).count() << "\n";
+				failed += stats.failed_count;
+			}
+			if (failed > 0)
+				fs << "\"" << failed << " waits timed out without getting the lock\"\n";
+			DumpWriter::write_file("MonoProfilerContention.csv", fs.str());
+		};
+	}
+
+private:
+	static inline bool started = false;
+	// A thread can only block on one monitor at a time
+	static inline thread_local void* pending_class = nullptr;
+	static inline thread_local uint64_t pending_start = 0;
+
+	static inline std::mutex stats_mut;
+	static inline MethodTable<MonitorStats> stats_by_class = MethodTable<MonitorStats>(64); // Keyed by MonoClass*. Needs lock: stats_mut
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Runtime types and constants used by the profiler hooks. Kept free of any platform headers
+// and function declarations, so that stand-ins for the runtime (FakeMono) can share them.
+
+typedef struct {
+	void* vtable;
+	void* synchronisation;
+} MonoObject;
+
+typedef char MonoBoolean;
+typedef void* gpointer;
+typedef uint16_t	gunichar2;
+typedef uint8_t		guint8;
+typedef uint32_t	guint32;
+typedef int32_t		gint32;
+typedef uint64_t	guint64;
+typedef size_t		gsize;
+
+struct _MonoThread {
+	MonoObject  obj;
+	int         lock_thread_id; /* to be used as the pre-shifted thread id in thin locks */
+	void*	    handle; /* HANDLE */
+	void* cached_culture_info;
+	gpointer    unused1;
+	MonoBoolean threadpool_thread;
+	gunichar2* name;
+	guint32	    name_len;
+	guint32	    state;
+	/* MonoException* */ void* abort_exc;
+	int abort_state_handle;
+	guint64 tid;	/* This is accessed as a gsize in the code (so it can hold a 64bit pointer on systems that need it), but needs to reserve 64 bits of space on all machines as it corresponds to a field in managed code */
+	void*	    start_notify; /* HANDLE */
+	gpointer stack_ptr;
+	gpointer* static_data;
+	gpointer jit_data;
+	gpointer lock_data;
+	/* MonoAppContext* */ void* current_appcontext;
+	int stack_size;
+	MonoObject* start_obj;
+	/* GSList* */ void* appdomain_refs;
+	/* This is modified using atomic ops, so keep it a gint32 */
+	gint32 interruption_requested;
+	gpointer suspend_event;
+	gpointer suspended_event;
+	gpointer resume_event;
+	void* synch_cs; /* CRITICAL_SECTION* */
+	guint8* serialized_culture_info;
+	guint32 serialized_culture_info_len;
+	guint8* serialized_ui_culture_info;
+	guint32 serialized_ui_culture_info_len;
+	MonoBoolean thread_dump_requested;
+	gpointer end_stack; /* This is only used when running in the debugger. */
+	MonoBoolean thread_interrupt_requested;
+	guint8	apartment_state;
+	gint32 critical_region_level;
+	guint32 small_id; /* A small, unique id, used for the hazard pointer table. */
+	/* MonoThreadManageCallback* */ void* manage_callback;
+	/* MonoException* */ void* pending_exception;
+	MonoObject* ec_to_set;
+	/*
+	 * These fields are used to avoid having to increment corlib versions
+	 * when a new field is added to the unmanaged MonoThread structure.
+	 */
+	gpointer interrupt_on_stop;
+	gsize    flags;
+	gpointer unused4;
+	gpointer unused5;
+	gpointer unused6;
+	MonoObject* threadstart;
+	int managed_id;
+	MonoObject* principal;
+};
+
+typedef enum
+{
+	MONO_PROFILE_NONE = 0,
+	MONO_PROFILE_APPDOMAIN_EVENTS = 1 << 0,
+	MONO_PROFILE_ASSEMBLY_EVENTS = 1 << 1,
+	MONO_PROFILE_MODULE_EVENTS = 1 << 2,
+	MONO_PROFILE_CLASS_EVENTS = 1 << 3,
+	MONO_PROFILE_JIT_COMPILATION = 1 << 4,
+	MONO_PROFILE_INLINING = 1 << 5,
+	MONO_PROFILE_EXCEPTIONS = 1 << 6,
+	MONO_PROFILE_ALLOCATIONS = 1 << 7,
+	MONO_PROFILE_GC = 1 << 8,
+	MONO_PROFILE_THREADS = 1 << 9,
+	MONO_PROFILE_REMOTING = 1 << 10,
+	MONO_PROFILE_TRANSITIONS = 1 << 11,
+	MONO_PROFILE_ENTER_LEAVE = 1 << 12,
+	MONO_PROFILE_COVERAGE = 1 << 13,
+	MONO_PROFILE_INS_COVERAGE = 1 << 14,
+	MONO_PROFILE_STATISTICAL = 1 << 15,
+	MONO_PROFILE_METHOD_EVENTS = 1 << 16,
+	MONO_PROFILE_MONITOR_EVENTS = 1 << 17,
+	MONO_PROFILE_IOMAP_EVENTS = 1 << 18,
+	/* this should likely be removed, too */
+	MONO_PROFILE_GC_MOVES = 1 << 19
+} MonoProfileFlags;
+
+typedef enum
+{
+	MONO_GC_EVENT_START,
+	MONO_GC_EVENT_MARK_START,
+	MONO_GC_EVENT_MARK_END,
+	MONO_GC_EVENT_RECLAIM_START,
+	MONO_GC_EVENT_RECLAIM_END,
+	MONO_GC_EVENT_END,
+	MONO_GC_EVENT_PRE_STOP_WORLD,
+	MONO_GC_EVENT_POST_STOP_WORLD,
+	MONO_GC_EVENT_PRE_START_WORLD,
+	MONO_GC_EVENT_POST_START_WORLD
+} MonoGCEvent;
+
+typedef void (*MonoProfileFunc)(void* prof);
+typedef void (*MonoProfileMethodFunc)(void* prof, void* method);
+typedef void (*MonoProfileGCFunc)(void* prof, MonoGCEvent event, int generation);
+typedef void (*MonoProfileGCResizeFunc)(void* prof, int64_t new_size);
+typedef void (*MonoProfileAllocFunc)(void* prof, MonoObject* obj, void* klass);
+typedef void (*MonoProfileStatFunc)(void* prof, guint8* ip, void* context);
+typedef void (*MonoProfileStatCallChainFunc)(void* prof, int call_chain_depth, guint8** ip, void* context);
+typedef void (*MonoProfileMethodResult)(void* prof, void* method, int result);
+typedef void (*MonoProfileJitResult)(void* prof, void* method, void* jinfo, int result);
+typedef void (*MonoProfileThreadFunc)(void* prof, uintptr_t tid);
+typedef void (*MonoProfileThreadNameFunc)(void* prof, uintptr_t tid, const char* name);
+typedef void (*MonoProfileExceptionFunc)(void* prof, MonoObject* object);
+typedef void (*MonoProfileExceptionClauseFunc)(void* prof, void* method, int clause_type, int clause_num);
+
+typedef enum
+{
+	MONO_PROFILER_MONITOR_CONTENTION = 1,
+	MONO_PROFILER_MONITOR_DONE = 2,
+	MONO_PROFILER_MONITOR_FAIL = 3
+} MonoProfilerMonitorEvent;
+
+typedef void (*MonoProfileMonitorFunc)(void* prof, MonoObject* obj, MonoProfilerMonitorEvent event);
+typedef void (*MonoProfileAssemblyFunc)(void* prof, void* assembly);
+typedef void (*MonoProfileAssemblyResult)(void* prof, void* assembly, int result);
+typedef void (*MonoProfileClassFunc)(void* prof, void* klass);
+typedef void (*MonoProfileClassResult)(void* prof, void* klass, int result);
+
+typedef enum
+{
+	MONO_PROFILE_OK,
+	MONO_PROFILE_FAILED
+} MonoProfileResult;
+
+typedef enum
+{
+	MONO_PROFILER_CALL_CHAIN_NONE = 0,
+	MONO_PROFILER_CALL_CHAIN_NATIVE = 1,
+	MONO_PROFILER_CALL_CHAIN_GLIBC = 2,
+	MONO_PROFILER_CALL_CHAIN_MANAGED = 3,
+} MonoProfilerCallChainStrategy;
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+
+enum class ProfilerMode
+{
+	Instrument = 0, // Time every call with enter/leave hooks
+	Sample = 1,     // Let the runtime periodically sample the running code
+	Count = 2,      // Only count calls per method with an enter hook, see CallCounter
+};
+
+enum class AllocationTracking
+{
+	None = 0,     // Don't measure allocations
+	HeapSize = 1, // Estimate from the change in total heap size, includes allocations of other threads
+	Events = 2,   // Count every allocated object through the runtime's allocation callback
+};
+
+enum class ClockSetting
+{
+	Auto = 0,   // The invariant TSC if the CPU has one, otherwise chrono. See ProfilerClock::calibrate.
+	Chrono = 1, // Always std::chrono, e.g. on machines where the TSC is reported as invariant but isn't synchronized
+};
+
+// Load-time settings, filled in through the SetOption export before AddProfiler is called.
+struct ProfilerOptions
+{
+	ProfilerMode mode = ProfilerMode::Instrument;
+	ClockSetting clock = ClockSetting::Auto;
+	uint32_t sample_call_depth = 16;        // Frames recorded per sample, 1 only records the sampled method
+	uint32_t sample_buffer = 8192;          // Samples queued before the sampler thread aggregates them
+	AllocationTracking allocations = AllocationTracking::HeapSize;
+	bool gc_events = true;                  // Record every garbage collection and write MonoProfilerGC.csv on dump
+	uint32_t gc_buffer_events = 4096;       // Collections kept between two dumps, rounded up to a power of two
+	bool trace = false;                     // Stream enter/leave events to MonoProfilerTrace.bin
+	uint32_t trace_buffer_events = 1 << 16; // Per-thread ring buffer capacity, rounded up to a power of two
+	bool call_tree = false;                 // Also aggregate per call path and write MonoProfilerCallTree.folded on dump
+	uint32_t call_tree_max_nodes = 1 << 16; // Per-thread call tree node cap, further paths go to an overflow node
+	bool merged_output = false;             // Also write MonoProfilerOutputByMethod.csv with every method summed over all threads
+	bool rollups = true;                    // Also write MonoProfilerRollup.csv with the self stats summed per class, namespace and assembly
+	bool histograms = false;                // Keep a latency histogram per method and add percentile columns to the dump
+	uint32_t max_methods = 0;               // Per-thread cap on methods with their own stats, 0 for no cap. See HeavyHitters.
+	bool flight_recorder = false;           // Keep the last frames of events and write them out when a frame is over budget
+	uint32_t flight_budget_us = 50000;      // Frames taking longer than this are captured
+	uint32_t flight_frames = 3;             // Frames included in a capture, the slow one and the ones before it
+	uint32_t flight_buffer_events = 1 << 17; // Per-thread ring capacity, rounded up to a power of two
+	uint32_t flight_max_captures = 10;      // Captures written per session
+	bool jit_events = true;                 // Record every method compilation and write MonoProfilerJit.csv on dump
+	bool jit_subtract = false;              // Leave compile time out of the runtimes of the methods that triggered it
+	bool monitor_events = true;             // Time waits for contended locks and write MonoProfilerContention.csv on dump
+	bool load_events = true;                // Time assembly and class loads and static constructors and write MonoProfilerLoads.csv on dump
+	uint32_t live_port = 0;                 // Loopback TCP port of the live stats server, 0 turns it off
+	uint32_t live_interval_ms = 1000;       // Time between two frames sent to live clients
+
+	bool set(std::string_view name, int64_t value)
+	{
+		if (name == "mode")
+			mode = static_cast<ProfilerMode>(value);
+		else if (name == "clock")
+			clock = static_cast<ClockSetting>(value);
+		else if (name == "sample_call_depth")
+			sample_call_depth = static_cast<uint32_t>(value);
+		else if (name == "sample_buffer")
+			sample_buffer = static_cast<uint32_t>(value);
+		else if (name == "allocations")
+			allocations = static_cast<AllocationTracking>(value);
+		else if (name == "gc_events")
+			gc_events = value != 0;
+		else if (name == "gc_buffer_events")
+			gc_buffer_events = static_cast<uint32_t>(value);
+		else if (name == "trace")
+			trace = value != 0;
+		else if (name == "trace_buffer_events")
+			trace_buffer_events = static_cast<uint32_t>(value);
+		else if (name == "call_tree")
+			call_tree = value != 0;
+		else if (name == "call_tree_max_nodes")
+			call_tree_max_nodes = static_cast<uint32_t>(value);
+		else if (name == "merged_output")
+			merged_output = value != 0;
+		else if (name == "rollups")
+			rollups = value != 0;
+		else if (name == "histograms")
+			histograms = value != 0;
+		else if (name == "max_methods")
+			max_methods = value > 0 ? static_cast<uint32_t>(std::max<int64_t>(value, 16)) : 0;
+		else if (name == "flight_recorder")
+			flight_recorder = value != 0;
+		else if (name == "flight_budget_us")
+			flight_budget_us = static_cast<uint32_t>(value);
+		else if (name == "flight_frames")
+			flight_frames = static_cast<uint32_t>(value);
+		else if (name == "flight_buffer_events")
+			flight_buffer_events = static_cast<uint32_t>(value);
+		else if (name == "flight_max_captures")
+			flight_max_captures = static_cast<uint32_t>(value);
+		else if (name == "jit_events")
+			jit_events = value != 0;
+		else if (name == "jit_subtract")
+			jit_subtract = value != 0;
+		else if (name == "monitor_events")
+			monitor_events = value != 0;
+		else if (name == "load_events")
+			load_events = value != 0;
+		else if (name == "live_port")
+			live_port = static_cast<uint32_t>(value);
+		else if (name == "live_interval_ms")
+			live_interval_ms = static_cast<uint32_t>(value);
+		else
+			return false;
+		return true;
+	}
+};
+
+inline ProfilerOptions profiler_options;
@@ -0,0 +1,32 @@
+#pragma once
+
+// Everything that differs between the Windows DLL and the Linux shared object
+
+#ifdef _WIN32
+
+#include <Windows.h> // Windows Platform SDK
+
+#define PROFILER_EXPORT extern "C" __declspec(dllexport)
+
+typedef HMODULE module_handle;
+
+inline void* get_export(module_handle module, const char* name)
+{
+	return reinterpret_cast<void*>(GetProcAddress(module, name));
+}
+
+#else
+
+#include <dlfcn.h>
+
+#define PROFILER_EXPORT extern "C" __attribute__((visibility("default")))
+
+// A handle returned by dlopen. Null searches all loaded libraries instead.
+typedef void* module_handle;
+
+inline void* get_export(module_handle module, const char* name)
+{
+	return dlsym(module ? module : RTLD_DEFAULT, name);
+}
+
+#endif
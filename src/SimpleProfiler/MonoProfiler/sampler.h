@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dllmain.h"
+#include "call_tree.h"
+#include "dump_writer.h"
+#include "method_names.h"
+#include "method_table.h"
+#include "options.h"
+
+constexpr int SAMPLE_MAX_FRAMES = 32;
+
+// Raw instruction pointers of one sample, innermost frame first
+struct SampleRecord
+{
+	uint32_t frame_count;
+	void* ips[SAMPLE_MAX_FRAMES];
+};
+
+// Bounded multi-producer single-consumer queue of samples.
+// push() may be called from the runtime's sampling signal handler or timer thread,
+// so it never blocks or allocates. If the queue is full the sample is dropped and counted.
+class SampleQueue
+{
+public:
+	explicit SampleQueue(uint32_t capacity)
+	{
+		size_t size = 256;
+		while (size < capacity)
+			size <<= 1;
+		slots.reset(new Slot[size]);
+		mask = size - 1;
+		for (size_t i = 0; i < size; i++)
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	void push(void* const* ips, uint32_t count)
+	{
+		uint64_t pos = head.load(std::memory_order_relaxed);
+		Slot* slot;
+		while (true)
+		{
+			slot = &slots[pos & mask];
+			int64_t diff = static_cast<int64_t>(slot->sequence.load(std::memory_order_acquire) - pos);
+			if (diff == 0)
+			{
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			else
+			{
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+
+		count = std::min<uint32_t>(count, SAMPLE_MAX_FRAMES);
+		slot->record.frame_count = count;
+		std::copy(ips, ips + count, slot->record.ips);
+		slot->sequence.store(pos + 1, std::memory_order_release);
+	}
+
+	// Only called by the single consumer
+	bool pop(SampleRecord& out)
+	{
+		Slot& slot = slots[tail & mask];
+		if (slot.sequence.load(std::memory_order_acquire) != tail + 1)
+			return false;
+		out = slot.record;
+		slot.sequence.store(tail + mask + 1, std::memory_order_release);
+		tail++;
+		return true;
+	}
+
+	uint64_t take_dropped()
+	{
+		return dropped.exchange(0, std::memory_order_relaxed);
+	}
+
+private:
+	struct Slot
+	{
+		std::atomic<uint64_t> sequence;
+		SampleRecord record;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	size_t mask;
+
+	alignas(64) std::atomic<uint64_t> head = 0;
+	std::atomic<uint64_t> dropped = 0;
+	alignas(64) uint64_t tail = 0; // Only used by the consumer
+};
+
+struct SampleStats
+{
+	uint64_t self_samples = 0;  // Samples where the method was on top of the stack
+	uint64_t total_samples = 0; // Samples where the method was anywhere on the stack
+};
+
+// Statistical profiler used instead of enter/leave instrumentation in ProfilerMode::Sample.
+// The runtime periodically interrupts the game and reports the instruction pointers of the
+// interrupted stack, those are queued as-is and resolved to methods on a background thread.
+class Sampler
+{
+public:
+	static void start()
+	{
+		queue = std::make_unique<SampleQueue>(profiler_options.sample_buffer);
+		tree = std::make_unique<CallTree>(profiler_options.call_tree_max_nodes);
+		std::thread(run).detach();
+	}
+
+	static void hit(void* const* ips, uint32_t count)
+	{
+		queue->push(ips, count);
+	}
+
+	static void reset()
+	{
+		std::lock_guard guard(aggregate_mut);
+		aggregate();
+		methods.clear();
+		tree->clear();
+		unresolved = 0;
+		dropped = 0;
+	}
+
+	// Takes the samples aggregated since the previous dump. The returned job writes per-method sample
+	// counts to MonoProfilerOutput.csv and the sampled call stacks to MonoProfilerCallTree.folded.
+	static DumpWriter::Job dump()
+	{
+		struct Snapshot
+		{
+			MethodTable<SampleStats> methods = MethodTable<SampleStats>(1024);
+			std::unique_ptr<CallTree> tree = std::make_unique<CallTree>(profiler_options.call_tree_max_nodes);
+			uint64_t unresolved = 0;
+			uint64_t dropped = 0;
+		};
+
+		auto snapshot = std::make_shared<Snapshot>();
+		{
+			std::lock_guard guard(aggregate_mut);
+			aggregate();
+			std::swap(snapshot->methods, methods);
+			std::swap(snapshot->tree, tree);
+			snapshot->unresolved = std::exchange(unresolved, 0);
+			snapshot->dropped = std::exchange(dropped, 0);
+		}
+
+		return [snapshot] { write(snapshot->methods, *snapshot->tree, snapshot->unresolved, snapshot->dropped); };
+	}
+
+private:
+	static void write(const MethodTable<SampleStats>& dumped_methods, const CallTree& dumped_tree, uint64_t dumped_unresolved, uint64_t dumped_dropped)
+	{
+		struct Row
+		{
+			const char* name;
+			uint64_t self_samples;
+			uint64_t total_samples;
+		};
+
+		uint64_t sample_count = dumped_unresolved;
+		std::vector<Row> rows;
+		dumped_methods.for_each([&](void* method, const SampleStats& stats) {
+			rows.push_back(Row{ MethodNames::get(method), stats.self_samples, stats.total_samples });
+			sample_count += stats.self_samples;
+		});
+		if (dumped_unresolved > 0)
+			rows.push_back(Row{ "[Native or unknown code]", dumped_unresolved, dumped_unresolved });
+		if (dumped_dropped > 0)
+			rows.push_back(Row{ "[Dropped samples]", dumped_dropped, dumped_dropped });
+		// Percentages are of every sample the runtime took, so the self % of all rows including the dropped ones adds up to 100
+		sample_count += dumped_dropped;
+
+		std::sort(rows.begin(), rows.end(), [](auto& a, auto& b) {
+			return a.self_samples > b.self_samples;
+		});
+
+		std::ostringstream fs;
+		fs << "\"Self samples\",\"Total samples\",\"Self %\",\"Total %\",\"Method name\"\n";
+		for (auto& it : rows)
+		{
+			fs << it.self_samples << "," << it.total_samples << "," <<
+				percent(it.self_samples, sample_count) << "," << percent(it.total_samples, sample_count) << ",\"" << it.name << "\"\n";
+		}
+		DumpWriter::write_file("MonoProfilerOutput.csv", fs.str());
+
+		std::ostringstream folded;
+		dumped_tree.write_folded(folded, "All threads", MethodNames::get, true);
+		DumpWriter::write_file("MonoProfilerCallTree.folded", folded.str());
+	}
+
+
+	static inline std::unique_ptr<SampleQueue> queue;
+
+	static inline std::mutex aggregate_mut;
+	static inline MethodTable<SampleStats> methods = MethodTable<SampleStats>(1024); // Needs lock: aggregate_mut
+	static inline std::unique_ptr<CallTree> tree;                  // Needs lock: aggregate_mut
+	static inline uint64_t unresolved = 0;                         // Needs lock: aggregate_mut
+	static inline uint64_t dropped = 0;                            // Needs lock: aggregate_mut
+	static inline std::unordered_map<void*, void*> method_by_ip;   // Needs lock: aggregate_mut
+
+	static void run()
+	{
+		// Instruction pointers are looked up in the runtime's JIT info table here
+		attach_profiler_thread();
+		while (true)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			std::lock_guard guard(aggregate_mut);
+			aggregate();
+		}
+	}
+
+	static double percent(uint64_t value, uint64_t total)
+	{
+		return total == 0 ? 0.0 : 100.0 * static_cast<double>(value) / static_cast<double>(total);
+	}
+
+	// Code addresses of JIT compiled methods don't change, so every ip only has to be looked up once
+	static void* resolve(void* ip)
+	{
+		auto [it, inserted] = method_by_ip.try_emplace(ip, nullptr);
+		if (inserted)
+		{
+			void* ji = mono_jit_info_table_find(mono_get_root_domain(), static_cast<char*>(ip));
+			if (ji)
+				it->second = mono_jit_info_get_method(ji);
+		}
+		return it->second;
+	}
+
+	// Needs lock: aggregate_mut
+	static void aggregate()
+	{
+		SampleRecord record;
+		void* frames[SAMPLE_MAX_FRAMES];
+		while (queue->pop(record))
+		{
+			uint32_t frame_count = 0;
+			for (uint32_t i = 0; i < record.frame_count; i++)
+			{
+				// Frames in native code can't be resolved and are left out of the stack
+				if (void* method = resolve(record.ips[i]))
+					frames[frame_count++] = method;
+			}
+
+			if (frame_count == 0)
+			{
+				unresolved++;
+				continue;
+			}
+
+			methods.get(frames[0]).self_samples++;
+			for (uint32_t i = 0; i < frame_count; i++)
+			{
+				// Recursive methods only count once per sample
+				if (std::find(frames, frames + i, frames[i]) == frames + i)
+					methods.get(frames[i]).total_samples++;
+			}
+
+			uint32_t node = CallTree::root;
+			for (uint32_t i = frame_count; i-- > 0;)
+				node = tree->child(node, frames[i]);
+			tree->add_sample(node);
+		}
+		dropped += queue->take_dropped();
+	}
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dllmain.h"
+#include "clock.h"
+#include "dump_writer.h"
+
+// One runtime thread. Small ids are reused once a thread has exited, so only the record identifies a thread.
+struct ThreadRecord
+{
+	uint32_t id;          // small_id, the thread id used in the other output files
+	uint64_t native_id;   // tid passed to the thread hooks
+	uint64_t start_ticks; // 0 if the thread was already running when it was first seen
+	uint64_t end_ticks;   // 0 while the thread is alive. Needs lock: ThreadRegistry::records_mut
+	std::string name;     // Empty for unnamed threads. Needs lock: ThreadRegistry::records_mut
+};
+
+// Names and lifetimes of the runtime's threads, from the thread hooks.
+// Threads that were already running when the profiler was installed are added the first time they
+// show up in a hook. Names are read from the runtime's thread object when a thread starts and ends,
+// and updated through the thread name hook on runtimes that have it.
+class ThreadRegistry
+{
+public:
+	static void start()
+	{
+		std::lock_guard guard(records_mut);
+		capture_start = ProfilerClock::now();
+	}
+
+	// Record of the calling thread, which must be attached to the runtime
+	static std::shared_ptr<ThreadRecord> current()
+	{
+		if (!current_record)
+			current_record = add(mono_thread_current(), 0);
+		return current_record;
+	}
+
+	// Called by the runtime on the new thread
+	static void thread_started()
+	{
+		uint64_t now = ProfilerClock::now();
+		// Another hook can run on the thread before the runtime reports its start, that record is kept
+		if (current_record)
+		{
+			std::lock_guard guard(records_mut);
+			if (current_record->start_ticks == 0)
+				current_record->start_ticks = now;
+			return;
+		}
+		current_record = add(mono_thread_current(), now);
+	}
+
+	// Called by the runtime on the exiting thread, which still has its thread object
+	static void thread_ended()
+	{
+		if (current_record)
+			end(read_name(mono_thread_current()));
+	}
+
+	// Called when the OS thread exits. Only ends the record if the runtime didn't.
+	static void thread_detached()
+	{
+		if (current_record)
+			end("");
+	}
+
+	// The name hook can run on any thread, e.g. when one thread names another
+	static void thread_named(uint64_t native_id, const char* name)
+	{
+		std::string clean = sanitize(name ? name : "");
+		std::lock_guard guard(records_mut);
+		for (auto it = records.rbegin(); it != records.rend(); ++it)
+		{
+			if ((*it)->native_id == native_id && (*it)->end_ticks == 0)
+			{
+				(*it)->name = clean;
+				return;
+			}
+		}
+	}
+
+	// "Thread <id>" followed by the name, if the thread has one
+	static std::string label(const ThreadRecord* record, uint32_t id)
+	{
+		std::string result = "Thread " + std::to_string(id);
+		std::string thread_name = name(record);
+		if (!thread_name.empty())
+			result += " (" + thread_name + ")";
+		return result;
+	}
+
+	static std::string name(const ThreadRecord* record)
+	{
+		if (!record)
+			return "";
+		std::lock_guard guard(records_mut);
+		return record->name;
+	}
+
+	static void reset()
+	{
+		std::lock_guard guard(records_mut);
+		remove_ended();
+		capture_start = ProfilerClock::now();
+	}
+
+	// Takes every thread that was alive since the previous dump, the returned job writes them to MonoProfilerThreads.csv.
+	// Threads that ended are dropped afterwards.
+	static DumpWriter::Job dump()
+	{
+		auto rows = std::make_shared<std::vector<ThreadRecord>>();
+		uint64_t window_start;
+		{
+			std::lock_guard guard(records_mut);
+			for (auto& record : records)
+				rows->push_back(*record);
+			remove_ended();
+			window_start = capture_start;
+			capture_start = ProfilerClock::now();
+		}
+
+		return [rows, window_start] {
+			std::stable_sort(rows->begin(), rows->end(), [](const ThreadRecord& a, const ThreadRecord& b) {
+				return a.id < b.id;
+			});
+
+			// Empty start and end columns mean the thread was started before the previous dump, or is still running
+			std::ostringstream fs;
+			fs << "\"Thread\",\"Thread name\",\"Started (ns since previous dump)\",\"Ended (ns since previous dump)\"\n";
+			for (auto& it : *rows)
+			{
+				fs << it.id << ",\"" << it.name << "\",";
+				if (it.start_ticks > window_start)
+					fs << ProfilerClock::to_ns(it.start_ticks - window_start).count();
+				fs << ",";
+				if (it.end_ticks != 0)
+					fs << ProfilerClock::to_ns(it.end_ticks - std::min(it.end_ticks, window_start)).count();
+				fs << "\n";
+			}
+			DumpWriter::write_file("MonoProfilerThreads.csv", fs.str());
+		};
+	}
+
+private:
+	static inline thread_local std::shared_ptr<ThreadRecord> current_record;
+
+	static inline std::mutex records_mut;
+	static inline std::vector<std::shared_ptr<ThreadRecord>> records; // Alive threads and the ones that ended since the previous dump. Needs lock: records_mut
+	static inline uint64_t capture_start = 0;                         // Needs lock: records_mut
+
+	static std::shared_ptr<ThreadRecord> add(_MonoThread* thread, uint64_t start_ticks)
+	{
+		auto record = std::make_shared<ThreadRecord>(ThreadRecord{ thread->small_id, thread->tid, start_ticks, 0, read_name(thread) });
+		std::lock_guard guard(records_mut);
+		// A live record with the same small id is from a thread whose end was never reported, the id has been
+		// reused since. It's ended so the next dump drops it and its name isn't mixed up with this thread's.
+		for (auto& it : records)
+		{
+			if (it->id == record->id && it->end_ticks == 0)
+				it->end_ticks = ProfilerClock::now();
+		}
+		records.push_back(record);
+		return record;
+	}
+
+	static void end(const std::string& last_name)
+	{
+		{
+			std::lock_guard guard(records_mut);
+			if (!last_name.empty())
+				current_record->name = last_name;
+			current_record->end_ticks = ProfilerClock::now();
+		}
+		current_record = nullptr;
+	}
+
+	// Needs lock: records_mut
+	static void remove_ended()
+	{
+		std::erase_if(records, [](auto& record) { return record->end_ticks != 0; });
+	}
+
+	// The name is UTF-16 in the thread object
+	static std::string read_name(_MonoThread* thread)
+	{
+		std::string result;
+		if (!thread || !thread->name)
+			return result;
+
+		for (guint32 i = 0; i < thread->name_len; i++)
+		{
+			uint32_t c = thread->name[i];
+			if (c >= 0xD800 && c < 0xDC00 && i + 1 < thread->name_len && thread->name[i + 1] >= 0xDC00 && thread->name[i + 1] < 0xE000)
+				c = 0x10000 + ((c - 0xD800) << 10) + (thread->name[++i] - 0xDC00);
+
+			if (c < 0x80)
+				result += static_cast<char>(c);
+			else if (c < 0x800)
+			{
+				result += static_cast<char>(0xC0 | (c >> 6));
+				result += static_cast<char>(0x80 | (c & 0x3F));
+			}
+			else if (c < 0x10000)
+			{
+				result += static_cast<char>(0xE0 | (c >> 12));
+				result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+				result += static_cast<char>(0x80 | (c & 0x3F));
+			}
+			else
+			{
+				result += static_cast<char>(0xF0 | (c >> 18));
+				result += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+				result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+				result += static_cast<char>(0x80 | (c & 0x3F));
+			}
+		}
+		return sanitize(result);
+	}
+
+	// Names end up in quoted CSV fields and in the first frame of folded stacks
+	static std::string sanitize(std::string name)
+	{
+		std::replace_if(name.begin(), name.end(), [](char c) { return c == '"' || c == ';' || c == '\n' || c == '\r'; }, ' ');
+		return name;
+	}
+};
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "dllmain.h"
+#include "clock.h"
+#include "method_names.h"
+#include "options.h"
+#include "trace_format.h"
+
+// Single-producer single-consumer ring of trace events.
+// push() is only called by the profiled thread, drain() only by the trace writer thread.
+class TraceRing
+{
+public:
+	const uint32_t thread_id;
+	std::atomic<bool> retired = false; // Set once the owner thread is gone and will not push anymore
+
+	TraceRing(uint32_t thread_id, uint32_t capacity)
+		: thread_id(thread_id)
+	{
+		size_t size = 1024;
+		while (size < capacity)
+			size <<= 1;
+		events.reset(new TraceEvent[size]);
+		mask = size - 1;
+	}
+
+	// Never blocks, if the writer can't keep up the event is dropped and counted instead.
+	void push(uint64_t ticks, uint32_t method_id)
+	{
+		uint64_t h = head.load(std::memory_order_relaxed);
+		if (h - cached_tail > mask)
+		{
+			cached_tail = tail.load(std::memory_order_acquire);
+			if (h - cached_tail > mask)
+			{
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+		}
+
+		events[h & mask] = TraceEvent{ ticks, method_id, thread_id };
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	// Appends all currently available events to `out`
+	void drain(std::vector<TraceEvent>& out)
+	{
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		uint64_t h = head.load(std::memory_order_acquire);
+		for (; t != h; t++)
+			out.push_back(events[t & mask]);
+		tail.store(t, std::memory_order_release);
+	}
+
+	uint64_t take_dropped()
+	{
+		return dropped.exchange(0, std::memory_order_relaxed);
+	}
+
+private:
+	std::unique_ptr<TraceEvent[]> events;
+	size_t mask;
+
+	alignas(64) std::atomic<uint64_t> head = 0; // Written by producer
+	uint64_t cached_tail = 0;                   // Producer's last seen value of tail
+	std::atomic<uint64_t> dropped = 0;
+	alignas(64) std::atomic<uint64_t> tail = 0; // Written by consumer
+};
+
+// Background thread that periodically drains every TraceRing into MonoProfilerTrace.bin.
+// The profiled threads never touch the file, so they can't be stalled by I/O.
+class TraceWriter
+{
+public:
+	static bool is_running() { return running; }
+
+	static uint64_t ticks_since_start(uint64_t now) { return now - start_ticks; }
+
+	static void start(const char* path)
+	{
+		file.open(path, std::fstream::out | std::fstream::binary | std::fstream::trunc);
+		if (!file)
+			return;
+
+		TraceFileHeader header{};
+		std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+		header.version = TRACE_VERSION;
+		header.ns_per_tick = ProfilerClock::ns_per_tick;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+		start_ticks = ProfilerClock::now();
+		running = true;
+		std::thread(run).detach();
+	}
+
+	static std::shared_ptr<TraceRing> create_ring(uint32_t thread_id)
+	{
+		auto ring = std::make_shared<TraceRing>(thread_id, profiler_options.trace_buffer_events);
+		std::lock_guard guard(rings_mut);
+		rings.push_back(ring);
+		return ring;
+	}
+
+	// Returns the trace id of the method. Its name is resolved later by the writer thread.
+	// Callers should cache the result since this takes a global lock.
+	static uint32_t register_method(void* method)
+	{
+		std::lock_guard guard(methods_mut);
+		auto it = method_ids.find(method);
+		if (it != method_ids.end())
+			return it->second;
+
+		uint32_t id = static_cast<uint32_t>(methods.size()) + 1;
+		method_ids.emplace(method, id);
+		methods.push_back(method);
+		return id;
+	}
+
+	// All methods registered so far, index is id - 1
+	static std::vector<void*> registered_methods()
+	{
+		std::lock_guard guard(methods_mut);
+		return methods;
+	}
+
+private:
+	static inline std::ofstream file;
+	static inline uint64_t start_ticks = 0;
+	static inline std::atomic<bool> running = false;
+
+	static inline std::mutex rings_mut;
+	static inline std::vector<std::shared_ptr<TraceRing>> rings; // Needs lock: rings_mut
+
+	static inline std::mutex methods_mut;
+	static inline std::unordered_map<void*, uint32_t> method_ids; // Needs lock: methods_mut
+	static inline std::vector<void*> methods;                     // Index is id - 1. Needs lock: methods_mut
+	static inline size_t names_written = 0;                       // Only used by the writer thread
+
+	static void run()
+	{
+		// Method names are resolved here
+		attach_profiler_thread();
+		std::vector<TraceEvent> events;
+		while (true)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			flush(events);
+		}
+	}
+
+	static void write_chunk(TraceChunkType type, const std::string& payload)
+	{
+		TraceChunkHeader header{ type, static_cast<uint32_t>(payload.size()) };
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(payload.data(), payload.size());
+	}
+
+	template <typename T>
+	static void append(std::string& buffer, const T& value)
+	{
+		buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	static void flush(std::vector<TraceEvent>& events)
+	{
+		std::vector<std::shared_ptr<TraceRing>> snapshot;
+		{
+			std::lock_guard guard(rings_mut);
+			snapshot = rings;
+		}
+
+		// Drain first and write names after, so that every id used by the drained events
+		// is already registered when the name chunk is written
+		std::vector<std::string> chunks;
+		std::vector<std::shared_ptr<TraceRing>> finished;
+		for (auto& ring : snapshot)
+		{
+			bool was_retired = ring->retired.load(std::memory_order_acquire);
+			events.clear();
+			ring->drain(events);
+			uint64_t dropped = ring->take_dropped();
+			if (was_retired)
+				finished.push_back(ring);
+			if (events.empty() && dropped == 0)
+				continue;
+
+			std::string payload;
+			payload.reserve(sizeof(TraceEventsHeader) + events.size() * sizeof(TraceEvent));
+			append(payload, TraceEventsHeader{ ring->thread_id, static_cast<uint32_t>(events.size()), dropped });
+			payload.append(reinterpret_cast<const char*>(events.data()), events.size() * sizeof(TraceEvent));
+			chunks.push_back(std::move(payload));
+		}
+
+		// Only the new methods are copied under the lock. Game threads take it for every method they
+		// haven't traced before, so names are resolved and written after it's released.
+		std::vector<void*> new_methods;
+		{
+			std::lock_guard guard(methods_mut);
+			new_methods.assign(methods.begin() + names_written, methods.end());
+		}
+		if (!new_methods.empty())
+		{
+			std::string payload;
+			append(payload, static_cast<uint32_t>(new_methods.size()));
+			for (void* method : new_methods)
+			{
+				const char* name = MethodNames::get(method);
+				uint32_t length = static_cast<uint32_t>(std::strlen(name));
+				append(payload, static_cast<uint32_t>(++names_written));
+				append(payload, length);
+				payload.append(name, length);
+			}
+			write_chunk(TraceChunkType::MethodNames, payload);
+		}
+
+		for (auto& chunk : chunks)
+			write_chunk(TraceChunkType::Events, chunk);
+		file.flush();
+
+		if (!finished.empty())
+		{
+			std::lock_guard guard(rings_mut);
+			for (auto& ring : finished)
+				rings.erase(std::find(rings.begin(), rings.end(), ring));
+		}
+	}
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+
+// Layout of MonoProfilerTrace.bin. Shared between the profiler and offline tools, so
+// keep it free of any Mono or Windows dependencies.
+//
+// The file starts with a TraceFileHeader followed by any number of chunks. Every chunk
+// starts with a TraceChunkHeader, unknown chunk types can be skipped using its size.
+// A method id is always defined by a MethodNames chunk before the first Events chunk that uses it.
+
+constexpr char TRACE_MAGIC[8] = { 'M', 'P', 'T', 'R', 'A', 'C', 'E', '\0' };
+constexpr uint32_t TRACE_VERSION = 1;
+
+// Set in TraceEvent::method_id for leave events
+constexpr uint32_t TRACE_LEAVE_FLAG = 0x80000000u;
+
+// TraceEventsHeader::thread_id of the frame slices in slow frame captures. Mono's small ids start at 0, so
+// real threads can't be told apart from this by any smaller value.
+constexpr uint32_t TRACE_FRAMES_THREAD_ID = 0xFFFFFFFFu;
+
+#pragma pack(push, 1)
+
+struct TraceFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	double ns_per_tick; // Converts TraceEvent::ticks to nanoseconds
+};
+
+enum class TraceChunkType : uint32_t
+{
+	// uint32_t count, then `count` times: uint32_t method_id, uint32_t length, char name[length]
+	MethodNames = 1,
+	// TraceEventsHeader, then TraceEventsHeader::count times TraceEvent
+	Events = 2,
+};
+
+struct TraceChunkHeader
+{
+	TraceChunkType type;
+	uint32_t size; // Payload size in bytes, not including this header
+};
+
+struct TraceEventsHeader
+{
+	uint32_t thread_id;
+	uint32_t count;
+	uint64_t dropped; // Events lost to ring buffer overflow on this thread since the previous chunk
+};
+
+struct TraceEvent
+{
+	uint64_t ticks;     // Since the start of the trace
+	uint32_t method_id; // TRACE_LEAVE_FLAG is set for leave events
+	uint32_t thread_id;
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(TraceEvent) == 16, "TraceEvent is part of the file format");
@@ -15,6 +15,14 @@ namespace MonoProfiler
 
         private ConfigEntry<bool> _uniqueNames;
         private ConfigEntry<KeyboardShortcut> _key;
+        private ConfigEntry<KeyboardShortcut> _toggleKey;
+        private ConfigEntry<KeyboardShortcut> _resetKey;
+        private ConfigEntry<string> _filter;
+        private ConfigEntry<bool> _startupDump;
+        private bool _profilerEnabled;
+        private uint? _pendingDump;
+        private DateTime _timestamp;
+        private bool _isStartupDump;
 
         private void Awake()
         {
@@ -27,22 +35,90 @@ namespace MonoProfiler
 
             _key = Config.Bind("Capture", "Dump collected data", new KeyboardShortcut(KeyCode.BackQuote), "Key used to dump all information to a file. Only includes information that was captured since the last time a dump was triggered.");
             _uniqueNames = Config.Bind("Capture", "Give dumps unique names", true, "If true each dump will be saved to a new file. If false old dump will be overwritten instead.");
+            _toggleKey = Config.Bind("Capture", "Toggle profiling", KeyboardShortcut.Empty, "Key used to pause and resume collecting data. While paused the profiler barely affects performance.");
+            _resetKey = Config.Bind("Capture", "Reset collected data", KeyboardShortcut.Empty, "Key used to discard everything that was collected since the last dump, e.g. to start a capture right before doing something specific.");
+            _startupDump = Config.Bind("Capture", "Dump after startup", false, "Automatically dump once all plugins have been loaded. The dump covers everything from the profiler being installed until then, so it shows what the game and the mods spent the startup on. Look at MonoProfilerLoads.csv for the slowest assembly loads, class loads and static constructors. The files are saved with a _Startup suffix.");
+            _filter = Config.Bind("Capture", "Method filter", "", "Only profile methods that match this filter. Comma separated list of namespace prefixes and assembly names in brackets, entries starting with - are excluded. For example: MyMod, -MyMod.Debug, [Assembly-CSharp]. Leave empty to profile everything. Does not apply to Sample mode.");
+
+            _filter.SettingChanged += (sender, args) => MonoProfilerPatcher.SetFilter(_filter.Value);
+            MonoProfilerPatcher.SetFilter(_filter.Value);
+            _profilerEnabled = MonoProfilerPatcher.IsEnabled;
+        }
+
+        private void Start()
+        {
+            // Start only runs after the Awake of every plugin, so all of them have been loaded by now
+            if (_startupDump.Value)
+            {
+                _isStartupDump = true;
+                _pendingDump = MonoProfilerPatcher.StartProfilerDump();
+            }
         }
 
         private void Update()
         {
-            if (_key.Value.IsDown())
+            if (MonoProfilerPatcher.MarkFrame())
+                Logger.LogMessage("Slow frame captured, saving it to the game root");
+
+            if (_toggleKey.Value.IsDown())
             {
-                var dumpFile = MonoProfilerPatcher.RunProfilerDump();
+                _profilerEnabled = !_profilerEnabled;
+                MonoProfilerPatcher.SetEnabled(_profilerEnabled);
+                Logger.LogMessage(_profilerEnabled ? "Profiler resumed" : "Profiler paused");
+            }
 
-                if (_uniqueNames.Value)
+            if (_resetKey.Value.IsDown())
+            {
+                MonoProfilerPatcher.ResetStats();
+                Logger.LogMessage("Discarded collected profiler data");
+            }
+
+            if (_key.Value.IsDown())
+            {
+                if (_pendingDump.HasValue)
                 {
-                    var containingDirectory = dumpFile.DirectoryName ?? throw new InvalidOperationException("dumpFile.DirectoryName is null for " + dumpFile);
-                    dumpFile.MoveTo(Path.Combine(containingDirectory, $"{Path.GetFileNameWithoutExtension(dumpFile.Name)}_{DateTime.Now:yyyy-MM-dd_HH-mm-ss}{dumpFile.Extension}"));
+                    Logger.LogMessage("The previous profiler dump is still being written, try again in a moment");
                 }
+                else
+                {
+                    // The dump is written on a background thread, the files are picked up once it's done
+                    _timestamp = DateTime.Now;
+                    _pendingDump = MonoProfilerPatcher.StartProfilerDump();
+                }
+            }
+
+            if (_pendingDump.HasValue && MonoProfilerPatcher.IsDumpFinished(_pendingDump.Value))
+            {
+                _pendingDump = null;
+                SaveDump();
+            }
+        }
 
-                Logger.LogMessage("Saved profiler dump to " + dumpFile.FullName);
+        private void SaveDump()
+        {
+            var dumpFile = MonoProfilerPatcher.GetDumpOutput();
+            var extraFiles = MonoProfilerPatcher.GetExtraDumps();
+
+            // The startup dump always gets its own name, so the next dump doesn't overwrite it
+            var suffix = _isStartupDump ? "Startup" : _uniqueNames.Value ? _timestamp.ToString("yyyy-MM-dd_HH-mm-ss") : null;
+            _isStartupDump = false;
+            if (suffix != null)
+            {
+                MakeUnique(dumpFile, suffix);
+                foreach (var extraFile in extraFiles) MakeUnique(extraFile, suffix);
             }
+
+            Logger.LogMessage("Saved profiler dump to " + dumpFile.FullName);
+            foreach (var extraFile in extraFiles) Logger.LogMessage("Saved " + extraFile.FullName);
+        }
+
+        private static void MakeUnique(FileInfo file, string suffix)
+        {
+            var containingDirectory = file.DirectoryName ?? throw new InvalidOperationException("file.DirectoryName is null for " + file);
+            var target = new FileInfo(Path.Combine(containingDirectory, $"{Path.GetFileNameWithoutExtension(file.Name)}_{suffix}{file.Extension}"));
+            // The startup dump of the previous session has the same name
+            if (target.Exists) target.Delete();
+            file.MoveTo(target.FullName);
         }
     }
 }
\ No newline at end of file
@@ -5,6 +5,7 @@ using System.IO;
 using System.Linq;
 using System.Runtime.InteropServices;
 using BepInEx;
+using BepInEx.Configuration;
 using BepInEx.Logging;
 using Mono.Cecil;
 
@@ -13,25 +14,114 @@ namespace MonoProfiler
     public static class MonoProfilerPatcher
     {
         private const string ProfilerOutputFilename = "MonoProfilerOutput.csv";
+        // Written next to the main output by some of the optional modes
+        private static readonly string[] ExtraOutputFilenames = { "MonoProfilerCallTree.folded", "MonoProfilerAllocations.csv", "MonoProfilerGC.csv", "MonoProfilerOutputByMethod.csv", "MonoProfilerJit.csv", "MonoProfilerThreads.csv", "MonoProfilerContention.csv", "MonoProfilerRollup.csv", "MonoProfilerLoads.csv" };
         private static Dump _dumpFunction;
+        private static DumpAsync _dumpAsyncFunction;
+        private static IsDumpFinishedDelegate _isDumpFinishedFunction;
+        private static SetEnabledDelegate _setEnabledFunction;
+        private static SetFilterDelegate _setFilterFunction;
+        private static ResetStats _resetStatsFunction;
+        private static MarkFrameDelegate _markFrameFunction;
         private static ManualLogSource _logger;
 
         public static IEnumerable<string> TargetDLLs { get; } = new string[0];
 
         private static bool Is64BitProcess => IntPtr.Size == 8;
         public static bool IsInitialized => _dumpFunction != null;
+        public static bool IsEnabled { get; private set; }
 
         public static FileInfo RunProfilerDump()
         {
             if (_dumpFunction == null) throw new InvalidOperationException("Tried to trigger a profiler info dump before profiler was initialized");
 
+            // Remove leftovers from earlier sessions so GetExtraDumps only finds what this dump wrote
+            foreach (var extraDump in GetExtraDumps()) extraDump.Delete();
+
             _dumpFunction();
 
+            return GetDumpOutput();
+        }
+
+        /// <summary>
+        /// Start a dump without waiting for it to be written, only the snapshot of the collected data is taken right away.
+        /// Poll <see cref="IsDumpFinished"/> with the returned id, then get the files from <see cref="GetDumpOutput"/> and <see cref="GetExtraDumps"/>.
+        /// </summary>
+        public static uint StartProfilerDump()
+        {
+            if (_dumpAsyncFunction == null) throw new InvalidOperationException("Tried to trigger a profiler info dump before profiler was initialized");
+
+            foreach (var extraDump in GetExtraDumps()) extraDump.Delete();
+
+            return _dumpAsyncFunction();
+        }
+
+        /// <summary>
+        /// True once the dump started by <see cref="StartProfilerDump"/> has been completely written.
+        /// </summary>
+        public static bool IsDumpFinished(uint dumpId)
+        {
+            if (_isDumpFinishedFunction == null) throw new InvalidOperationException("Tried to check a profiler dump before profiler was initialized");
+            return _isDumpFinishedFunction(dumpId);
+        }
+
+        /// <summary>
+        /// The main output file of the last finished dump.
+        /// </summary>
+        public static FileInfo GetDumpOutput()
+        {
             var dump = new FileInfo(Path.Combine(Paths.GameRootPath, ProfilerOutputFilename));
             if (!dump.Exists) throw new FileNotFoundException("Could not find the profiler dump file in " + dump.FullName);
             return dump;
         }
 
+        /// <summary>
+        /// Additional files written by the last dump, like the call tree. Which ones exist depends on the enabled modes.
+        /// </summary>
+        public static List<FileInfo> GetExtraDumps()
+        {
+            return ExtraOutputFilenames.Select(name => new FileInfo(Path.Combine(Paths.GameRootPath, name))).Where(file => file.Exists).ToList();
+        }
+
+        /// <summary>
+        /// Pause or resume profiling without uninstalling the profiler. While paused nothing is collected.
+        /// </summary>
+        public static void SetEnabled(bool enabled)
+        {
+            if (_setEnabledFunction == null) throw new InvalidOperationException("Tried to enable or disable the profiler before it was initialized");
+            _setEnabledFunction(enabled);
+            IsEnabled = enabled;
+        }
+
+        /// <summary>
+        /// Only profile methods matching the filter. It's a comma separated list of namespace prefixes and [assembly names],
+        /// entries starting with - are excluded. Null or empty profiles all methods.
+        /// </summary>
+        public static void SetFilter(string filter)
+        {
+            if (_setFilterFunction == null) throw new InvalidOperationException("Tried to set a profiler filter before profiler was initialized");
+            _setFilterFunction(filter ?? string.Empty);
+        }
+
+        /// <summary>
+        /// Discard everything collected since the last dump.
+        /// </summary>
+        public static void ResetStats()
+        {
+            if (_resetStatsFunction == null) throw new InvalidOperationException("Tried to reset profiler stats before profiler was initialized");
+            _resetStatsFunction();
+        }
+
+        /// <summary>
+        /// Tell the flight recorder that a frame has ended. Returns true if the frame took longer than the configured budget
+        /// and is being saved to a MonoProfilerSlowFrame file. Always false if the flight recorder is disabled.
+        /// </summary>
+        public static bool MarkFrame()
+        {
+            if (_markFrameFunction == null) throw new InvalidOperationException("Tried to mark a frame before profiler was initialized");
+            return _markFrameFunction();
+        }
+
         public static void Initialize()
         {
             _logger = new ManualLogSource("MonoProfiler");
@@ -61,6 +151,32 @@ namespace MonoProfiler
                     return;
                 }
 
+                // Pass settings to the profiler, this has to happen before it's subscribed
+                var setOptionPtr = GetProcAddress(profilerPtr, "SetOption");
+                if (setOptionPtr == IntPtr.Zero)
+                {
+                    _logger.LogError("Failed to find function SetOption in MonoProfiler.dll");
+                    return;
+                }
+                var setOption = (SetOptionDelegate)Marshal.GetDelegateForFunctionPointer(setOptionPtr, typeof(SetOptionDelegate));
+                var enabledOnStart = ApplyOptions(setOption);
+
+                var setEnabledPtr = GetProcAddress(profilerPtr, "SetEnabled");
+                var setFilterPtr = GetProcAddress(profilerPtr, "SetFilter");
+                var resetStatsPtr = GetProcAddress(profilerPtr, "ResetStats");
+                var markFramePtr = GetProcAddress(profilerPtr, "MarkFrame");
+                if (setEnabledPtr == IntPtr.Zero || setFilterPtr == IntPtr.Zero || resetStatsPtr == IntPtr.Zero || markFramePtr == IntPtr.Zero)
+                {
+                    _logger.LogError("Failed to find functions SetEnabled, SetFilter, ResetStats or MarkFrame in MonoProfiler.dll");
+                    return;
+                }
+                _setEnabledFunction = (SetEnabledDelegate)Marshal.GetDelegateForFunctionPointer(setEnabledPtr, typeof(SetEnabledDelegate));
+                _setFilterFunction = (SetFilterDelegate)Marshal.GetDelegateForFunctionPointer(setFilterPtr, typeof(SetFilterDelegate));
+                _resetStatsFunction = (ResetStats)Marshal.GetDelegateForFunctionPointer(resetStatsPtr, typeof(ResetStats));
+                _markFrameFunction = (MarkFrameDelegate)Marshal.GetDelegateForFunctionPointer(markFramePtr, typeof(MarkFrameDelegate));
+                _setEnabledFunction(enabledOnStart);
+                IsEnabled = enabledOnStart;
+
                 // Subscribe the profiler in mono
                 var addProfilerPtr = GetProcAddress(profilerPtr, "AddProfiler");
                 if (addProfilerPtr == IntPtr.Zero)
@@ -73,11 +189,15 @@ namespace MonoProfiler
 
                 // Prepare callback used to trigger a dump of collected profiler info
                 var dumpPtr = GetProcAddress(profilerPtr, "Dump");
-                if (dumpPtr == IntPtr.Zero)
+                var dumpAsyncPtr = GetProcAddress(profilerPtr, "DumpAsync");
+                var isDumpFinishedPtr = GetProcAddress(profilerPtr, "IsDumpFinished");
+                if (dumpPtr == IntPtr.Zero || dumpAsyncPtr == IntPtr.Zero || isDumpFinishedPtr == IntPtr.Zero)
                 {
-                    _logger.LogError("Failed to find function Dump in MonoProfiler.dll");
+                    _logger.LogError("Failed to find functions Dump, DumpAsync or IsDumpFinished in MonoProfiler.dll");
                     return;
                 }
+                _dumpAsyncFunction = (DumpAsync)Marshal.GetDelegateForFunctionPointer(dumpAsyncPtr, typeof(DumpAsync));
+                _isDumpFinishedFunction = (IsDumpFinishedDelegate)Marshal.GetDelegateForFunctionPointer(isDumpFinishedPtr, typeof(IsDumpFinishedDelegate));
                 _dumpFunction = (Dump)Marshal.GetDelegateForFunctionPointer(dumpPtr, typeof(Dump));
 
                 _logger.LogDebug($"Loaded profiler from {profilerPath}"); // monoModule:{monoModule} profilerPtr:{profilerPtr} AddProfilerPtr:{addProfilerPtr} DumpPtr:{dumpPtr}
@@ -92,8 +212,102 @@ namespace MonoProfiler
             }
         }
 
+        private static bool ApplyOptions(SetOptionDelegate setOption)
+        {
+            var config = new ConfigFile(Path.Combine(Paths.ConfigPath, "MonoProfilerLoader.cfg"), true);
+
+            var enabledOnStart = config.Bind("General", "Enabled on start", true, "If false the profiler is installed but doesn't collect anything until it's turned on with the MonoProfiler Controller hotkey. Turning it off makes the game run at almost full speed.");
+            var mergedOutput = config.Bind("General", "Merge threads", false, "Also write MonoProfilerOutputByMethod.csv on every dump, with one row per method summed over all threads instead of one row per thread and method. The Threads column tells on how many threads the method ran.");
+            var rollups = config.Bind("General", "Rollups", true, "Also write MonoProfilerRollup.csv on every dump, with the self time, calls, allocations and blocked time summed per assembly, namespace and class. Shows how much each mod costs without going through the method rows.");
+            var histograms = config.Bind("General", "Latency histograms", false, "Keep a histogram of the total and self runtime of every call, and add min, max, p50, p90, p99 and p99.9 columns to the dump. Shows whether a method is always slow or only has rare spikes. Percentiles are accurate to within 12.5%. Uses about 4 KB more memory per method and thread. Does not apply to Sample or Count mode. Requires a game restart.");
+
+            var maxMethods = config.Bind("General", "Max methods per thread", 0, "If not 0, every thread keeps its own stats for at most this many methods between two dumps, which puts a hard limit on the profiler's memory and dump time in games with huge numbers of generic or dynamic methods. When a thread runs out of room, the methods with the least self time are merged into an [Evicted methods] row. Methods with a lot of self time always keep their own row, and the Max missing self runtime column says how much time a method may have lost to an earlier eviction (0 means exact). Values below 16 are raised to 16. Does not apply to Sample or Count mode. Requires a game restart.");
+
+            var mode = config.Bind("Mode", "Profiler mode", ProfilerMode.Instrument, "Instrument: time every method call. Exact call counts and runtimes, but noticeably slows down the game.\nSample: let the runtime periodically sample what code is running. Much lower overhead, but only reports how often each method was seen running (sample counts) instead of exact times and call counts. Trace and call tree settings are ignored, sampled stacks are always written to MonoProfilerCallTree.folded.\nCount: only count how often every method is called. Exact call counts at a fraction of the Instrument overhead, but no runtimes, allocations, call trees or traces.\nRequires a game restart.");
+            var clock = config.Bind("Mode", "Clock", ClockSetting.Auto, "Auto: time calls with the CPU's timestamp counter if it runs at a constant rate, which is the cheapest clock, and fall back to the system clock otherwise.\nChrono: always use the system clock. Try this if runtimes look wrong, e.g. on virtual machines or old multi-socket systems where the timestamp counters of different cores aren't in sync.\nRequires a game restart.");
+            var sampleCallDepth = config.Bind("Mode", "Sampled stack depth", 16, "How many frames of the call stack are recorded with each sample in Sample mode. 1 only records the running method, which is the cheapest. At most 32.");
+
+            var allocations = config.Bind("Allocations", "Allocation tracking", AllocationTracking.HeapSize, "None: don't measure allocations, which makes profiling a bit cheaper.\nHeapSize: estimate allocations from changes in the total heap size. Cheap, but includes allocations made by other threads and is thrown off by garbage collections.\nEvents: get notified of every allocated object. Exact per-method numbers and an extra MonoProfilerAllocations.csv with allocations per class, but makes every allocation slower.\nRequires a game restart.");
+
+            var gcEvents = config.Bind("GC", "Record garbage collections", true, "Record the start time, duration, stop-the-world time, generation and heap capacity of every garbage collection, plus the used heap size at each dump, and write them to MonoProfilerGC.csv on every dump. Start times are relative to the previous dump, so GC pauses can be matched up with the method timings of the same dump. Requires a game restart.");
+            var gcBufferEvents = config.Bind("GC", "Collections kept between dumps", 4096, "How many garbage collections can be recorded between two dumps. Any further collections are only counted.");
+
+            var jitEvents = config.Bind("JIT", "Record compilations", true, "Record every method the runtime compiles, with how long the compilation took and the size of the generated code, and write them to MonoProfilerJit.csv on every dump, slowest first. The first call of a method is compiled on the spot, so these are the hitches that go away after a method has run once. Requires a game restart.");
+            var jitSubtract = config.Bind("JIT", "Exclude compile time from callers", false, "Compile time is normally counted in the runtime of the method that made the first call. If enabled, it is left out of that method's (and its callers') runtimes, so the dump only shows time spent running code. Does not apply to Sample or Count mode. Requires a game restart.");
+
+            var monitorEvents = config.Bind("Locks", "Record lock contention", true, "Time how long threads wait for locks (lock blocks, Monitor.Enter) that another thread is holding. The waits are listed per class of the locked object in MonoProfilerContention.csv on every dump, and the dump gets a Blocked time column with the time each method spent waiting. That time is left out of the method's self runtime. Locks that are free cost nothing extra. Requires a game restart.");
+
+            var loadEvents = config.Bind("Startup", "Record loads", true, "Time every assembly and class the runtime loads and every static constructor that runs, and write them to MonoProfilerLoads.csv on every dump, most expensive first. Most of them happen while the game starts, so this shows which mods and classes make startup slow. Nested loads are subtracted in the self duration column. Static constructors are only timed in Instrument mode. Turn on Dump after startup in the MonoProfiler Controller config to capture the whole startup. Requires a game restart.");
+
+            var livePort = config.Bind("Live view", "Port", 0, "If not 0, the profiler serves live stats on this local TCP port (e.g. 7878). Run LiveViewer from the tools folder to watch the methods with the most self time while playing, without dumping. Only accepts connections from the same PC. Does not apply to Sample or Count mode. Requires a game restart.");
+            var liveInterval = config.Bind("Live view", "Update interval (ms)", 1000, "How often connected viewers get new numbers. Every update briefly takes the stats from all threads, like a small dump without the files.");
+
+            var trace = config.Bind("Trace", "Record event trace", false, "Stream every method enter and leave event to MonoProfilerTrace.bin in the game root. The trace is written on a background thread for the whole session, independently of dumps. Requires a game restart.");
+            var traceBufferEvents = config.Bind("Trace", "Buffer size per thread", 65536, "How many events each thread can buffer before the trace writer drains them. If a thread fills its buffer faster than that, the extra events are dropped and counted in the trace. Each event takes 16 bytes.");
+
+            var callTree = config.Bind("Call tree", "Record call tree", false, "Also aggregate timings per call path (which caller called which method) and write them to MonoProfilerCallTree.folded on every dump. The file is in the collapsed stack format used by flamegraph tools, weighted by self runtime in nanoseconds. Requires a game restart.");
+            var callTreeMaxNodes = config.Bind("Call tree", "Max nodes per thread", 65536, "Upper limit of distinct call paths kept per thread between dumps. Calls on new paths past this limit are counted under a single overflow node. Each node takes about 48 bytes, twice per thread.");
+
+            var flightRecorder = config.Bind("Flight recorder", "Capture slow frames", false, "Keep the last few frames of method enter and leave events in memory, and save them to a MonoProfilerSlowFrame_<time>.bin file in the game root whenever a frame takes longer than the budget. Open the files with TraceConverter like MonoProfilerTrace.bin. Needs the MonoProfiler Controller plugin to mark frames. Does not apply to Sample or Count mode. Requires a game restart.");
+            var flightBudget = config.Bind("Flight recorder", "Frame budget (ms)", 50f, "Frames that take longer than this many milliseconds are captured.");
+            var flightFrames = config.Bind("Flight recorder", "Frames per capture", 3, "How many frames are saved in a capture: the slow frame and the frames right before it. Only as much as fits in the buffer is kept.");
+            var flightBufferEvents = config.Bind("Flight recorder", "Buffer size per thread", 131072, "How many of the most recent events every thread keeps. Each event takes 16 bytes. If a capture doesn't reach back to the start of its frames, increase this.");
+            var flightMaxCaptures = config.Bind("Flight recorder", "Max captures", 10, "Stop capturing after this many slow frames in one session, so a game that is slow all the time doesn't fill the disk.");
+
+            setOption("mode", (long)mode.Value);
+            setOption("clock", (long)clock.Value);
+            setOption("sample_call_depth", sampleCallDepth.Value);
+            setOption("allocations", (long)allocations.Value);
+            setOption("gc_events", gcEvents.Value ? 1 : 0);
+            setOption("gc_buffer_events", gcBufferEvents.Value);
+            setOption("trace", trace.Value ? 1 : 0);
+            setOption("trace_buffer_events", traceBufferEvents.Value);
+            setOption("call_tree", callTree.Value ? 1 : 0);
+            setOption("call_tree_max_nodes", callTreeMaxNodes.Value);
+            setOption("merged_output", mergedOutput.Value ? 1 : 0);
+            setOption("rollups", rollups.Value ? 1 : 0);
+            setOption("histograms", histograms.Value ? 1 : 0);
+            setOption("max_methods", maxMethods.Value);
+            setOption("flight_recorder", flightRecorder.Value ? 1 : 0);
+            setOption("flight_budget_us", (long)(flightBudget.Value * 1000));
+            setOption("flight_frames", flightFrames.Value);
+            setOption("flight_buffer_events", flightBufferEvents.Value);
+            setOption("flight_max_captures", flightMaxCaptures.Value);
+            setOption("jit_events", jitEvents.Value ? 1 : 0);
+            setOption("jit_subtract", jitSubtract.Value ? 1 : 0);
+            setOption("monitor_events", monitorEvents.Value ? 1 : 0);
+            setOption("load_events", loadEvents.Value ? 1 : 0);
+            setOption("live_port", livePort.Value);
+            setOption("live_interval_ms", liveInterval.Value);
+
+            return enabledOnStart.Value;
+        }
+
         public static void Patch(AssemblyDefinition ass) { }
 
+        // Values have to match ProfilerMode in options.h
+        private enum ProfilerMode
+        {
+            Instrument = 0,
+            Sample = 1,
+            Count = 2
+        }
+
+        // Values have to match ClockSetting in options.h
+        private enum ClockSetting
+        {
+            Auto = 0,
+            Chrono = 1
+        }
+
+        // Values have to match AllocationTracking in options.h
+        private enum AllocationTracking
+        {
+            None = 0,
+            HeapSize = 1,
+            Events = 2
+        }
+
         [DllImport("kernel32", CharSet = CharSet.Ansi, ExactSpelling = true, SetLastError = true)]
         private static extern IntPtr GetProcAddress(IntPtr hModule, string procName);
 
@@ -102,5 +316,27 @@ namespace MonoProfiler
 
         private delegate void AddProfilerDelegate(IntPtr mono);
         private delegate void Dump();
+        private delegate void ResetStats();
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        private delegate uint DumpAsync();
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        private delegate bool MarkFrameDelegate();
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        private delegate bool IsDumpFinishedDelegate(uint dumpId);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        private delegate void SetEnabledDelegate([MarshalAs(UnmanagedType.I1)] bool enabled);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Ansi)]
+        private delegate void SetFilterDelegate(string filter);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        private delegate bool SetOptionDelegate(string name, long value);
     }
 }
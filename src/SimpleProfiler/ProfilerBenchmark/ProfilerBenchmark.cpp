@@ -0,0 +1,350 @@
+// ProfilerBenchmark.cpp : Measures the overhead of the native profiler against the FakeMono runtime.
+// Usage: ProfilerBenchmark [--profiler <path>] [--threads 1,2,4,8] [--depth 6] [--fanout 4] [--iterations 20]
+//                          [--leaf-methods <count>] [--clock-drift <seconds>] [--option <name>=<value>]...
+//
+// Every thread walks the same synthetic call tree (`fanout` children per method, `depth` levels),
+// calling the enter/leave hooks the profiler installed in the fake runtime. The walk is timed once
+// before the profiler is added, which gives the cost of the walk itself, and then with the profiler
+// for every thread count. Options are passed to SetOption before AddProfiler, like the patcher does.
+//
+// --leaf-methods gives the deepest level its own pool of distinct methods, which the walk cycles through,
+// so the working set can be made bigger than a method cap (e.g. --leaf-methods 4096 --option max_methods=1024).
+//
+// Before the walks, the cost of reading each ProfilerClock source is printed. Compare the overhead of both
+// clocks with --option clock=1, which forces chrono. --clock-drift checks the TSC calibration by comparing
+// the calibrated TSC to steady_clock once a second for that many seconds.
+
+#include "../FakeMono/fake_mono.h"
+#include "../MonoProfiler/clock.h"
+
+#include <dlfcn.h>
+
+#include <algorithm>
+#include <barrier>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+typedef void (*AddProfiler_t)(void* mono);
+typedef bool (*SetOption_t)(const char* name, int64_t value);
+typedef uint32_t (*DumpAsync_t)();
+typedef bool (*IsDumpFinished_t)(uint32_t id);
+typedef void (*ResetStats_t)();
+
+struct DumpFunctions
+{
+	DumpAsync_t dump_async;
+	IsDumpFinished_t is_dump_finished;
+};
+
+struct Workload
+{
+	uint32_t depth = 6;
+	uint32_t fanout = 4;
+	uint32_t iterations = 20;
+	uint32_t leaf_methods = 0; // Distinct methods of the deepest level, 0 for `fanout` like the other levels
+	std::vector<std::vector<void*>> methods; // methods[level][index]
+
+	// Number of enter/leave pairs in a single walk of the tree
+	uint64_t calls_per_walk() const
+	{
+		uint64_t calls = 0;
+		uint64_t level_size = 1;
+		for (uint32_t i = 0; i < depth; i++)
+		{
+			level_size *= fanout;
+			calls += level_size;
+		}
+		return calls;
+	}
+
+	void create_methods()
+	{
+		for (uint32_t level = 0; level < depth; level++)
+		{
+			std::string class_name = "Level" + std::to_string(level);
+			auto& row = methods.emplace_back();
+			uint32_t count = level == depth - 1 && leaf_methods != 0 ? leaf_methods : fanout;
+			for (uint32_t i = 0; i < count; i++)
+				row.push_back(fake_mono_create_method("Benchmark", class_name.c_str(), ("Method" + std::to_string(i)).c_str(), "Benchmark"));
+		}
+	}
+
+	void walk(uint32_t level) const
+	{
+		if (level == depth)
+			return;
+		const std::vector<void*>& row = methods[level];
+		// The leaf pool is cycled through, every thread starts at the front
+		static thread_local size_t next_leaf = 0;
+		for (uint32_t i = 0; i < fanout; i++)
+		{
+			void* method = row.size() == fanout ? row[i] : row[next_leaf++ % row.size()];
+			fake_mono_enter(method);
+			walk(level + 1);
+			fake_mono_leave(method);
+		}
+	}
+};
+
+struct RunResult
+{
+	double ns_per_call;  // Wall time of the walks divided by the number of calls, averaged over threads
+	int64_t rss_bytes;   // Resident set size while all threads are alive
+	double stall_ms;     // Time until DumpAsync returned with all threads alive, 0 without a profiler
+	double dump_ms;      // Time until the dump was written
+};
+
+static int64_t resident_bytes()
+{
+	FILE* f = std::fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	long pages = 0, resident = 0;
+	if (std::fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	std::fclose(f);
+	return static_cast<int64_t>(resident) * sysconf(_SC_PAGESIZE);
+}
+
+// Runs the walk on `thread_count` threads at once. The threads are kept alive until the
+// memory use and the dump latency have been measured, since their stats go away when they exit.
+// Every thread walks once before the measurement so its tables are already sized, then `reset_stats`
+// (if any) throws those calls away.
+static RunResult run(const Workload& workload, uint32_t thread_count, const DumpFunctions* dump, ResetStats_t reset_stats)
+{
+	std::barrier warmed_up(thread_count + 1);
+	std::barrier start(thread_count + 1);
+	std::barrier finished(thread_count + 1);
+	std::barrier measured(thread_count + 1);
+	std::vector<double> elapsed(thread_count);
+
+	std::vector<std::thread> threads;
+	for (uint32_t i = 0; i < thread_count; i++)
+	{
+		threads.emplace_back([&, i] {
+			workload.walk(0);
+			warmed_up.arrive_and_wait();
+			start.arrive_and_wait();
+			auto begin = std::chrono::steady_clock::now();
+			for (uint32_t it = 0; it < workload.iterations; it++)
+				workload.walk(0);
+			elapsed[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+			finished.arrive_and_wait();
+			measured.arrive_and_wait();
+		});
+	}
+
+	warmed_up.arrive_and_wait();
+	if (reset_stats)
+		reset_stats();
+	start.arrive_and_wait();
+	finished.arrive_and_wait();
+
+	RunResult result{};
+	result.rss_bytes = resident_bytes();
+	if (dump)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		uint32_t id = dump->dump_async();
+		result.stall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		while (!dump->is_dump_finished(id))
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		result.dump_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	}
+	measured.arrive_and_wait();
+
+	for (auto& thread : threads)
+		thread.join();
+
+	double calls = static_cast<double>(workload.calls_per_walk()) * workload.iterations;
+	for (double ns : elapsed)
+		result.ns_per_call += ns / calls / thread_count;
+	return result;
+}
+
+static bool parse_uint(std::string_view text, uint32_t& out)
+{
+	auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+	return ec == std::errc() && end == text.data() + text.size() && out > 0;
+}
+
+static std::string default_profiler_path(const char* argv0)
+{
+	std::string path = argv0;
+	size_t slash = path.find_last_of('/');
+	path = slash == std::string::npos ? "./" : path.substr(0, slash + 1);
+	return path + (sizeof(void*) == 8 ? "MonoProfiler64.so" : "MonoProfiler32.so");
+}
+
+// Average cost of ProfilerClock::now() with the current source
+static double ns_per_clock_read()
+{
+	constexpr uint32_t reads = 10000000;
+	uint64_t sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < reads; i++)
+		sum += ProfilerClock::now();
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	// Keeps the reads from being optimized out
+	if (sum == 1)
+		std::cout << std::endl;
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / reads;
+}
+
+// The profiler calibrates its own copy of ProfilerClock the same way when it's added
+static void measure_clocks(uint32_t drift_seconds)
+{
+	ProfilerClock::calibrate(false);
+	double chrono_ns = ns_per_clock_read();
+	ProfilerClock::calibrate(true);
+	if (ProfilerClock::source != ClockSource::Tsc)
+	{
+		std::printf("Clock read: chrono %.2f ns, no invariant TSC\n", chrono_ns);
+		return;
+	}
+	std::printf("Clock read: chrono %.2f ns, TSC %.2f ns (%.4f ns per tick)\n", chrono_ns, ns_per_clock_read(), ProfilerClock::ns_per_tick);
+
+	auto start_time = std::chrono::steady_clock::now();
+	uint64_t start_ticks = ProfilerClock::now();
+	for (uint32_t i = 1; i <= drift_seconds; i++)
+	{
+		std::this_thread::sleep_until(start_time + std::chrono::seconds(i));
+		int64_t steady_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+		int64_t tsc_ns = ProfilerClock::to_ns(ProfilerClock::now() - start_ticks).count();
+		std::printf("TSC drift after %u s: %+.1f us (%+.1f ppm)\n", i, (tsc_ns - steady_ns) / 1000.0,
+			1e6 * static_cast<double>(tsc_ns - steady_ns) / static_cast<double>(steady_ns));
+	}
+}
+
+static int usage()
+{
+	std::cerr << "Usage: ProfilerBenchmark [--profiler <path>] [--threads 1,2,4,8] [--depth 6] [--fanout 4] [--iterations 20]" << std::endl;
+	std::cerr << "                         [--leaf-methods <count>] [--clock-drift <seconds>] [--option <name>=<value>]..." << std::endl;
+	return 2;
+}
+
+int main(int argc, char** argv)
+{
+	Workload workload;
+	std::string profiler_path = default_profiler_path(argv[0]);
+	std::vector<uint32_t> thread_counts = { 1, 2, 4, 8 };
+	std::vector<std::pair<std::string, int64_t>> options;
+	uint32_t drift_seconds = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (i + 1 >= argc)
+			return usage();
+		std::string_view value = argv[++i];
+
+		bool ok = true;
+		if (arg == "--profiler")
+			profiler_path = value;
+		else if (arg == "--depth")
+			ok = parse_uint(value, workload.depth);
+		else if (arg == "--fanout")
+			ok = parse_uint(value, workload.fanout);
+		else if (arg == "--iterations")
+			ok = parse_uint(value, workload.iterations);
+		else if (arg == "--leaf-methods")
+			ok = parse_uint(value, workload.leaf_methods);
+		else if (arg == "--clock-drift")
+			ok = parse_uint(value, drift_seconds);
+		else if (arg == "--threads")
+		{
+			thread_counts.clear();
+			while (ok && !value.empty())
+			{
+				size_t end = value.find(',');
+				uint32_t count;
+				ok = parse_uint(value.substr(0, end), count);
+				thread_counts.push_back(count);
+				value = end == std::string_view::npos ? std::string_view() : value.substr(end + 1);
+			}
+		}
+		else if (arg == "--option")
+		{
+			size_t eq = value.find('=');
+			int64_t number = 0;
+			ok = eq != std::string_view::npos;
+			if (ok)
+			{
+				auto [end, ec] = std::from_chars(value.data() + eq + 1, value.data() + value.size(), number);
+				ok = ec == std::errc() && end == value.data() + value.size();
+			}
+			if (ok)
+				options.emplace_back(std::string(value.substr(0, eq)), number);
+		}
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			std::cerr << "Invalid argument " << arg << " " << value << std::endl;
+			return usage();
+		}
+	}
+
+	void* profiler = dlopen(profiler_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!profiler)
+	{
+		std::cerr << "Could not load " << profiler_path << ": " << dlerror() << std::endl;
+		return 1;
+	}
+	auto add_profiler = reinterpret_cast<AddProfiler_t>(dlsym(profiler, "AddProfiler"));
+	auto set_option = reinterpret_cast<SetOption_t>(dlsym(profiler, "SetOption"));
+	DumpFunctions dump{
+		reinterpret_cast<DumpAsync_t>(dlsym(profiler, "DumpAsync")),
+		reinterpret_cast<IsDumpFinished_t>(dlsym(profiler, "IsDumpFinished")) };
+	auto reset_stats = reinterpret_cast<ResetStats_t>(dlsym(profiler, "ResetStats"));
+	if (!add_profiler || !set_option || !dump.dump_async || !dump.is_dump_finished || !reset_stats)
+	{
+		std::cerr << profiler_path << " does not export the profiler functions" << std::endl;
+		return 1;
+	}
+
+	for (auto& [name, value] : options)
+	{
+		if (!set_option(name.c_str(), value))
+		{
+			std::cerr << "Unknown option " << name << std::endl;
+			return 1;
+		}
+	}
+
+	measure_clocks(drift_seconds);
+	workload.create_methods();
+	std::cout << workload.calls_per_walk() * workload.iterations << " calls per thread, depth " << workload.depth << ", fanout " << workload.fanout << std::endl;
+
+	// Without a profiler the hooks are not installed yet, so this is the cost of the walk alone
+	uint32_t max_threads = *std::max_element(thread_counts.begin(), thread_counts.end());
+	std::vector<RunResult> baseline(max_threads + 1);
+	for (uint32_t count : thread_counts)
+		baseline[count] = run(workload, count, nullptr, nullptr);
+
+	// The fake runtime exports the mono functions, so they are found without a module handle
+	add_profiler(nullptr);
+	if (!(fake_mono_events() & MONO_PROFILE_ENTER_LEAVE))
+		std::cout << "The profiler did not ask for enter/leave events, per call overhead will be 0" << std::endl;
+
+	std::printf("%8s %14s %14s %12s %12s %18s\n", "Threads", "Baseline ns", "Overhead ns", "Stall ms", "Dump ms", "Memory per thread");
+	for (uint32_t count : thread_counts)
+	{
+		RunResult result = run(workload, count, &dump, reset_stats);
+		RunResult& base = baseline[count];
+		int64_t memory = (result.rss_bytes - base.rss_bytes) / static_cast<int64_t>(count);
+		std::printf("%8u %14.2f %14.2f %12.3f %12.3f %15.1f KB\n", count, base.ns_per_call, result.ns_per_call - base.ns_per_call,
+			result.stall_ms, result.dump_ms, static_cast<double>(memory) / 1024.0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,525 @@
+// TraceConverter.cpp : Converts MonoProfilerTrace.bin to Chrome Trace Event JSON or Perfetto protobuf.
+// Usage: TraceConverter <MonoProfilerTrace.bin> <output.json | output.pftrace>
+//
+// The input is streamed one chunk at a time, so memory use only depends on the number of
+// distinct methods and threads, not on the length of the capture.
+
+#include "../MonoProfiler/trace_format.h"
+
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Buffered binary output, avoids going through ostream formatting for every event
+class OutputBuffer
+{
+public:
+	explicit OutputBuffer(const char* path)
+		: file(path, std::fstream::out | std::fstream::binary | std::fstream::trunc)
+	{
+		buffer.reserve(buffer_size + 4096);
+	}
+
+	~OutputBuffer() { flush(); }
+
+	bool good() const { return file.good(); }
+
+	void write(std::string_view data)
+	{
+		buffer.append(data);
+		if (buffer.size() >= buffer_size)
+			flush();
+	}
+
+	void write(char c) { write(std::string_view(&c, 1)); }
+
+	void write_uint(uint64_t value)
+	{
+		char digits[24];
+		auto result = std::to_chars(digits, digits + sizeof(digits), value);
+		write(std::string_view(digits, result.ptr - digits));
+	}
+
+	void flush()
+	{
+		file.write(buffer.data(), buffer.size());
+		buffer.clear();
+	}
+
+private:
+	static constexpr size_t buffer_size = 1 << 20;
+	std::ofstream file;
+	std::string buffer;
+};
+
+// Track name of a thread in the trace viewer
+static std::string thread_name(uint32_t thread_id)
+{
+	if (thread_id == TRACE_FRAMES_THREAD_ID)
+		return "Frames";
+	return "Thread " + std::to_string(thread_id);
+}
+
+// Output formats only need to know about slices; matching enter and leave events is done by the converter
+class TraceOutput
+{
+public:
+	virtual ~TraceOutput() = default;
+	virtual void add_method(uint32_t id, const std::string& name) = 0;
+	virtual void add_thread(uint32_t thread_id) = 0;
+	virtual void begin(uint32_t thread_id, uint64_t time_ns, uint32_t method_id) = 0;
+	virtual void end(uint32_t thread_id, uint64_t time_ns) = 0;
+	virtual void dropped(uint32_t thread_id, uint64_t time_ns, uint64_t count) = 0;
+	virtual void finish() = 0;
+};
+
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+class ChromeTraceOutput : public TraceOutput
+{
+public:
+	explicit ChromeTraceOutput(OutputBuffer& out)
+		: out(out)
+	{
+		out.write("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	}
+
+	void add_method(uint32_t id, const std::string& name) override
+	{
+		if (names.size() <= id)
+			names.resize(id + 1);
+		names[id] = escape(name);
+	}
+
+	void add_thread(uint32_t thread_id) override
+	{
+		separator();
+		out.write("{\"ph\":\"M\",\"pid\":1,\"tid\":");
+		out.write_uint(thread_id);
+		out.write(",\"name\":\"thread_name\",\"args\":{\"name\":\"");
+		out.write(thread_name(thread_id));
+		out.write("\"}}");
+	}
+
+	void begin(uint32_t thread_id, uint64_t time_ns, uint32_t method_id) override
+	{
+		event_prefix('B', thread_id, time_ns);
+		out.write(",\"name\":\"");
+		out.write(method_id < names.size() ? std::string_view(names[method_id]) : std::string_view("<unknown>"));
+		out.write("\"}");
+	}
+
+	void end(uint32_t thread_id, uint64_t time_ns) override
+	{
+		event_prefix('E', thread_id, time_ns);
+		out.write('}');
+	}
+
+	void dropped(uint32_t thread_id, uint64_t time_ns, uint64_t count) override
+	{
+		event_prefix('i', thread_id, time_ns);
+		out.write(",\"s\":\"t\",\"name\":\"Dropped ");
+		out.write_uint(count);
+		out.write(" events\"}");
+	}
+
+	void finish() override
+	{
+		out.write("\n]}\n");
+	}
+
+private:
+	OutputBuffer& out;
+	std::vector<std::string> names; // Indexed by method id, already escaped
+	bool first = true;
+
+	void separator()
+	{
+		if (!first)
+			out.write(",\n");
+		first = false;
+	}
+
+	void event_prefix(char phase, uint32_t thread_id, uint64_t time_ns)
+	{
+		separator();
+		out.write("{\"ph\":\"");
+		out.write(phase);
+		out.write("\",\"pid\":1,\"tid\":");
+		out.write_uint(thread_id);
+		// Timestamps are in microseconds, keep ns precision as a fraction
+		out.write(",\"ts\":");
+		out.write_uint(time_ns / 1000);
+		char fraction[5] = { '.', static_cast<char>('0' + time_ns / 100 % 10), static_cast<char>('0' + time_ns / 10 % 10), static_cast<char>('0' + time_ns % 10), 0 };
+		out.write(fraction);
+	}
+
+	static std::string escape(const std::string& name)
+	{
+		std::string result;
+		result.reserve(name.size());
+		for (char c : name)
+		{
+			if (c == '"' || c == '\\')
+			{
+				result += '\\';
+				result += c;
+			}
+			else if (static_cast<unsigned char>(c) < 0x20)
+			{
+				char code[8];
+				std::snprintf(code, sizeof(code), "\\u%04x", c);
+				result += code;
+			}
+			else
+			{
+				result += c;
+			}
+		}
+		return result;
+	}
+};
+
+// Writes the protobuf wire format of perfetto.protos.Trace directly, see
+// https://perfetto.dev/docs/reference/trace-packet-proto for the field numbers used below.
+class PerfettoOutput : public TraceOutput
+{
+public:
+	explicit PerfettoOutput(OutputBuffer& out)
+		: out(out)
+	{
+	}
+
+	void add_method(uint32_t id, const std::string& name) override
+	{
+		// InternedData.event_names = 2 { EventName.iid = 1, EventName.name = 2 }
+		std::string event_name;
+		varint_field(event_name, 1, id);
+		bytes_field(event_name, 2, name);
+		std::string interned;
+		bytes_field(interned, 2, event_name);
+
+		std::string packet;
+		bytes_field(packet, 12, interned); // TracePacket.interned_data
+		write_packet(packet);
+	}
+
+	void add_thread(uint32_t thread_id) override
+	{
+		// ThreadDescriptor { pid = 1, tid = 2, thread_name = 5 }
+		std::string thread;
+		varint_field(thread, 1, 1);
+		varint_field(thread, 2, thread_id);
+		bytes_field(thread, 5, thread_name(thread_id));
+		// TrackDescriptor { uuid = 1, thread = 4 }
+		std::string track;
+		varint_field(track, 1, track_uuid(thread_id));
+		bytes_field(track, 4, thread);
+
+		std::string packet;
+		bytes_field(packet, 60, track); // TracePacket.track_descriptor
+		write_packet(packet);
+	}
+
+	void begin(uint32_t thread_id, uint64_t time_ns, uint32_t method_id) override
+	{
+		std::string event;
+		varint_field(event, 9, 1); // type = TYPE_SLICE_BEGIN
+		varint_field(event, 10, method_id); // name_iid
+		varint_field(event, 11, track_uuid(thread_id));
+		write_event(time_ns, event);
+	}
+
+	void end(uint32_t thread_id, uint64_t time_ns) override
+	{
+		std::string event;
+		varint_field(event, 9, 2); // type = TYPE_SLICE_END
+		varint_field(event, 11, track_uuid(thread_id));
+		write_event(time_ns, event);
+	}
+
+	void dropped(uint32_t thread_id, uint64_t time_ns, uint64_t count) override
+	{
+		std::string event;
+		varint_field(event, 9, 3); // type = TYPE_INSTANT
+		varint_field(event, 11, track_uuid(thread_id));
+		bytes_field(event, 23, "Dropped " + std::to_string(count) + " events"); // name
+		write_event(time_ns, event);
+	}
+
+	void finish() override {}
+
+private:
+	static constexpr uint32_t sequence_id = 1;
+	static constexpr uint32_t SEQ_INCREMENTAL_STATE_CLEARED = 1;
+	static constexpr uint32_t SEQ_NEEDS_INCREMENTAL_STATE = 2;
+
+	OutputBuffer& out;
+	bool first_packet = true;
+
+	static uint64_t track_uuid(uint32_t thread_id) { return 0x4d50000000000000ull | thread_id; }
+
+	static void varint(std::string& buffer, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			buffer += static_cast<char>((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+		buffer += static_cast<char>(value);
+	}
+
+	static void varint_field(std::string& buffer, uint32_t field, uint64_t value)
+	{
+		varint(buffer, (static_cast<uint64_t>(field) << 3) | 0);
+		varint(buffer, value);
+	}
+
+	static void bytes_field(std::string& buffer, uint32_t field, std::string_view value)
+	{
+		varint(buffer, (static_cast<uint64_t>(field) << 3) | 2);
+		varint(buffer, value.size());
+		buffer.append(value);
+	}
+
+	void write_event(uint64_t time_ns, const std::string& event)
+	{
+		std::string packet;
+		varint_field(packet, 8, time_ns); // TracePacket.timestamp
+		bytes_field(packet, 11, event);    // TracePacket.track_event
+		write_packet(packet);
+	}
+
+	void write_packet(std::string& packet)
+	{
+		varint_field(packet, 10, sequence_id); // trusted_packet_sequence_id
+		// sequence_flags, interned method names are valid for the rest of the trace
+		varint_field(packet, 13, first_packet ? SEQ_INCREMENTAL_STATE_CLEARED : SEQ_NEEDS_INCREMENTAL_STATE);
+		first_packet = false;
+
+		std::string field;
+		bytes_field(field, 1, packet); // Trace.packet
+		out.write(field);
+	}
+};
+
+// Matches enter and leave events per thread. A leave that doesn't match the innermost open
+// slice closes every slice above the matching one (exception unwinding), a leave without any
+// matching enter (its enter was dropped or happened before the capture) is ignored.
+class Converter
+{
+public:
+	Converter(TraceOutput& output, double ns_per_tick)
+		: output(output), ns_per_tick(ns_per_tick)
+	{
+	}
+
+	void events(const TraceEventsHeader& header, const TraceEvent* events)
+	{
+		ThreadState& thread = get_thread(header.thread_id);
+
+		if (header.dropped > 0)
+		{
+			dropped_total += header.dropped;
+			uint64_t time = header.count > 0 ? to_ns(events[0].ticks) : thread.last_time;
+			output.dropped(header.thread_id, time, header.dropped);
+		}
+
+		for (uint32_t i = 0; i < header.count; i++)
+		{
+			const TraceEvent& event = events[i];
+			uint64_t time = to_ns(event.ticks);
+			thread.last_time = time;
+			uint32_t method_id = event.method_id & ~TRACE_LEAVE_FLAG;
+
+			if ((event.method_id & TRACE_LEAVE_FLAG) == 0)
+			{
+				thread.stack.push_back(method_id);
+				output.begin(header.thread_id, time, method_id);
+				event_count++;
+				continue;
+			}
+
+			size_t depth = thread.stack.size();
+			while (depth > 0 && thread.stack[depth - 1] != method_id)
+				depth--;
+			if (depth == 0)
+			{
+				unmatched++;
+				continue;
+			}
+			while (thread.stack.size() >= depth)
+			{
+				thread.stack.pop_back();
+				output.end(header.thread_id, time);
+			}
+		}
+	}
+
+	void finish()
+	{
+		// Close whatever was still running when the capture ended
+		for (auto& [thread_id, thread] : threads)
+		{
+			while (!thread.stack.empty())
+			{
+				thread.stack.pop_back();
+				output.end(thread_id, thread.last_time);
+			}
+		}
+		output.finish();
+	}
+
+	uint64_t event_count = 0;
+	uint64_t dropped_total = 0;
+	uint64_t unmatched = 0;
+
+private:
+	struct ThreadState
+	{
+		std::vector<uint32_t> stack;
+		uint64_t last_time = 0;
+	};
+
+	TraceOutput& output;
+	const double ns_per_tick;
+	std::unordered_map<uint32_t, ThreadState> threads;
+
+	uint64_t to_ns(uint64_t ticks) const { return static_cast<uint64_t>(ticks * ns_per_tick); }
+
+	ThreadState& get_thread(uint32_t thread_id)
+	{
+		auto it = threads.find(thread_id);
+		if (it == threads.end())
+		{
+			it = threads.emplace(thread_id, ThreadState{}).first;
+			output.add_thread(thread_id);
+		}
+		return it->second;
+	}
+};
+
+static bool ends_with(std::string_view str, std::string_view suffix)
+{
+	return str.size() >= suffix.size() && str.substr(str.size() - suffix.size()) == suffix;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc != 3)
+	{
+		std::cerr << "Usage: TraceConverter <MonoProfilerTrace.bin> <output.json | output.pftrace>" << std::endl;
+		std::cerr << "Output format is picked from the extension, .json for Chrome Trace Event format, anything else for Perfetto." << std::endl;
+		return 2;
+	}
+
+	std::ifstream in(argv[1], std::fstream::in | std::fstream::binary);
+	if (!in)
+	{
+		std::cerr << "Could not open " << argv[1] << std::endl;
+		return 1;
+	}
+
+	TraceFileHeader header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+	{
+		std::cerr << argv[1] << " is not a MonoProfiler trace" << std::endl;
+		return 1;
+	}
+	if (header.version != TRACE_VERSION)
+	{
+		std::cerr << "Unsupported trace version " << header.version << std::endl;
+		return 1;
+	}
+
+	OutputBuffer out(argv[2]);
+	if (!out.good())
+	{
+		std::cerr << "Could not open " << argv[2] << " for writing" << std::endl;
+		return 1;
+	}
+
+	std::unique_ptr<TraceOutput> output;
+	if (ends_with(argv[2], ".json"))
+		output = std::make_unique<ChromeTraceOutput>(out);
+	else
+		output = std::make_unique<PerfettoOutput>(out);
+
+	// Chunk sizes are checked against what's left of the file, so a corrupt size can't make us allocate gigabytes
+	in.seekg(0, std::ios::end);
+	uint64_t file_size = static_cast<uint64_t>(in.tellg());
+	in.seekg(sizeof(header));
+
+	Converter converter(*output, header.ns_per_tick);
+	std::vector<char> payload;
+	TraceChunkHeader chunk;
+	bool malformed = false;
+	while (!malformed && in.read(reinterpret_cast<char*>(&chunk), sizeof(chunk)))
+	{
+		uint64_t position = static_cast<uint64_t>(in.tellg());
+		if (chunk.size > file_size - position)
+		{
+			std::cerr << "Trace is truncated, the game was probably closed while it was being written" << std::endl;
+			break;
+		}
+		payload.resize(chunk.size);
+		if (!in.read(payload.data(), chunk.size))
+		{
+			std::cerr << "Trace is truncated, the game was probably closed while it was being written" << std::endl;
+			break;
+		}
+
+		size_t offset = 0;
+		auto read = [&](void* out, size_t size) {
+			if (size > payload.size() - offset)
+				return false;
+			std::memcpy(out, payload.data() + offset, size);
+			offset += size;
+			return true;
+		};
+
+		bool ok = true;
+		if (chunk.type == TraceChunkType::MethodNames)
+		{
+			uint32_t count = 0;
+			ok = read(&count, sizeof(count));
+			for (uint32_t i = 0; ok && i < count; i++)
+			{
+				uint32_t id, length;
+				ok = read(&id, sizeof(id)) && read(&length, sizeof(length)) && length <= payload.size() - offset;
+				if (ok)
+				{
+					output->add_method(id, std::string(payload.data() + offset, length));
+					offset += length;
+				}
+			}
+		}
+		else if (chunk.type == TraceChunkType::Events)
+		{
+			TraceEventsHeader events_header;
+			ok = read(&events_header, sizeof(events_header)) &&
+				events_header.count <= (payload.size() - offset) / sizeof(TraceEvent);
+			if (ok)
+				converter.events(events_header, reinterpret_cast<const TraceEvent*>(payload.data() + offset));
+		}
+		if (!ok)
+		{
+			std::cerr << "Malformed chunk at offset " << position - sizeof(chunk) << ", the rest of the trace is skipped" << std::endl;
+			malformed = true;
+		}
+	}
+	converter.finish();
+
+	std::cerr << "Converted " << converter.event_count << " calls" << std::endl;
+	if (converter.dropped_total > 0)
+		std::cerr << converter.dropped_total << " events were lost during capture because of full buffers" << std::endl;
+	if (converter.unmatched > 0)
+		std::cerr << converter.unmatched << " leave events had no matching enter and were skipped" << std::endl;
+	return malformed ? 1 : 0;
+}